@@ -0,0 +1,44 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "matrix.h"
+
+// handle to a task running on the worker pool
+typedef struct MatTask MatTask;
+
+// start the persistent worker pool with n_threads workers (0 uses the number of online cores). if you never call this, the pool is started with the default size on the first async call.
+// if only some of the threads can be started the pool runs with those, UTIL_ERROR_THREAD is returned if none could.
+UtilStatus mat_async_init(const size_t n_threads);
+
+// wait for every submitted task to finish and stop the worker pool. task handles you haven't freed yet are still valid (and done) afterwards.
+void mat_async_free(void);
+
+// run task_func(argv) on the worker pool once all tasks in deps have finished. deps can be NULL if n_deps is 0.
+// this is how you chain dependent operations into a small task graph: independent tasks overlap across cores, dependent ones wait for their inputs.
+// the task runs under a copy of the submitting thread's context (allocator, thread count, tuning - which must stay alive until it's done),
+// with its own generator seeded from the submitter's, so the same submissions from the same seed always draw the same numbers.
+// the returned handle must be released with mat_task_free. returns NULL if the task couldn't be created.
+MatTask* mat_async_submit(void (*task_func)(void* argv), void* argv, MatTask** deps, const size_t n_deps);
+
+// asynchronous version of mat_multiply_inplace - target must be pre-allocated and must not be touched until the task is done. mat1 and mat2 may be the targets of tasks in deps.
+MatTask* mat_multiply_async(const Matrix* mat1, const Matrix* mat2, Matrix** target, MatTask** deps, const size_t n_deps);
+
+// asynchronous version of mat_sort - mat must not be touched until the task is done
+MatTask* mat_sort_async(Matrix** mat, const size_t c, const bool ascending, MatTask** deps, const size_t n_deps);
+
+// return true if the task has finished, without blocking
+bool mat_task_poll(MatTask* task);
+
+// block the calling thread until the task has finished. NOTE: don't call this from inside a task, pass the task as a dependency instead.
+void mat_task_wait(MatTask* task);
+
+// block until the task has finished and return the status of the wrapped operation (always UTIL_OK for tasks from mat_async_submit).
+// errors raised on the worker thread only show up here, not in util_last_error of the submitting thread.
+UtilStatus mat_task_status(MatTask* task);
+
+// release the task handle. if the task hasn't finished yet, this waits for it first.
+void mat_task_free(MatTask** task);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef LAZY_H
+#define LAZY_H
+
+#include <stddef.h>
+#include "matrix.h"
+
+// deferred-evaluation mode: instead of materializing every intermediate result, the mat_lazy_* calls record
+// the operations as a DAG which is only computed when you call mat_lazy_eval or mat_lazy_sum.
+// on evaluation, a multiply runs on the regular gemm kernel: transposes are folded into its transpose flags and
+// chains of element-wise operations / applies (and a final sum) become its epilogue, applied to every output tile
+// while it's still in cache. the intermediates which do need materializing share a pool of reusable buffers.
+
+// owns every node recorded on it as well as the intermediate buffers
+typedef struct MatGraph MatGraph;
+
+// a (not yet computed) matrix in the graph
+typedef struct MatNode MatNode;
+
+// initialize an empty graph. the graph, its nodes and buffers are allocated through the calling thread's context allocator
+// (see util.h), so build, evaluate and free it under the same allocator.
+UtilStatus mat_graph_init(MatGraph** graph);
+
+// free the graph, all of its nodes and buffers. the matrices wrapped with mat_lazy are NOT free'd.
+void mat_graph_free(MatGraph** graph);
+
+// NOTE: the mat_lazy_* builders return NULL if they fail (dimension mismatch, nodes from different graphs or out of memory)
+// and accept NULL input nodes, in which case they just return NULL again - so you only need to check the node you finally
+// evaluate, which raises UTIL_ERROR_ARGUMENT if it's NULL.
+
+// wrap an existing matrix as a graph input. the matrix must stay alive (and unchanged) until evaluation.
+// raises UTIL_ERROR_ARGUMENT (and returns NULL) if graph or mat is NULL.
+MatNode* mat_lazy(MatGraph* graph, const Matrix* mat);
+
+// record a transpose
+MatNode* mat_lazy_transpose(MatNode* node);
+
+// record a multiplication node1 x node2
+MatNode* mat_lazy_multiply(MatNode* node1, MatNode* node2);
+
+// record an element-wise operation between two nodes (dimensions must match exactly)
+MatNode* mat_lazy_add_e(MatNode* target, MatNode* node);
+MatNode* mat_lazy_subtract_e(MatNode* target, MatNode* node);
+MatNode* mat_lazy_multiply_e(MatNode* target, MatNode* node);
+MatNode* mat_lazy_divide_e(MatNode* target, MatNode* node);
+
+// record an element-wise operation with a scalar
+MatNode* mat_lazy_add_s(MatNode* node, const float value);
+MatNode* mat_lazy_subtract_s(MatNode* node, const float value);
+MatNode* mat_lazy_multiply_s(MatNode* node, const float value);
+MatNode* mat_lazy_divide_s(MatNode* node, const float value);
+
+// record applying a function to each element (same semantics as mat_apply). argv must stay alive until evaluation.
+MatNode* mat_lazy_apply(MatNode* node, float (*apply_func)(float x, float* argv), float* argv);
+
+// return the number of rows / columns the node will have once evaluated
+size_t mat_lazy_rows(const MatNode* node);
+size_t mat_lazy_columns(const MatNode* node);
+
+// evaluate the node and return the result as a new matrix (NULL on failure) - don't forget to free it
+Matrix* mat_lazy_eval(MatNode* node);
+
+// evaluate the node and store the result into target (assumes it's pre-allocated with matching dimensions)
+UtilStatus mat_lazy_eval_inplace(MatNode* node, Matrix** target);
+
+// evaluate the sum of all elements in the node (NAN on failure). element-wise chains are summed as they are computed;
+// a multiply's product goes through one pooled scratch buffer, reduced tile by tile right after the kernel computes it
+float mat_lazy_sum(MatNode* node);
+
+#endif
@@ -5,29 +5,146 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include "util.h"
 
 typedef struct Matrix
 {
 	float* data;
 	size_t n_rows;
 	size_t n_columns;
+	size_t capacity; // number of floats data has room for, >= n_rows * n_columns (larger after mat_reserve_rows / mat_append_rows)
 } Matrix;
 
 // forward declaration
 typedef struct Vector Vector;
 
-// initialize matrix with n_rows and n_columns
-void mat_init(Matrix** mat, const size_t n_rows, const size_t n_columns);
+// optional work done on each output tile of mat_gemm while it's still in cache, in this order: add bias, apply activation, multiply by scale, call tile.
+// start from MAT_EPILOGUE_INIT, which skips all of them, and set the members you need.
+typedef struct MatEpilogue
+{
+	const Vector* bias; // added to every row - length must match the target's column size
+	float (*activation)(float x, float* argv); // same semantics as mat_apply
+	float* activation_argv;
+	float scale; // every output is multiplied by it (skipped when it's 1)
+	// for anything that depends on the position, e.g., element-wise operations with another matrix: tile points to element
+	// (row, column) of the target, the tile is (n_rows, n_columns) and ld is the target's row stride. the parallel variants
+	// call this from several threads at once, each on its own tiles.
+	void (*tile)(float* tile, const size_t row, const size_t column, const size_t n_rows, const size_t n_columns, const size_t ld, void* argv);
+	void* tile_argv;
+} MatEpilogue;
+
+// an epilogue which does nothing: no bias, activation or tile callback and a scale of 1
+#define MAT_EPILOGUE_INIT { NULL, NULL, NULL, 1.0f, NULL, NULL }
+
+// distance between two rows, see mat_pairwise_distances
+typedef enum MatMetric
+{
+	MAT_METRIC_EUCLIDEAN,
+	MAT_METRIC_SQUARED_EUCLIDEAN, // same ordering as euclidean without the square roots
+	MAT_METRIC_COSINE // 1 - cosine similarity, rows of zeros are at distance 1 from everything
+} MatMetric;
+
+// per-group aggregate, see mat_groupby_agg
+typedef enum MatAggOp
+{
+	MAT_AGG_SUM,
+	MAT_AGG_COUNT, // number of rows in the group (the column is ignored)
+	MAT_AGG_MEAN,
+	MAT_AGG_MIN,
+	MAT_AGG_MAX
+} MatAggOp;
+
+typedef struct MatAgg
+{
+	size_t column;
+	MatAggOp op;
+} MatAgg;
+
+// payload encoding of mat_write
+typedef enum MatCodec
+{
+	MAT_CODEC_RAW, // the floats as they are in memory
+	MAT_CODEC_SHUFFLE_RLE // byte planes of the floats, run-length encoded. good for sparse or low-entropy data, never more than ~1% larger than raw
+} MatCodec;
+
+// how mat_conv2d computes the outputs
+typedef enum MatConvAlgorithm
+{
+	MAT_CONV_AUTO, // direct for 3x3 kernels, im2col otherwise
+	MAT_CONV_IM2COL, // lower the receptive fields into the workspace and run the multiply kernel on them
+	MAT_CONV_DIRECT // accumulate straight from the input, no workspace needed
+} MatConvAlgorithm;
+
+// shape of a 2D convolution, see mat_conv2d
+typedef struct MatConv2d
+{
+	size_t height; // input image height
+	size_t width; // input image width
+	size_t kernel_height;
+	size_t kernel_width;
+	size_t stride; // same in both directions, must be >= 1
+	size_t padding; // zeros added on every side of the input
+	MatConvAlgorithm algorithm;
+} MatConv2d;
+
+// largest block size mat_set_tuning / mat_tuning_load accept. the multiply packs a gemm_block_k * gemm_block_columns panel
+// per thread, so anything beyond this is far past any cache and only a way to run out of memory
+#define MAT_TUNING_MAX_BLOCK 1024
+
+// parameters of the multiply / transpose kernels. these depend on the host's caches and core count, see mat_autotune.
+typedef struct MatTuning
+{
+	size_t gemm_block_rows; // output rows computed per block
+	size_t gemm_block_columns; // output columns computed per block
+	size_t gemm_block_k; // inner dimension per block
+	size_t transpose_block; // side of the square tiles used by transpose
+	size_t strassen_cutoff; // see mat_set_strassen_cutoff (0 = disabled, otherwise at least 2)
+	size_t parallel_threshold; // minimum number of output elements before the parallel variants actually use multiple threads
+} MatTuning;
+
+// fill tuning with defaults derived from the host's L1/L2 cache sizes (read from sysfs, falling back to common sizes if they're unavailable)
+void mat_tuning_defaults(MatTuning* tuning);
+
+// load tuning parameters from a profile written by mat_tuning_save. keys missing from the file are left untouched.
+// if path is NULL, the CMATRIX_TUNING_PROFILE environment variable is used, then ~/.cmatrix_tuning. returns false if no profile could be read
+// or if any value in it is out of range (a block size of 0 or above MAT_TUNING_MAX_BLOCK, a Strassen cutoff of 1), in which case tuning is left untouched.
+// NOTE: the matrix functions do this automatically on first use, you only need it to load a profile from somewhere else (then pass it to mat_set_tuning).
+bool mat_tuning_load(const char* path, MatTuning* tuning);
+
+// save tuning parameters to a small text profile (path NULL behaves like in mat_tuning_load). returns false if the file couldn't be written.
+bool mat_tuning_save(const char* path, const MatTuning* tuning);
+
+// benchmark candidate parameters on this host and store the fastest ones into tuning (which also becomes the active tuning). this takes a few seconds.
+// the candidates are only ever installed for the calling thread while they're measured, so other threads keep multiplying with the current parameters.
+// the Strassen-Winograd cutoff is only tuned if tuning->strassen_cutoff is non-zero on input, since enabling it changes the results slightly.
+// if the benchmark matrices can't be allocated, UTIL_ERROR_ALLOCATION is returned and neither tuning nor the active parameters change.
+UtilStatus mat_autotune(MatTuning* tuning);
+
+// get the parameters currently used by the kernels
+void mat_get_tuning(MatTuning* tuning);
 
-// reshape matrix to new dimensions (does not touch original data, i.e., does not reset everything to 0)
-void mat_reshape(Matrix** mat, const size_t r, const size_t c);
+// replace the process-wide parameters used by the kernels (threads with a UtilContext.tuning use that instead). returns UTIL_ERROR_ARGUMENT (and keeps the current ones)
+// if any block size is 0 or above MAT_TUNING_MAX_BLOCK, or the Strassen cutoff is 1.
+UtilStatus mat_set_tuning(const MatTuning* tuning);
+
+// NOTE: functions returning a new Matrix* / Vector* return NULL if they fail (see util_last_error in util.h),
+// functions returning UtilStatus leave their target untouched on failure.
+
+// initialize matrix with n_rows and n_columns. on failure *mat is set to NULL and nothing is left allocated.
+UtilStatus mat_init(Matrix** mat, const size_t n_rows, const size_t n_columns);
+
+// reshape matrix to new dimensions (does not touch original data, i.e., does not reset everything to 0). on failure the matrix is left unchanged.
+UtilStatus mat_reshape(Matrix** mat, const size_t r, const size_t c);
 
 // create matrix from C-style 2D array (must cast to float pointer)
 Matrix* mat_create(const float* data, const size_t n_rows, const size_t n_colums);
 
-// generate random values for matrix
+// generate random values for matrix, drawn from the calling thread's context generator (see util_get_context)
 void mat_random(Matrix** mat, const float lower_bound, const float upper_bound);
 
+// same as mat_random but with an explicit generator, e.g. for reproducible results
+void mat_random_r(Matrix** mat, const float lower_bound, const float upper_bound, UtilRng* rng);
+
 // fill matrix with a value
 void mat_fill(Matrix** mat, const float value);
 
@@ -62,7 +179,33 @@ Matrix* mat_multiply(const Matrix* mat1, const Matrix* mat2);
 Matrix* mat_multiply_parallel(const Matrix* mat1, const Matrix* mat2);
 
 // multiply two matrices and store the result into target (assumes it's pre-allocated). you can use this version if you are worried about heap fragmentation (i.e., if you are doing an absurd amount of multiplications).
-void mat_multiply_inplace(const Matrix* mat1, const Matrix* mat2, Matrix** target);
+UtilStatus mat_multiply_inplace(const Matrix* mat1, const Matrix* mat2, Matrix** target);
+
+// same as mat_multiply_inplace but skips the dimension checks - for hot loops where the shapes are already known to match
+UtilStatus mat_multiply_inplace_unchecked(const Matrix* mat1, const Matrix* mat2, Matrix** target);
+
+// multiply two matrices and store the result into target (assumes it's pre-allocated) using OpenMP for multiple threads.
+UtilStatus mat_multiply_inplace_parallel(const Matrix* mat1, const Matrix* mat2, Matrix** target);
+
+// BLAS-style general multiply: target = alpha * op(mat1) x op(mat2) + beta * target, where op() transposes its argument if trans1/trans2 is set.
+// transposed operands are read in place (no mat_transpose needed) and if beta is 0 the previous contents of target are ignored.
+// epilogue can be NULL, otherwise it's applied to each output tile right after it's computed (e.g., bias + ReLU in the same pass).
+UtilStatus mat_gemm(const bool trans1, const bool trans2, const float alpha, const Matrix* mat1, const Matrix* mat2, const float beta, Matrix** target, const MatEpilogue* epilogue);
+
+// same as mat_gemm but skips the dimension checks
+UtilStatus mat_gemm_unchecked(const bool trans1, const bool trans2, const float alpha, const Matrix* mat1, const Matrix* mat2, const float beta, Matrix** target, const MatEpilogue* epilogue);
+
+// same as mat_gemm but using OpenMP for multiple threads
+UtilStatus mat_gemm_parallel(const bool trans1, const bool trans2, const float alpha, const Matrix* mat1, const Matrix* mat2, const float beta, Matrix** target, const MatEpilogue* epilogue);
+
+// enable the Strassen-Winograd path in mat_multiply / mat_multiply_inplace (and their parallel versions) for products whose dimensions are all larger than cutoff. each level of the recursion splits the matrices in half until a dimension drops to the cutoff (or becomes odd), where the regular kernel takes over. pass 0 to disable it (the default).
+// NOTE: this trades some floating point accuracy for fewer FLOPs, so it's mainly worth it for very large square products. mat_gemm never uses it.
+// the seven sub-products of a level run one after the other (see __strassen for why); in the parallel versions each of them is computed with all threads instead.
+// this sets the process-wide cutoff (like mat_set_tuning); threads whose context has its own tuning keep using that one's. raises UTIL_ERROR_ARGUMENT for a cutoff of 1.
+UtilStatus mat_set_strassen_cutoff(const size_t cutoff);
+
+// return the process-wide Strassen-Winograd cutoff (0 means disabled), i.e. the one mat_set_strassen_cutoff sets
+size_t mat_get_strassen_cutoff(void);
 
 // apply function to each element in matrix inplace using function pointer. function pointer uses argv if user needs to pass any additional parameters to the apply function, otherwise can pass NULL. value returned from function will be set in the matrix's cell.
 void mat_apply(Matrix** mat, float (*apply_func)(float x, float* argv), float* argv);
@@ -76,6 +219,9 @@ void mat_add_s(Matrix** mat, const float value);
 // subtract scalar from each element inplace
 void mat_subtract_s(Matrix** mat, const float value);
 
+// old spelling of mat_subtract_s, which is what the library used to export. kept so existing code still links, use mat_subtract_s instead
+void mat_substract_s(Matrix** mat, const float value) __attribute__((deprecated("use mat_subtract_s")));
+
 // multiply scalar to each element inplace
 void mat_multiply_s(Matrix** mat, const float value);
 
@@ -83,16 +229,21 @@ void mat_multiply_s(Matrix** mat, const float value);
 void mat_divide_s(Matrix** mat, const float value);
 
 // add matrices target + mat element-wise - target will be modified inplace. NOTE: dimensions must be exact
-void mat_add_e(Matrix** target, const Matrix* mat);
+// (the _unchecked versions of the element-wise operations skip that check)
+UtilStatus mat_add_e(Matrix** target, const Matrix* mat);
+void mat_add_e_unchecked(Matrix** target, const Matrix* mat);
 
 // subtract matrices target - mat element-wise - target will be modified inplace. NOTE: dimensions must be exact
-void mat_subtract_e(Matrix** target, const Matrix* mat);
+UtilStatus mat_subtract_e(Matrix** target, const Matrix* mat);
+void mat_subtract_e_unchecked(Matrix** target, const Matrix* mat);
 
 // multiply matrices target * mat element-wise - target will be modified inplace. NOTE: dimensions must be exact
-void mat_multiply_e(Matrix** target, const Matrix* mat);
+UtilStatus mat_multiply_e(Matrix** target, const Matrix* mat);
+void mat_multiply_e_unchecked(Matrix** target, const Matrix* mat);
 
 // divide matrices target / mat element-wise - target will be modified inplace. NOTE: dimensions must be exact
-void mat_divide_e(Matrix** target, const Matrix* mat);
+UtilStatus mat_divide_e(Matrix** target, const Matrix* mat);
+void mat_divide_e_unchecked(Matrix** target, const Matrix* mat);
 
 // copy contents from mat into target
 Matrix* mat_copy(const Matrix* mat);
@@ -109,6 +260,9 @@ float mat_mean(const Matrix* mat);
 // randomly sample rows with or without replacement. optionally store the incides sampled into sampled_indices (e.g., for paired sampling) - sampled_indices must be of length n_samples and is assumed to be pre-allocated. user can pass NULL if they don't need the sampled indices.
 Matrix* mat_sample(const Matrix* mat, const size_t n_samples, bool with_replacement, size_t* sampled_indices);
 
+// same as mat_sample but with an explicit generator
+Matrix* mat_sample_r(const Matrix* mat, const size_t n_samples, bool with_replacement, size_t* sampled_indices, UtilRng* rng);
+
 // free memory allocated by matrix
 void mat_free(Matrix** mat);
 
@@ -116,8 +270,10 @@ void mat_free(Matrix** mat);
 // Second parameter is a pointer to any additional values you want to pass to predicate
 // (via array). If no additional values, you can pass NULL. This will return a newly-allocate matrix
 // with the filtered rows and also store the filtered indices into filtered_idx. WARNING: filtered_idx
-// will be free'd and reallocated based on the # of rows that match predicate. It's advised to pass
-// a NULL pointer to filtered_idx and free it manually when you're done
+// will be free'd (with util_free) and reallocated based on the # of rows that match predicate. It's advised to pass
+// a NULL pointer to filtered_idx. the array comes from the calling thread's context allocator, like the matrix, so it
+// must be released with util_free under the same allocator when you're done - not with free(), which breaks as soon
+// as a custom allocator is installed
 Matrix* mat_filter(const Matrix* mat, bool (*predicate)(const Vector*, float*), float* predicate_args, size_t** filtered_idx);
 
 // a variation of mat_subset where you specify the exact indices to sample from.
@@ -127,7 +283,100 @@ Matrix* mat_filter(const Matrix* mat, bool (*predicate)(const Vector*, float*),
 // (i.e., filtering two matrices at the same time)
 Matrix* mat_subset_idx(const Matrix* mat, const size_t* sample_idx, const size_t n_samples);
 
+// copy row idx[i] of mat into row i of target (pre-allocated as (n_idx, mat->n_columns)). rows are copied whole, not cell by cell.
+UtilStatus mat_gather_rows(const Matrix* mat, const size_t* idx, const size_t n_idx, Matrix** target);
+
+// the inverse of mat_gather_rows: copy row i of mat into row idx[i] of target (mat->n_rows indices, same column count).
+// if an index repeats, the last row copied there wins.
+UtilStatus mat_scatter_rows(const Matrix* mat, const size_t* idx, Matrix** target);
+
 // Sort matrix inplace in column c
 void mat_sort(Matrix** mat, size_t c, bool ascending);
 
+// concatenate n_mats matrices side by side and return the result as a new matrix. all of them must have the same row count.
+Matrix* mat_hstack(const Matrix* const* mats, const size_t n_mats);
+
+// concatenate n_mats matrices on top of each other and return the result as a new matrix. all of them must have the same column count.
+Matrix* mat_vstack(const Matrix* const* mats, const size_t n_mats);
+
+// unlike C++, C doesn't convert a Matrix** to a const Matrix* const* implicitly, so these let a plain Matrix* array through
+// as well without a cast at every call site
+#define mat_hstack(mats, n_mats) mat_hstack((const Matrix* const*)(mats), (n_mats))
+#define mat_vstack(mats, n_mats) mat_vstack((const Matrix* const*)(mats), (n_mats))
+
+// make room for at least n_rows rows in total without changing the matrix's dimensions, so the next appends don't reallocate.
+// raises UTIL_ERROR_ARGUMENT if that many rows can't be addressed
+UtilStatus mat_reserve_rows(Matrix** mat, const size_t n_rows);
+
+// append n_rows rows to the bottom of mat. rows points to n_rows * mat->n_columns floats in row-major order (e.g., another matrix's data).
+// the capacity grows geometrically, so appending a stream of rows one at a time costs amortized O(1) per row.
+// raises UTIL_ERROR_ARGUMENT if the total number of elements would overflow.
+// NOTE: the data may be moved, don't keep pointers into mat->data across appends (rows can't point into mat either).
+UtilStatus mat_append_rows(Matrix** mat, const float* rows, const size_t n_rows);
+
+// release the spare capacity left over from appending (an empty matrix gives back its whole buffer)
+UtilStatus mat_shrink_to_fit(Matrix** mat);
+
+// return a new (a->n_rows, b->n_rows) matrix with the distance between every row of a and every row of b (column counts must match).
+// the dot products come from the gemm kernel (||a - b||^2 = ||a||^2 + ||b||^2 - 2 a.b) instead of a pair of loops over rows.
+Matrix* mat_pairwise_distances(const Matrix* a, const Matrix* b, const MatMetric metric);
+
+// for every row of a, find the k closest rows of b. indices (a->n_rows * k, pre-allocated) receives their row indices in b,
+// closest first, and distances (same size, can be NULL) their distances. the distances are computed tile by tile and only
+// the current k best per row are kept, so the full distance matrix is never materialized.
+UtilStatus mat_knn(const Matrix* a, const Matrix* b, const size_t k, const MatMetric metric, size_t* indices, float* distances);
+
+// write mat to a file descriptor in the binary stream format: a 32-byte header (so a raw payload stays aligned) followed by the data.
+// the floats are stored in the host's byte order, so streams are only portable between hosts of the same endianness.
+UtilStatus mat_write(const Matrix* mat, const MatCodec codec, const int fd);
+
+// same as mat_write, into a memory buffer of size bytes. written (can be NULL) receives the number of bytes used.
+// fails with UTIL_ERROR_ARGUMENT if the buffer is too small - mat_write_bound bytes are always enough.
+UtilStatus mat_write_buffer(const Matrix* mat, const MatCodec codec, void* buffer, const size_t size, size_t* written);
+
+// upper bound of the size of mat's stream with this codec
+size_t mat_write_bound(const Matrix* mat, const MatCodec codec);
+
+// read one matrix written by mat_write from a file descriptor. if *target is NULL a new matrix is allocated, otherwise it must
+// already have the stream's dimensions and the data is read (or decoded) straight into it. a bad header or a dimension mismatch leaves it
+// untouched, but an I/O or codec error halfway through the payload leaves it partially written. exactly the matrix's bytes are consumed,
+// so several matrices can be read back to back from one stream (UTIL_ERROR_FORMAT once it's exhausted). on failure an allocated *target is free'd again.
+UtilStatus mat_read(const int fd, Matrix** target);
+
+// same as mat_read, from a memory buffer of size bytes. consumed (can be NULL) receives the number of bytes the matrix took up.
+UtilStatus mat_read_buffer(const void* buffer, const size_t size, Matrix** target, size_t* consumed);
+
+// 2D convolution (cross-correlation, as in CNNs) of a multi-channel image with a bank of filters, all in channels-last layout:
+// input is (height * width, channels) with pixels in row-major order, filters is (kernel_height * kernel_width * channels, n_filters)
+// with rows ordered by (kernel row, kernel column, channel), and target (pre-allocated) is (out_height * out_width, n_filters),
+// so it can be fed straight into the next convolution. epilogue can be NULL, its bias is per filter.
+// workspace must hold mat_conv2d_workspace_size floats (it can be NULL if that's 0) and is reused instead of allocating on every call.
+// if the multiply kernel fails on a band its status is returned (the target is then only partially written).
+UtilStatus mat_conv2d(const Matrix* input, const Matrix* filters, const MatConv2d* params, float* workspace, Matrix** target, const MatEpilogue* epilogue);
+
+// same as mat_conv2d but using OpenMP for multiple threads, each one taking whole bands of output rows. workspace must hold
+// mat_conv2d_parallel_workspace_size floats. an error raised on one of the threads reaches the error handler there, not in util_last_error of the caller.
+UtilStatus mat_conv2d_parallel(const Matrix* input, const Matrix* filters, const MatConv2d* params, float* workspace, Matrix** target, const MatEpilogue* epilogue);
+
+// output image size of a convolution: (size + 2 * padding - kernel) / stride + 1 in each direction. raises UTIL_ERROR_ARGUMENT
+// for a zero stride or kernel size and UTIL_ERROR_DIMENSION if the kernel is larger than the padded input (height / width are left alone)
+UtilStatus mat_conv2d_output_size(const MatConv2d* params, size_t* height, size_t* width);
+
+// number of floats of workspace mat_conv2d needs for this shape: one band of output rows' receptive fields (0 when it
+// takes the direct path, or for a shape mat_conv2d_output_size rejects)
+size_t mat_conv2d_workspace_size(const MatConv2d* params, const size_t in_channels);
+
+// same for mat_conv2d_parallel: one band for each thread of the calling thread's context (see util.h). ask again after raising its thread count.
+size_t mat_conv2d_parallel_workspace_size(const MatConv2d* params, const size_t in_channels);
+
+// group the rows of mat by the value in column key_col and compute the n_aggs aggregates for every group in a single hash pass.
+// returns a new (n_groups, 1 + n_aggs) matrix: the key in column 0, then aggregate i in column 1 + i, one row per distinct key
+// in the order the keys first appear. 0 and -0 are the same key, as are all NaNs. sums are accumulated in double, and a NaN
+// value makes its group's sum / mean / min / max NaN.
+Matrix* mat_groupby_agg(const Matrix* mat, const size_t key_col, const MatAgg* aggs, const size_t n_aggs);
+
+// same as mat_groupby_agg, but every thread groups its own contiguous slice of the rows into a private table and the tables
+// are merged afterwards (the result is identical, including the group order). with a custom allocator in the context, it must be thread-safe.
+Matrix* mat_groupby_agg_parallel(const Matrix* mat, const size_t key_col, const MatAgg* aggs, const size_t n_aggs);
+
 #endif
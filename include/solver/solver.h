@@ -0,0 +1,84 @@
+#ifndef SOLVER_H
+#define SOLVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "matrix.h"
+
+// matrix-free iterative solvers: they only ever touch A through an operator computing A x and A^T x, so the same
+// code runs on a dense Matrix, a sparse CSR matrix or anything else you can multiply a vector with. all the scratch
+// vectors come from one workspace you can allocate once and reuse, and the vector updates are fused into single
+// passes that accumulate their dot products / norms in double.
+
+// y = A x (transpose false) or y = A^T x (transpose true). x and y never overlap.
+typedef struct MatOperator
+{
+	size_t n_rows;
+	size_t n_columns;
+	void (*apply)(const float* x, float* y, const bool transpose, void* argv);
+	void* argv;
+} MatOperator;
+
+// compressed sparse row view over the caller's arrays: the non-zeros of row r are values[row_ptr[r] .. row_ptr[r + 1])
+// in the columns col_idx[row_ptr[r] .. row_ptr[r + 1]). row_ptr has n_rows + 1 entries.
+typedef struct MatCsr
+{
+	size_t n_rows;
+	size_t n_columns;
+	const size_t* row_ptr;
+	const size_t* col_idx;
+	const float* values;
+} MatCsr;
+
+typedef struct MatSolverOptions
+{
+	size_t max_iterations; // 0 uses the default (n_columns for CG, 2 * n_columns for LSQR)
+	float tolerance; // relative, see mat_cg / mat_lsqr. 0 uses the default (1e-5)
+	float damping; // LSQR only: minimize ||A x - b||^2 + damping^2 ||x||^2 (ridge regression), 0 for plain least squares. must be finite and non-negative
+} MatSolverOptions;
+
+typedef struct MatSolverResult
+{
+	size_t iterations;
+	float residual_norm; // ||b - A x|| (for damped LSQR, including the damping term)
+	bool converged; // false if max_iterations ran out first
+} MatSolverResult;
+
+// operator over a dense matrix (must stay alive while the operator is used). A^T x is computed from the rows
+// as they are, no transpose is materialized.
+MatOperator mat_operator_dense(const Matrix* mat);
+
+// same as mat_operator_dense but using OpenMP for multiple threads
+MatOperator mat_operator_dense_parallel(const Matrix* mat);
+
+// operator over a CSR matrix (the MatCsr and its arrays must stay alive while the operator is used).
+MatOperator mat_operator_csr(const MatCsr* csr);
+
+// same as mat_operator_csr but using OpenMP for multiple threads to compute A x.
+// NOTE: A^T x scatters into y, so it always runs on a single thread.
+MatOperator mat_operator_csr_parallel(const MatCsr* csr);
+
+// number of floats of workspace mat_cg / mat_lsqr need for this operator
+size_t mat_cg_workspace_size(const MatOperator* op);
+size_t mat_lsqr_workspace_size(const MatOperator* op);
+
+// solve A x = b for a symmetric positive definite (square) A with conjugate gradients. x holds the initial guess
+// (e.g., zeros) and receives the solution. stops once ||b - A x|| <= tolerance * ||b||.
+// options and result can be NULL. workspace holds mat_cg_workspace_size floats, or is NULL to allocate it for this call.
+// running out of iterations isn't an error (see result->converged), an A which turns out not to be positive definite is (UTIL_ERROR_ARGUMENT).
+UtilStatus mat_cg(const MatOperator* op, const float* b, float* x, const MatSolverOptions* options, float* workspace, MatSolverResult* result);
+
+// same as mat_cg but the vector updates use OpenMP for multiple threads (pair it with a parallel operator)
+UtilStatus mat_cg_parallel(const MatOperator* op, const float* b, float* x, const MatSolverOptions* options, float* workspace, MatSolverResult* result);
+
+// solve the least-squares problem min ||A x - b|| (A is (n_rows, n_columns), b has n_rows elements) with LSQR, which
+// is mathematically CG on the normal equations but never forms A^T A, so it stays stable for ill-conditioned A.
+// x holds the initial guess and receives the solution. stops once ||r|| <= tolerance * (||b|| + ||A|| ||x||) (consistent
+// systems) or ||A^T r|| <= tolerance * ||A|| ||r|| (inconsistent ones), with ||A|| estimated along the way.
+// options, result and workspace behave as in mat_cg (with mat_lsqr_workspace_size floats).
+UtilStatus mat_lsqr(const MatOperator* op, const float* b, float* x, const MatSolverOptions* options, float* workspace, MatSolverResult* result);
+
+// same as mat_lsqr but the vector updates use OpenMP for multiple threads (pair it with a parallel operator)
+UtilStatus mat_lsqr_parallel(const MatOperator* op, const float* b, float* x, const MatSolverOptions* options, float* workspace, MatSolverResult* result);
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// optional hot-path instrumentation. when the library is built with -DUSE_INSTRUMENTATION=ON (which defines CMATRIX_INSTRUMENT),
+// every public mat_* / vec_* operation records its call count, wall time, bytes allocated, bytes moved and FLOPs.
+// the trivial accessors (mat_at, mat_set, vec_at, vec_set) are not instrumented since timing them would cost more than the call itself.
+// only the outermost instrumented call on a thread is recorded, and its numbers include everything it does internally:
+// mat_multiply's time and allocation cover its mat_init, mat_lazy_eval covers the mat_gemm it runs, ... without those
+// inner calls showing up as calls of their own, so adding up the operations never counts anything twice.
+// calls which return early (an error, or nothing to do) are still counted, with their time but no traffic.
+// counters are kept per thread and only summed up when you take a snapshot, so recording never takes a lock.
+// without CMATRIX_INSTRUMENT the recording compiles to nothing and snapshots are all zeroes.
+
+// X(id, name) for every instrumented operation
+#define INSTR_OPS(X) \
+	X(MAT_INIT, "mat_init") \
+	X(MAT_RESHAPE, "mat_reshape") \
+	X(MAT_CREATE, "mat_create") \
+	X(MAT_RANDOM, "mat_random") \
+	X(MAT_FILL, "mat_fill") \
+	X(MAT_GET_ROW, "mat_get_row") \
+	X(MAT_GET_ROW_INPLACE, "mat_get_row_inplace") \
+	X(MAT_GET_COLUMN, "mat_get_column") \
+	X(MAT_GET_COLUMN_INPLACE, "mat_get_column_inplace") \
+	X(MAT_TRANSPOSE, "mat_transpose") \
+	X(MAT_TRANSPOSE_INPLACE, "mat_transpose_inplace") \
+	X(MAT_PRINT, "mat_print") \
+	X(MAT_GEMM, "mat_gemm") \
+	X(MAT_GEMM_PARALLEL, "mat_gemm_parallel") \
+	X(MAT_MULTIPLY, "mat_multiply") \
+	X(MAT_MULTIPLY_PARALLEL, "mat_multiply_parallel") \
+	X(MAT_MULTIPLY_INPLACE, "mat_multiply_inplace") \
+	X(MAT_MULTIPLY_INPLACE_PARALLEL, "mat_multiply_inplace_parallel") \
+	X(MAT_APPLY, "mat_apply") \
+	X(MAT_ADD_S, "mat_add_s") \
+	X(MAT_SUBTRACT_S, "mat_subtract_s") \
+	X(MAT_MULTIPLY_S, "mat_multiply_s") \
+	X(MAT_DIVIDE_S, "mat_divide_s") \
+	X(MAT_ADD_E, "mat_add_e") \
+	X(MAT_SUBTRACT_E, "mat_subtract_e") \
+	X(MAT_MULTIPLY_E, "mat_multiply_e") \
+	X(MAT_DIVIDE_E, "mat_divide_e") \
+	X(MAT_COPY, "mat_copy") \
+	X(MAT_SUBSET, "mat_subset") \
+	X(MAT_SUM, "mat_sum") \
+	X(MAT_MEAN, "mat_mean") \
+	X(MAT_SAMPLE, "mat_sample") \
+	X(MAT_FREE, "mat_free") \
+	X(MAT_FILTER, "mat_filter") \
+	X(MAT_SUBSET_IDX, "mat_subset_idx") \
+	X(MAT_SORT, "mat_sort") \
+	X(MAT_HSTACK, "mat_hstack") \
+	X(MAT_VSTACK, "mat_vstack") \
+	X(MAT_RESERVE_ROWS, "mat_reserve_rows") \
+	X(MAT_APPEND_ROWS, "mat_append_rows") \
+	X(MAT_SHRINK_TO_FIT, "mat_shrink_to_fit") \
+	X(MAT_PAIRWISE_DISTANCES, "mat_pairwise_distances") \
+	X(MAT_KNN, "mat_knn") \
+	X(MAT_GATHER_ROWS, "mat_gather_rows") \
+	X(MAT_SCATTER_ROWS, "mat_scatter_rows") \
+	X(MAT_GROUPBY_AGG, "mat_groupby_agg") \
+	X(MAT_CONV2D, "mat_conv2d") \
+	X(MAT_WRITE, "mat_write") \
+	X(MAT_READ, "mat_read") \
+	X(MAT_LAZY_EVAL, "mat_lazy_eval") \
+	X(MAT_LAZY_SUM, "mat_lazy_sum") \
+	X(MAT_CG, "mat_cg") \
+	X(MAT_LSQR, "mat_lsqr") \
+	X(VEC_INIT, "vec_init") \
+	X(VEC_CREATE, "vec_create") \
+	X(VEC_COPY, "vec_copy") \
+	X(VEC_DOT, "vec_dot") \
+	X(VEC_RANDOM, "vec_random") \
+	X(VEC_FILL, "vec_fill") \
+	X(VEC_APPLY, "vec_apply") \
+	X(VEC_ADD_S, "vec_add_s") \
+	X(VEC_SUBTRACT_S, "vec_subtract_s") \
+	X(VEC_MULTIPLY_S, "vec_multiply_s") \
+	X(VEC_DIVIDE_S, "vec_divide_s") \
+	X(VEC_ADD_E, "vec_add_e") \
+	X(VEC_SUBTRACT_E, "vec_subtract_e") \
+	X(VEC_MULTIPLY_E, "vec_multiply_e") \
+	X(VEC_DIVIDE_E, "vec_divide_e") \
+	X(VEC_SUM, "vec_sum") \
+	X(VEC_MEAN, "vec_mean") \
+	X(VEC_FREE, "vec_free")
+
+#define INSTR_ENUM_ENTRY(id, name) INSTR_##id,
+typedef enum InstrOp
+{
+	INSTR_OPS(INSTR_ENUM_ENTRY)
+	INSTR_OP_COUNT
+} InstrOp;
+#undef INSTR_ENUM_ENTRY
+
+typedef struct InstrStats
+{
+	uint64_t calls;
+	uint64_t nanoseconds; // wall time
+	uint64_t bytes_allocated;
+	uint64_t bytes_moved; // bytes read + written (an estimate based on the operation's size)
+	uint64_t flops;
+} InstrStats;
+
+typedef struct InstrSnapshot
+{
+	InstrStats ops[INSTR_OP_COUNT];
+} InstrSnapshot;
+
+// name of the operation, e.g. "mat_multiply"
+const char* util_instr_name(const InstrOp op);
+
+// sum the counters of all threads into snapshot
+void util_instr_snapshot(InstrSnapshot* snapshot);
+
+// reset all counters to 0. counts from operations running concurrently with the reset may be partially lost.
+void util_instr_reset(void);
+
+// write snapshot as a JSON object ({"mat_multiply": {"calls": ..., ...}, ...}) to f. operations which were never called are skipped.
+void util_instr_dump_json(FILE* f, const InstrSnapshot* snapshot);
+
+#ifdef CMATRIX_INSTRUMENT
+
+// one instrumented call in progress, recorded when it goes out of scope (whichever return it leaves through)
+typedef struct InstrScope
+{
+	InstrOp op;
+	uint64_t start;
+	uint64_t bytes_allocated;
+	uint64_t bytes_moved;
+	uint64_t flops;
+	int outermost;
+} InstrScope;
+
+InstrScope util_instr_begin(const InstrOp op);
+void util_instr_end(InstrScope* scope);
+
+// INSTR_BEGIN(op) at the top of the function, INSTR_END(...) with the counters once the work is done.
+// INSTR_NESTED() in the body of a parallel region marks the worker threads as inside the caller's call, so the
+// instrumented operations they run aren't recorded as outermost calls of their own
+#define INSTR_BEGIN(op) InstrScope __instr __attribute__((cleanup(util_instr_end))) = util_instr_begin(INSTR_##op)
+#define INSTR_END(allocated, moved, n_flops) (__instr.bytes_allocated = (uint64_t)(allocated), __instr.bytes_moved = (uint64_t)(moved), __instr.flops = (uint64_t)(n_flops))
+#define INSTR_NESTED() InstrScope __instr_nested __attribute__((cleanup(util_instr_end))) = util_instr_begin(INSTR_OP_COUNT)
+// a call which is over before it did any work, e.g., a checked variant rejecting its arguments before the unchecked one runs
+#define INSTR_CALL(op) do { INSTR_BEGIN(op); } while (0)
+
+#else
+
+#define INSTR_BEGIN(op) ((void)0)
+#define INSTR_END(allocated, moved, n_flops) ((void)0)
+#define INSTR_NESTED() ((void)0)
+#define INSTR_CALL(op) ((void)0)
+
+#endif
+
+#endif
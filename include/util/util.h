@@ -2,13 +2,110 @@
 #define UTIL_H
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
 
-// print error message and terminate application
+// NOTE: every mat_* / vec_* / util_* function is reentrant: it only touches its arguments and the calling thread's
+// context (see UtilContext below), so different threads can call into the library concurrently as long as they
+// don't modify the same Matrix / Vector at the same time. the few process-wide settings (util_set_error_handler,
+// mat_set_tuning) are safe to change at runtime but are meant to be set once at startup.
+
+// result of an operation that can fail
+typedef enum UtilStatus
+{
+	UTIL_OK = 0,
+	UTIL_ERROR_DIMENSION, // operand dimensions don't match
+	UTIL_ERROR_ALLOCATION, // ran out of memory
+	UTIL_ERROR_ARGUMENT, // any other invalid argument
+	UTIL_ERROR_THREAD, // couldn't start a thread
+	UTIL_ERROR_IO, // reading from / writing to a file descriptor failed
+	UTIL_ERROR_FORMAT // serialized data is malformed or truncated
+} UtilStatus;
+
+// called for every error with the status, a human readable message and the argv passed to util_set_error_handler
+typedef void (*UtilErrorHandler)(const UtilStatus status, const char* msg, void* argv);
+
+// replace the process-wide error handler. the default (also restored by passing NULL) prints the message and terminates the application, like the library always did.
+// if the handler returns, the failing function stops and reports the error to its caller instead: functions returning a pointer return NULL,
+// functions returning a UtilStatus return the error and functions returning a float return NAN. set this once before spawning threads.
+void util_set_error_handler(UtilErrorHandler handler, void* argv);
+
+// error handler that does nothing, so every failure is just returned to the caller. use it with util_set_error_handler to stop the library from calling exit().
+void util_error_return(const UtilStatus status, const char* msg, void* argv);
+
+// report an error: store it as the calling thread's last error, call the error handler and return status
+UtilStatus util_raise(const UtilStatus status, const char* msg);
+
+// status and message of the last error raised on the calling thread (UTIL_OK / empty string if there was none since the last util_clear_error)
+UtilStatus util_last_error(void);
+const char* util_last_error_message(void);
+
+// reset the calling thread's last error to UTIL_OK
+void util_clear_error(void);
+
+// report an error with UTIL_ERROR_ARGUMENT (kept for compatibility, prefer util_raise)
 void util_error(const char* msg);
 
-// generate random float between lower_bound and upper_bound. NOTE: need to provide seed before calling this function!
+// state of a small xorshift64* random number generator. each context owns one, so threads never share a sequence.
+typedef struct UtilRng
+{
+	uint64_t state;
+} UtilRng;
+
+// seed the generator. the same seed always produces the same sequence.
+void util_rng_seed(UtilRng* rng, const uint64_t seed);
+
+// next 64 random bits from the generator
+uint64_t util_rng_next(UtilRng* rng);
+
+// generate random float in [lower_bound, upper_bound) using the calling thread's context generator
 float util_rand_between(const float lower_bound, const float upper_bound);
 
-#endif
\ No newline at end of file
+// same as util_rand_between but with an explicit generator
+float util_rand_between_r(UtilRng* rng, const float lower_bound, const float upper_bound);
+
+// everything the library would otherwise keep in global state. each thread has its own default context
+// (with a uniquely seeded generator); install your own with util_set_context to control seeding, threads or allocation.
+typedef struct UtilContext
+{
+	UtilRng rng; // used by mat_random, vec_random, mat_sample, ...
+
+	// threads used by the *_parallel operations when built with OpenMP (0 = OpenMP's default)
+	size_t n_threads;
+
+	// allocator for matrices, vectors and the kernels' scratch buffers (except the small packing buffer each thread keeps for
+	// the multiply kernel). a matrix / vector must be free'd under the same allocator it was created with. the *_parallel
+	// operations run their threads under the caller's context, so the allocator may be called from several threads at once.
+	void* (*alloc)(size_t size, void* argv);
+	void* (*realloc)(void* ptr, size_t size, void* argv);
+	void (*dealloc)(void* ptr, void* argv);
+	void* alloc_argv;
+
+	// kernel parameters to use instead of the process-wide ones (NULL = process-wide, see mat_set_tuning)
+	const struct MatTuning* tuning;
+} UtilContext;
+
+// fill ctx with defaults: a generator seeded from the clock and a per-context counter, OpenMP's thread count,
+// the C allocator and the process-wide tuning
+void util_context_init(UtilContext* ctx);
+
+// make ctx the calling thread's context (NULL restores the thread's default context). ctx must stay alive while it's installed.
+void util_set_context(UtilContext* ctx);
+
+// the calling thread's current context
+UtilContext* util_get_context(void);
+
+// mark the calling thread as a worker of a thread pool (the async pool does this for its own workers). the library doesn't
+// start OpenMP teams for incidental work, like first-touching a new matrix, on such threads: the pool already keeps the cores busy.
+void util_set_pool_worker(const bool worker);
+bool util_is_pool_worker(void);
+
+// allocate / free through the calling thread's context allocator. util_calloc zeroes the memory.
+void* util_malloc(const size_t size);
+void* util_calloc(const size_t n_elem, const size_t size);
+void* util_realloc(void* ptr, const size_t size);
+void util_free(void* ptr);
+
+#endif
@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
+#include "util.h"
 
 typedef struct Vector
 {
@@ -12,8 +13,8 @@ typedef struct Vector
 	size_t n_elem;
 } Vector;
 
-// initialize vector of size n_elem (default to 0.0)
-void vec_init(Vector** vec, const size_t n_elem);
+// initialize vector of size n_elem (default to 0.0). on failure *vec is set to NULL and the error is returned.
+UtilStatus vec_init(Vector** vec, const size_t n_elem);
 
 // create vector from float pointer of data
 Vector* vec_create(const float* data, const size_t n_elem);
@@ -27,12 +28,18 @@ float vec_at(const Vector* vec, const size_t i);
 // set value at index i
 void vec_set(Vector** vec, const size_t i, const float value);
 
-// dot product between two vectors
+// dot product between two vectors (NAN if the sizes don't match)
 float vec_dot(const Vector* vec1, const Vector* vec2);
 
-// fill vector with random values between lower_bound and upper_bound
+// dot product without checking the sizes - only use this when they are already known to match
+float vec_dot_unchecked(const Vector* vec1, const Vector* vec2);
+
+// fill vector with random values between lower_bound and upper_bound, drawn from the calling thread's context generator
 void vec_random(Vector** vec, const float lower_bound, const float upper_bound);
 
+// same as vec_random but with an explicit generator
+void vec_random_r(Vector** vec, const float lower_bound, const float upper_bound, UtilRng* rng);
+
 // fill vector with constant value
 void vec_fill(Vector** vec, const float value);
 
@@ -51,17 +58,29 @@ void vec_multiply_s(Vector** vec, const float value);
 // divide scalar value element-wise to vector
 void vec_divide_s(Vector** vec, const float value);
 
-// add two vectors target - vec element-wise - target is modified inplace
-void vec_add_e(Vector** target, const Vector* vec);
+// add two vectors target - vec element-wise - target is modified inplace. sizes must match exactly
+UtilStatus vec_add_e(Vector** target, const Vector* vec);
+
+// same as vec_add_e without checking the sizes
+void vec_add_e_unchecked(Vector** target, const Vector* vec);
+
+// substract two vectors target - vec element-wise - target is modified inplace. sizes must match exactly
+UtilStatus vec_subtract_e(Vector** target, const Vector* vec);
+
+// same as vec_subtract_e without checking the sizes
+void vec_subtract_e_unchecked(Vector** target, const Vector* vec);
+
+// multiply two vectors target * vec element-wise - target is modified inplace. sizes must match exactly
+UtilStatus vec_multiply_e(Vector** target, const Vector* vec);
 
-// substract two vectors target - vec element-wise - target is modified inplace
-void vec_subtract_e(Vector** target, const Vector* vec);
+// same as vec_multiply_e without checking the sizes
+void vec_multiply_e_unchecked(Vector** target, const Vector* vec);
 
-// multiply two vectors target * vec element-wise - target is modified inplace
-void vec_multiply_e(Vector** target, const Vector* vec);
+// divide two vectors target / vec element-wise - target is modified inplace. sizes must match exactly
+UtilStatus vec_divide_e(Vector** target, const Vector* vec);
 
-// divide two vectors target / vec element-wise - target is modified inplace
-void vec_divide_e(Vector** target, const Vector* vec);
+// same as vec_divide_e without checking the sizes
+void vec_divide_e_unchecked(Vector** target, const Vector* vec);
 
 // sum all elements in a vector
 float vec_sum(const Vector* vec);
@@ -0,0 +1,524 @@
+#include <pthread.h>
+#include <unistd.h>
+#include "async.h"
+#include "util.h"
+
+struct MatTask
+{
+	void (*task_func)(void* argv);
+	void* argv;
+	bool owns_argv; // argv was allocated by one of the mat_*_async wrappers
+
+	// the submitting thread's context (allocator, thread count, tuning), installed on whichever thread runs the task.
+	// the generator is seeded from the submitter's, so tasks never share a random sequence
+	UtilContext context;
+
+	size_t n_pending_deps;
+	MatTask** dependents;
+	size_t n_dependents;
+	size_t dependents_capacity;
+
+	bool done;
+	UtilStatus status; // what the wrapped operation returned, UTIL_OK for plain submitted functions
+	size_t ref_count; // one reference for the user's handle and one for the pool
+
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+};
+
+// each worker owns a deque of ready tasks. the owner pushes/pops at the back (most recently
+// released tasks are usually the ones whose inputs are still in cache) and idle workers
+// steal from the front of other workers' deques.
+typedef struct TaskDeque
+{
+	MatTask** tasks;
+	size_t head;
+	size_t n_tasks;
+	size_t capacity;
+	pthread_mutex_t lock;
+} TaskDeque;
+
+typedef struct TaskPool
+{
+	pthread_t* workers;
+	TaskDeque* deques;
+	size_t n_workers; // workers actually running
+	size_t n_deques;
+	size_t next_deque; // round-robin target for tasks submitted from outside the pool
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond; // signalled when a task becomes ready or on shutdown
+	pthread_cond_t idle_cond; // signalled when the last outstanding task finishes
+	size_t n_ready;
+	size_t n_outstanding;
+	bool shutdown;
+} TaskPool;
+
+static TaskPool* pool = NULL;
+static pthread_mutex_t pool_init_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// index of the worker deque owned by the current thread, (size_t)-1 if the thread isn't a worker
+static __thread size_t worker_id = (size_t)-1;
+
+static bool __deque_push_back(TaskDeque* deque, MatTask* task)
+{
+	pthread_mutex_lock(&deque->lock);
+	if (deque->n_tasks == deque->capacity)
+	{
+		size_t new_capacity = deque->capacity == 0 ? 16 : deque->capacity * 2;
+		MatTask** alloc = malloc(new_capacity * sizeof(MatTask*));
+		if (!alloc)
+		{
+			pthread_mutex_unlock(&deque->lock);
+			return false;
+		}
+
+		// unroll the ring buffer into the new allocation
+		for (size_t i = 0; i < deque->n_tasks; ++i)
+			alloc[i] = deque->tasks[(deque->head + i) % deque->capacity];
+
+		free(deque->tasks);
+		deque->tasks = alloc;
+		deque->head = 0;
+		deque->capacity = new_capacity;
+	}
+	deque->tasks[(deque->head + deque->n_tasks) % deque->capacity] = task;
+	deque->n_tasks++;
+	pthread_mutex_unlock(&deque->lock);
+	return true;
+}
+
+static MatTask* __deque_pop_back(TaskDeque* deque)
+{
+	MatTask* task = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->n_tasks > 0)
+	{
+		deque->n_tasks--;
+		task = deque->tasks[(deque->head + deque->n_tasks) % deque->capacity];
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return task;
+}
+
+static MatTask* __deque_pop_front(TaskDeque* deque)
+{
+	MatTask* task = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->n_tasks > 0)
+	{
+		task = deque->tasks[deque->head];
+		deque->head = (deque->head + 1) % deque->capacity;
+		deque->n_tasks--;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return task;
+}
+
+static void __task_release(MatTask* task)
+{
+	pthread_mutex_lock(&task->lock);
+	size_t remaining = --task->ref_count;
+	pthread_mutex_unlock(&task->lock);
+
+	if (remaining > 0)
+		return;
+
+	if (task->owns_argv)
+		free(task->argv);
+	free(task->dependents);
+	pthread_mutex_destroy(&task->lock);
+	pthread_cond_destroy(&task->done_cond);
+	free(task);
+}
+
+static void __run_task(MatTask* task);
+
+static void __schedule(MatTask* task)
+{
+	// the push and the n_ready increment happen under the pool lock together: a worker only decrements n_ready
+	// (under the same lock) after popping, so it can never see the task before it has been counted
+	pthread_mutex_lock(&pool->lock);
+	size_t target = worker_id;
+	if (worker_id >= pool->n_workers)
+	{
+		target = pool->next_deque;
+		pool->next_deque = (pool->next_deque + 1) % pool->n_workers;
+	}
+
+	bool queued = __deque_push_back(&pool->deques[target], task);
+	if (queued)
+	{
+		pool->n_ready++;
+		pthread_cond_signal(&pool->work_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	// if the queue can't grow, run the task right here instead - slower, but nothing gets lost
+	if (!queued)
+		__run_task(task);
+}
+
+static MatTask* __find_task(size_t id)
+{
+	MatTask* task = __deque_pop_back(&pool->deques[id]);
+
+	// nothing local, try to steal from the other workers
+	for (size_t i = 1; !task && i < pool->n_workers; ++i)
+		task = __deque_pop_front(&pool->deques[(id + i) % pool->n_workers]);
+
+	return task;
+}
+
+static void __run_task(MatTask* task)
+{
+	UtilContext* previous = util_get_context();
+	util_set_context(&task->context);
+	task->task_func(task->argv);
+	util_set_context(previous);
+
+	pthread_mutex_lock(&task->lock);
+	if (task->owns_argv)
+		task->status = *(UtilStatus*)task->argv;
+	task->done = true;
+	MatTask** dependents = task->dependents;
+	size_t n_dependents = task->n_dependents;
+	task->dependents = NULL;
+	task->n_dependents = 0;
+	pthread_cond_broadcast(&task->done_cond);
+	pthread_mutex_unlock(&task->lock);
+
+	// release the dependents whose last input we just produced
+	for (size_t i = 0; i < n_dependents; ++i)
+	{
+		MatTask* dependent = dependents[i];
+		pthread_mutex_lock(&dependent->lock);
+		bool ready = --dependent->n_pending_deps == 0;
+		pthread_mutex_unlock(&dependent->lock);
+
+		if (ready)
+			__schedule(dependent);
+	}
+	free(dependents);
+
+	__task_release(task);
+
+	pthread_mutex_lock(&pool->lock);
+	if (--pool->n_outstanding == 0)
+		pthread_cond_broadcast(&pool->idle_cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void* __worker_loop(void* argv)
+{
+	worker_id = (size_t)argv;
+	util_set_pool_worker(true);
+
+	while (true)
+	{
+		MatTask* task = __find_task(worker_id);
+		if (task)
+		{
+			pthread_mutex_lock(&pool->lock);
+			pool->n_ready--;
+			pthread_mutex_unlock(&pool->lock);
+
+			__run_task(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->n_ready == 0 && !pool->shutdown)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		bool stop = pool->shutdown && pool->n_ready == 0;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (stop)
+			break;
+	}
+
+	return NULL;
+}
+
+UtilStatus mat_async_init(const size_t n_threads)
+{
+	pthread_mutex_lock(&pool_init_lock);
+	if (pool)
+	{
+		pthread_mutex_unlock(&pool_init_lock);
+		return UTIL_OK;
+	}
+
+	size_t n_workers = n_threads;
+	if (n_workers == 0)
+	{
+		long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+		n_workers = n_cores > 0 ? (size_t)n_cores : 1;
+	}
+
+	TaskPool* p = calloc(1, sizeof(TaskPool));
+	if (!p)
+	{
+		pthread_mutex_unlock(&pool_init_lock);
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for task pool.");
+	}
+	p->n_deques = n_workers;
+	p->workers = calloc(n_workers, sizeof(pthread_t));
+	p->deques = calloc(n_workers, sizeof(TaskDeque));
+	if (!p->workers || !p->deques)
+	{
+		free(p->workers);
+		free(p->deques);
+		free(p);
+		pthread_mutex_unlock(&pool_init_lock);
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for task pool workers.");
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work_cond, NULL);
+	pthread_cond_init(&p->idle_cond, NULL);
+	for (size_t i = 0; i < n_workers; ++i)
+		pthread_mutex_init(&p->deques[i].lock, NULL);
+
+	// if the system refuses to start some of the threads, carry on with the ones we got. the deques
+	// past n_workers stay allocated (and empty), so running workers can still look at them safely.
+	p->n_workers = n_workers;
+	pool = p;
+	for (size_t i = 0; i < n_workers; ++i)
+		if (pthread_create(&p->workers[i], NULL, __worker_loop, (void*)i) != 0)
+		{
+			pthread_mutex_lock(&p->lock);
+			p->n_workers = i;
+			pthread_mutex_unlock(&p->lock);
+			break;
+		}
+
+	if (p->n_workers == 0)
+	{
+		pool = NULL;
+		for (size_t i = 0; i < n_workers; ++i)
+			pthread_mutex_destroy(&p->deques[i].lock);
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->work_cond);
+		pthread_cond_destroy(&p->idle_cond);
+		free(p->deques);
+		free(p->workers);
+		free(p);
+		pthread_mutex_unlock(&pool_init_lock);
+		return util_raise(UTIL_ERROR_THREAD, "Couldn't start any task pool worker thread.");
+	}
+
+	pthread_mutex_unlock(&pool_init_lock);
+	return UTIL_OK;
+}
+
+void mat_async_free(void)
+{
+	pthread_mutex_lock(&pool_init_lock);
+	if (!pool)
+	{
+		pthread_mutex_unlock(&pool_init_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->n_outstanding > 0)
+		pthread_cond_wait(&pool->idle_cond, &pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (size_t i = 0; i < pool->n_workers; ++i)
+		pthread_join(pool->workers[i], NULL);
+
+	// every deque was initialized, even those of workers that failed to start
+	for (size_t i = 0; i < pool->n_workers; ++i)
+		free(pool->deques[i].tasks);
+	for (size_t i = 0; i < pool->n_deques; ++i)
+		pthread_mutex_destroy(&pool->deques[i].lock);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->idle_cond);
+	free(pool->deques);
+	free(pool->workers);
+	free(pool);
+	pool = NULL;
+
+	pthread_mutex_unlock(&pool_init_lock);
+}
+
+static MatTask* __submit(void (*task_func)(void* argv), void* argv, bool owns_argv, MatTask** deps, const size_t n_deps)
+{
+	if (mat_async_init(0) != UTIL_OK)
+	{
+		if (owns_argv)
+			free(argv);
+		return NULL;
+	}
+
+	MatTask* task = calloc(1, sizeof(MatTask));
+	if (!task)
+	{
+		if (owns_argv)
+			free(argv);
+		util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for task.");
+		return NULL;
+	}
+	task->task_func = task_func;
+	task->argv = argv;
+	task->owns_argv = owns_argv;
+	task->ref_count = 2;
+
+	UtilContext* submitter = util_get_context();
+	task->context = *submitter;
+	util_rng_seed(&task->context.rng, util_rng_next(&submitter->rng));
+
+	pthread_mutex_init(&task->lock, NULL);
+	pthread_cond_init(&task->done_cond, NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->n_outstanding++;
+	pthread_mutex_unlock(&pool->lock);
+
+	// hold one extra pending count while registering so a dependency finishing
+	// midway through can't schedule the task before we are done
+	task->n_pending_deps = 1;
+	for (size_t i = 0; i < n_deps; ++i)
+	{
+		MatTask* dep = deps[i];
+		pthread_mutex_lock(&dep->lock);
+		if (!dep->done)
+		{
+			if (dep->n_dependents == dep->dependents_capacity)
+			{
+				size_t new_capacity = dep->dependents_capacity == 0 ? 4 : dep->dependents_capacity * 2;
+				void* alloc = realloc(dep->dependents, new_capacity * sizeof(MatTask*));
+				if (!alloc)
+				{
+					// can't register the edge, so satisfy the dependency by waiting for it here instead
+					pthread_mutex_unlock(&dep->lock);
+					mat_task_wait(dep);
+					continue;
+				}
+				dep->dependents = alloc;
+				dep->dependents_capacity = new_capacity;
+			}
+			dep->dependents[dep->n_dependents++] = task;
+
+			pthread_mutex_lock(&task->lock);
+			task->n_pending_deps++;
+			pthread_mutex_unlock(&task->lock);
+		}
+		pthread_mutex_unlock(&dep->lock);
+	}
+
+	pthread_mutex_lock(&task->lock);
+	bool ready = --task->n_pending_deps == 0;
+	pthread_mutex_unlock(&task->lock);
+
+	if (ready)
+		__schedule(task);
+
+	return task;
+}
+
+MatTask* mat_async_submit(void (*task_func)(void* argv), void* argv, MatTask** deps, const size_t n_deps)
+{
+	return __submit(task_func, argv, false, deps, n_deps);
+}
+
+// NOTE: the argument structs of the mat_*_async wrappers all start with the status of the
+// operation, which __run_task copies into the task once it's done
+typedef struct MultiplyArgs
+{
+	UtilStatus status;
+	const Matrix* mat1;
+	const Matrix* mat2;
+	Matrix* target;
+} MultiplyArgs;
+
+static void __multiply_task(void* argv)
+{
+	MultiplyArgs* args = argv;
+	args->status = mat_multiply_inplace(args->mat1, args->mat2, &args->target);
+}
+
+MatTask* mat_multiply_async(const Matrix* mat1, const Matrix* mat2, Matrix** target, MatTask** deps, const size_t n_deps)
+{
+	MultiplyArgs* args = malloc(sizeof(MultiplyArgs));
+	if (!args)
+	{
+		util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for multiply task.");
+		return NULL;
+	}
+	args->mat1 = mat1;
+	args->mat2 = mat2;
+	args->target = *target;
+
+	return __submit(__multiply_task, args, true, deps, n_deps);
+}
+
+typedef struct SortArgs
+{
+	UtilStatus status;
+	Matrix* mat;
+	size_t c;
+	bool ascending;
+} SortArgs;
+
+static void __sort_task(void* argv)
+{
+	SortArgs* args = argv;
+	mat_sort(&args->mat, args->c, args->ascending);
+	args->status = UTIL_OK;
+}
+
+MatTask* mat_sort_async(Matrix** mat, const size_t c, const bool ascending, MatTask** deps, const size_t n_deps)
+{
+	SortArgs* args = malloc(sizeof(SortArgs));
+	if (!args)
+	{
+		util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for sort task.");
+		return NULL;
+	}
+	args->mat = *mat;
+	args->c = c;
+	args->ascending = ascending;
+
+	return __submit(__sort_task, args, true, deps, n_deps);
+}
+
+bool mat_task_poll(MatTask* task)
+{
+	pthread_mutex_lock(&task->lock);
+	bool done = task->done;
+	pthread_mutex_unlock(&task->lock);
+
+	return done;
+}
+
+void mat_task_wait(MatTask* task)
+{
+	pthread_mutex_lock(&task->lock);
+	while (!task->done)
+		pthread_cond_wait(&task->done_cond, &task->lock);
+	pthread_mutex_unlock(&task->lock);
+}
+
+UtilStatus mat_task_status(MatTask* task)
+{
+	mat_task_wait(task);
+
+	pthread_mutex_lock(&task->lock);
+	UtilStatus status = task->status;
+	pthread_mutex_unlock(&task->lock);
+
+	return status;
+}
+
+void mat_task_free(MatTask** task)
+{
+	mat_task_wait(*task);
+	__task_release(*task);
+	*task = NULL;
+}
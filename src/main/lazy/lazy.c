@@ -0,0 +1,743 @@
+#include <math.h>
+#include "lazy.h"
+#include "vector.h"
+#include "util.h"
+#include "instrument.h"
+
+typedef enum NodeKind
+{
+	NODE_LEAF,
+	NODE_TRANSPOSE,
+	NODE_MULTIPLY,
+	NODE_ELEMENTWISE, // node (op) other
+	NODE_SCALAR,      // node (op) value
+	NODE_APPLY
+} NodeKind;
+
+typedef enum ElementOp
+{
+	OP_ADD,
+	OP_SUBTRACT,
+	OP_MULTIPLY,
+	OP_DIVIDE
+} ElementOp;
+
+// read-only window onto evaluated data. if trans is set, the data is stored as the
+// transpose of the logical (n_rows, n_columns) shape, which is how transposes are folded
+// into their consumers without copying.
+typedef struct View
+{
+	const float* data;
+	size_t n_rows;
+	size_t n_columns;
+	bool trans;
+} View;
+
+struct MatNode
+{
+	MatGraph* graph;
+	NodeKind kind;
+	size_t n_rows;
+	size_t n_columns;
+
+	MatNode* inputs[2];
+	size_t n_inputs;
+
+	const Matrix* leaf;
+	ElementOp op;
+	float value;
+	float (*apply_func)(float x, float* argv);
+	float* argv;
+
+	// evaluation state, reset every time a new evaluation starts
+	size_t epoch;
+	size_t pending_uses;
+	bool evaluated;
+	View view;
+	float* buffer;
+};
+
+typedef struct Buffer
+{
+	float* data;
+	size_t capacity;
+	bool in_use;
+} Buffer;
+
+struct MatGraph
+{
+	MatNode** nodes;
+	size_t n_nodes;
+	size_t nodes_capacity;
+
+	Buffer* buffers;
+	size_t n_buffers;
+
+	size_t epoch;
+};
+
+// one step of a fused element-wise chain
+typedef struct ChainOp
+{
+	NodeKind kind;
+	ElementOp op;
+	float value;
+	float (*apply_func)(float x, float* argv);
+	float* argv;
+	View other;
+} ChainOp;
+
+// where the fused computation writes its results: either rows of an output buffer or a running sum
+typedef struct Sink
+{
+	float* out;
+	double sum;
+} Sink;
+
+UtilStatus mat_graph_init(MatGraph** graph)
+{
+	*graph = util_calloc(1, sizeof(MatGraph));
+	if (!*graph)
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for MatGraph.");
+
+	return UTIL_OK;
+}
+
+void mat_graph_free(MatGraph** graph)
+{
+	for (size_t i = 0; i < (*graph)->n_nodes; ++i)
+		util_free((*graph)->nodes[i]);
+	util_free((*graph)->nodes);
+
+	for (size_t i = 0; i < (*graph)->n_buffers; ++i)
+		util_free((*graph)->buffers[i].data);
+	util_free((*graph)->buffers);
+
+	util_free(*graph);
+	*graph = NULL;
+}
+
+static MatNode* __new_node(MatGraph* graph, NodeKind kind, size_t n_rows, size_t n_columns)
+{
+	if (graph->n_nodes == graph->nodes_capacity)
+	{
+		size_t new_capacity = graph->nodes_capacity == 0 ? 16 : graph->nodes_capacity * 2;
+		void* alloc = util_realloc(graph->nodes, new_capacity * sizeof(MatNode*));
+		if (!alloc)
+		{
+			util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for MatGraph nodes.");
+			return NULL;
+		}
+		graph->nodes = alloc;
+		graph->nodes_capacity = new_capacity;
+	}
+
+	MatNode* node = util_calloc(1, sizeof(MatNode));
+	if (!node)
+	{
+		util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for MatNode.");
+		return NULL;
+	}
+	node->graph = graph;
+	node->kind = kind;
+	node->n_rows = n_rows;
+	node->n_columns = n_columns;
+
+	graph->nodes[graph->n_nodes++] = node;
+
+	return node;
+}
+
+MatNode* mat_lazy(MatGraph* graph, const Matrix* mat)
+{
+	if (!graph || !mat)
+	{
+		util_raise(UTIL_ERROR_ARGUMENT, "Cannot wrap a NULL matrix or wrap into a NULL graph.");
+		return NULL;
+	}
+
+	MatNode* node = __new_node(graph, NODE_LEAF, mat->n_rows, mat->n_columns);
+	if (node)
+		node->leaf = mat;
+	return node;
+}
+
+MatNode* mat_lazy_transpose(MatNode* node)
+{
+	if (!node)
+		return NULL;
+
+	MatNode* tpose = __new_node(node->graph, NODE_TRANSPOSE, node->n_columns, node->n_rows);
+	if (!tpose)
+		return NULL;
+	tpose->inputs[0] = node;
+	tpose->n_inputs = 1;
+	return tpose;
+}
+
+MatNode* mat_lazy_multiply(MatNode* node1, MatNode* node2)
+{
+	if (!node1 || !node2)
+		return NULL;
+	if (node1->graph != node2->graph)
+	{
+		util_raise(UTIL_ERROR_ARGUMENT, "Nodes from different graphs can't be combined.");
+		return NULL;
+	}
+	if (node1->n_columns != node2->n_rows)
+	{
+		util_raise(UTIL_ERROR_DIMENSION, "mat1's column size must match mat2's row size when multiplying matrices.");
+		return NULL;
+	}
+
+	MatNode* product = __new_node(node1->graph, NODE_MULTIPLY, node1->n_rows, node2->n_columns);
+	if (!product)
+		return NULL;
+	product->inputs[0] = node1;
+	product->inputs[1] = node2;
+	product->n_inputs = 2;
+	return product;
+}
+
+static MatNode* __lazy_elementwise(MatNode* target, MatNode* node, ElementOp op)
+{
+	if (!target || !node)
+		return NULL;
+	if (target->graph != node->graph)
+	{
+		util_raise(UTIL_ERROR_ARGUMENT, "Nodes from different graphs can't be combined.");
+		return NULL;
+	}
+	if (target->n_rows != node->n_rows || target->n_columns != node->n_columns)
+	{
+		util_raise(UTIL_ERROR_DIMENSION, "Matrix dimensions must match exactly when trying to perform element-wise operations.");
+		return NULL;
+	}
+
+	MatNode* result = __new_node(target->graph, NODE_ELEMENTWISE, target->n_rows, target->n_columns);
+	if (!result)
+		return NULL;
+	result->inputs[0] = target;
+	result->inputs[1] = node;
+	result->n_inputs = 2;
+	result->op = op;
+	return result;
+}
+
+MatNode* mat_lazy_add_e(MatNode* target, MatNode* node)
+{
+	return __lazy_elementwise(target, node, OP_ADD);
+}
+
+MatNode* mat_lazy_subtract_e(MatNode* target, MatNode* node)
+{
+	return __lazy_elementwise(target, node, OP_SUBTRACT);
+}
+
+MatNode* mat_lazy_multiply_e(MatNode* target, MatNode* node)
+{
+	return __lazy_elementwise(target, node, OP_MULTIPLY);
+}
+
+MatNode* mat_lazy_divide_e(MatNode* target, MatNode* node)
+{
+	return __lazy_elementwise(target, node, OP_DIVIDE);
+}
+
+static MatNode* __lazy_scalar(MatNode* node, const float value, ElementOp op)
+{
+	if (!node)
+		return NULL;
+
+	MatNode* result = __new_node(node->graph, NODE_SCALAR, node->n_rows, node->n_columns);
+	if (!result)
+		return NULL;
+	result->inputs[0] = node;
+	result->n_inputs = 1;
+	result->op = op;
+	result->value = value;
+	return result;
+}
+
+MatNode* mat_lazy_add_s(MatNode* node, const float value)
+{
+	return __lazy_scalar(node, value, OP_ADD);
+}
+
+MatNode* mat_lazy_subtract_s(MatNode* node, const float value)
+{
+	return __lazy_scalar(node, value, OP_SUBTRACT);
+}
+
+MatNode* mat_lazy_multiply_s(MatNode* node, const float value)
+{
+	return __lazy_scalar(node, value, OP_MULTIPLY);
+}
+
+MatNode* mat_lazy_divide_s(MatNode* node, const float value)
+{
+	return __lazy_scalar(node, value, OP_DIVIDE);
+}
+
+MatNode* mat_lazy_apply(MatNode* node, float (*apply_func)(float x, float* argv), float* argv)
+{
+	if (!node)
+		return NULL;
+
+	MatNode* result = __new_node(node->graph, NODE_APPLY, node->n_rows, node->n_columns);
+	if (!result)
+		return NULL;
+	result->inputs[0] = node;
+	result->n_inputs = 1;
+	result->apply_func = apply_func;
+	result->argv = argv;
+	return result;
+}
+
+size_t mat_lazy_rows(const MatNode* node)
+{
+	return node->n_rows;
+}
+
+size_t mat_lazy_columns(const MatNode* node)
+{
+	return node->n_columns;
+}
+
+static float* __acquire_buffer(MatGraph* graph, size_t n_elem)
+{
+	// reuse the smallest free buffer that fits
+	Buffer* best = NULL;
+	for (size_t i = 0; i < graph->n_buffers; ++i)
+	{
+		Buffer* b = &graph->buffers[i];
+		if (!b->in_use && b->capacity >= n_elem && (!best || b->capacity < best->capacity))
+			best = b;
+	}
+
+	if (!best)
+	{
+		void* alloc = util_realloc(graph->buffers, (graph->n_buffers + 1) * sizeof(Buffer));
+		if (!alloc)
+		{
+			util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for MatGraph buffers.");
+			return NULL;
+		}
+		graph->buffers = alloc;
+
+		float* data = util_malloc(n_elem * sizeof(float));
+		if (!data)
+		{
+			util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for MatGraph buffer data.");
+			return NULL;
+		}
+
+		best = &graph->buffers[graph->n_buffers++];
+		best->data = data;
+		best->capacity = n_elem;
+	}
+
+	best->in_use = true;
+	return best->data;
+}
+
+static void __release_buffer(MatGraph* graph, float* data)
+{
+	for (size_t i = 0; i < graph->n_buffers; ++i)
+		if (graph->buffers[i].data == data)
+			graph->buffers[i].in_use = false;
+}
+
+// count how many times each node reachable from root will be consumed during this evaluation
+static void __count_uses(MatNode* node, size_t epoch)
+{
+	for (size_t i = 0; i < node->n_inputs; ++i)
+	{
+		MatNode* input = node->inputs[i];
+		if (input->epoch != epoch)
+		{
+			input->epoch = epoch;
+			input->pending_uses = 0;
+			input->evaluated = false;
+			input->buffer = NULL;
+			__count_uses(input, epoch);
+		}
+		input->pending_uses++;
+	}
+}
+
+static float __view_at(const View* view, size_t r, size_t c)
+{
+	if (view->trans)
+		return view->data[r + c * view->n_rows];
+	return view->data[c + r * view->n_columns];
+}
+
+static float __apply_op(ElementOp op, float x, float y)
+{
+	switch (op)
+	{
+		case OP_ADD:
+			return x + y;
+		case OP_SUBTRACT:
+			return x - y;
+		case OP_MULTIPLY:
+			return x * y;
+		case OP_DIVIDE:
+			return x / y;
+	}
+	return x;
+}
+
+static UtilStatus __compute(MatNode* node, Sink* sink);
+
+// get a view of the node's data, materializing it into a pooled buffer if necessary
+static UtilStatus __eval(MatNode* node, View* view)
+{
+	if (node->evaluated)
+	{
+		*view = node->view;
+		return UTIL_OK;
+	}
+
+	switch (node->kind)
+	{
+		case NODE_LEAF:
+			node->view.data = node->leaf->data;
+			node->view.n_rows = node->leaf->n_rows;
+			node->view.n_columns = node->leaf->n_columns;
+			node->view.trans = false;
+			break;
+		case NODE_TRANSPOSE:
+		{
+			// no data movement, just read the input the other way around
+			UtilStatus status = __eval(node->inputs[0], &node->view);
+			if (status != UTIL_OK)
+				return status;
+			node->view.n_rows = node->n_rows;
+			node->view.n_columns = node->n_columns;
+			node->view.trans = !node->view.trans;
+			break;
+		}
+		default:
+		{
+			node->buffer = __acquire_buffer(node->graph, node->n_rows * node->n_columns);
+			if (!node->buffer)
+				return UTIL_ERROR_ALLOCATION;
+			Sink sink = { node->buffer, 0.0 };
+			UtilStatus status = __compute(node, &sink);
+			if (status != UTIL_OK)
+				return status;
+			node->view.data = node->buffer;
+			node->view.n_rows = node->n_rows;
+			node->view.n_columns = node->n_columns;
+			node->view.trans = false;
+			break;
+		}
+	}
+
+	node->evaluated = true;
+	*view = node->view;
+	return UTIL_OK;
+}
+
+// called once per use of the node. the last use hands the node's buffer back to the pool.
+static void __release(MatNode* node)
+{
+	if (--node->pending_uses > 0)
+		return;
+
+	if (node->buffer)
+	{
+		__release_buffer(node->graph, node->buffer);
+		node->buffer = NULL;
+	}
+	else if (node->kind == NODE_TRANSPOSE)
+		__release(node->inputs[0]);
+}
+
+static bool __is_elementwise(const MatNode* node)
+{
+	return node->kind == NODE_ELEMENTWISE || node->kind == NODE_SCALAR || node->kind == NODE_APPLY;
+}
+
+// run the chain over n_columns elements of output row r starting at column c_offset, reading them from in and
+// writing the results to out (which can be in itself), or adding them to the sink's sum if out is NULL
+static void __emit_row(const ChainOp* chain, size_t n_chain, const float* in, float* out, size_t r, size_t c_offset, size_t n_columns, Sink* sink)
+{
+	for (size_t c = 0; c < n_columns; ++c)
+	{
+		float x = in[c];
+		for (size_t i = 0; i < n_chain; ++i)
+		{
+			const ChainOp* step = &chain[i];
+			if (step->kind == NODE_APPLY)
+				x = step->apply_func(x, step->argv);
+			else if (step->kind == NODE_SCALAR)
+				x = __apply_op(step->op, x, step->value);
+			else
+				x = __apply_op(step->op, x, __view_at(&step->other, r, c_offset + c));
+		}
+
+		if (out)
+			out[c] = x;
+		else
+			sink->sum += x;
+	}
+}
+
+// the fused chain, run by the multiply kernel on every output tile while it is still in cache
+typedef struct ChainEpilogue
+{
+	const ChainOp* chain;
+	size_t n_chain;
+	Sink* sink;
+} ChainEpilogue;
+
+static void __chain_tile(float* tile, const size_t row, const size_t column, const size_t n_rows, const size_t n_columns, const size_t ld, void* argv)
+{
+	ChainEpilogue* fused = argv;
+	for (size_t r = 0; r < n_rows; ++r)
+	{
+		float* tile_row = &tile[r * ld];
+		__emit_row(fused->chain, fused->n_chain, tile_row, fused->sink->out ? tile_row : NULL, row + r, column, n_columns, fused->sink);
+	}
+}
+
+// the stored (untransposed) matrix behind a view, so it can be handed to the multiply kernel with a transpose flag
+static Matrix __stored_matrix(const View* view)
+{
+	Matrix stored = {
+		(float*)view->data,
+		view->trans ? view->n_columns : view->n_rows,
+		view->trans ? view->n_rows : view->n_columns,
+		view->n_rows * view->n_columns
+	};
+	return stored;
+}
+
+// a x b through mat_gemm: transposed views become the kernel's transpose flags and the chain becomes its epilogue.
+// the product lands in the sink's output, or for a sum in a pooled scratch buffer which the epilogue reduces tile by tile
+static UtilStatus __multiply(MatGraph* graph, const View* a, const View* b, const ChainOp* chain, size_t n_chain, Sink* sink)
+{
+	const size_t n_rows = a->n_rows;
+	const size_t n_columns = b->n_columns;
+
+	float* out = sink->out;
+	if (!out)
+	{
+		out = __acquire_buffer(graph, n_rows * n_columns);
+		if (!out)
+			return UTIL_ERROR_ALLOCATION;
+	}
+
+	Matrix a_stored = __stored_matrix(a);
+	Matrix b_stored = __stored_matrix(b);
+	Matrix product = { out, n_rows, n_columns, n_rows * n_columns };
+	Matrix* target = &product;
+
+	ChainEpilogue fused = { chain, n_chain, sink };
+	MatEpilogue epilogue = MAT_EPILOGUE_INIT;
+	epilogue.tile = __chain_tile;
+	epilogue.tile_argv = &fused;
+	const bool needs_epilogue = n_chain > 0 || !sink->out;
+
+	UtilStatus status = mat_gemm_unchecked(a->trans, b->trans, 1.0f, &a_stored, &b_stored, 0.0f, &target, needs_epilogue ? &epilogue : NULL);
+
+	if (!sink->out)
+		__release_buffer(graph, out);
+
+	return status;
+}
+
+static UtilStatus __view_rows(const View* base, const ChainOp* chain, size_t n_chain, Sink* sink)
+{
+	Vector* row_vec = NULL;
+	if (vec_init(&row_vec, base->n_columns) != UTIL_OK)
+		return UTIL_ERROR_ALLOCATION;
+
+	for (size_t r = 0; r < base->n_rows; ++r)
+	{
+		if (base->trans)
+			for (size_t c = 0; c < base->n_columns; ++c)
+				row_vec->data[c] = __view_at(base, r, c);
+		else
+			memcpy(row_vec->data, &base->data[r * base->n_columns], base->n_columns * sizeof(float));
+
+		__emit_row(chain, n_chain, row_vec->data, sink->out ? &sink->out[r * base->n_columns] : NULL, r, 0, base->n_columns, sink);
+	}
+
+	vec_free(&row_vec);
+
+	return UTIL_OK;
+}
+
+// compute node into the sink, fusing as much of the graph below it as possible.
+// on failure the buffers stay marked as in use, the caller resets the pool.
+static UtilStatus __compute(MatNode* node, Sink* sink)
+{
+	// walk down the chain of element-wise nodes which nobody else consumes - they
+	// can be applied on the fly instead of being materialized one by one
+	size_t n_chain = 0;
+	MatNode* base = node;
+	while (__is_elementwise(base) && (base == node || base->pending_uses == 1))
+	{
+		n_chain++;
+		base = base->inputs[0];
+	}
+
+	ChainOp* chain = NULL;
+	if (n_chain > 0)
+	{
+		chain = util_calloc(n_chain, sizeof(ChainOp));
+		if (!chain)
+			return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory while evaluating MatGraph.");
+	}
+
+	UtilStatus status = UTIL_OK;
+
+	// chain is stored bottom-up, i.e., in the order the operations are applied
+	MatNode* step_node = node;
+	for (size_t i = n_chain; i > 0 && status == UTIL_OK; --i)
+	{
+		ChainOp* step = &chain[i - 1];
+		step->kind = step_node->kind;
+		step->op = step_node->op;
+		step->value = step_node->value;
+		step->apply_func = step_node->apply_func;
+		step->argv = step_node->argv;
+		if (step_node->kind == NODE_ELEMENTWISE)
+			status = __eval(step_node->inputs[1], &step->other);
+		step_node = step_node->inputs[0];
+	}
+	if (status != UTIL_OK)
+	{
+		util_free(chain);
+		return status;
+	}
+
+	if (base->kind == NODE_MULTIPLY && (base == node || base->pending_uses == 1))
+	{
+		View a, b;
+		status = __eval(base->inputs[0], &a);
+		if (status == UTIL_OK)
+			status = __eval(base->inputs[1], &b);
+		if (status == UTIL_OK)
+			status = __multiply(node->graph, &a, &b, chain, n_chain, sink);
+		if (status != UTIL_OK)
+		{
+			util_free(chain);
+			return status;
+		}
+		__release(base->inputs[0]);
+		__release(base->inputs[1]);
+	}
+	else
+	{
+		View v;
+		status = __eval(base, &v);
+		if (status == UTIL_OK)
+			status = __view_rows(&v, chain, n_chain, sink);
+		if (status != UTIL_OK)
+		{
+			util_free(chain);
+			return status;
+		}
+		if (base != node)
+			__release(base);
+	}
+
+	step_node = node;
+	for (size_t i = 0; i < n_chain; ++i)
+	{
+		if (step_node->kind == NODE_ELEMENTWISE)
+			__release(step_node->inputs[1]);
+		step_node = step_node->inputs[0];
+	}
+
+	util_free(chain);
+
+	return UTIL_OK;
+}
+
+// hand every buffer back to the pool after a failed evaluation
+static void __reset_buffers(MatGraph* graph)
+{
+	for (size_t i = 0; i < graph->n_buffers; ++i)
+		graph->buffers[i].in_use = false;
+}
+
+static void __begin_eval(MatNode* root)
+{
+	size_t epoch = ++root->graph->epoch;
+	root->epoch = epoch;
+	root->pending_uses = 0;
+	root->evaluated = false;
+	root->buffer = NULL;
+	__count_uses(root, epoch);
+}
+
+Matrix* mat_lazy_eval(MatNode* node)
+{
+	INSTR_BEGIN(MAT_LAZY_EVAL);
+	if (!node)
+	{
+		util_raise(UTIL_ERROR_ARGUMENT, "Cannot evaluate a NULL node (a previous mat_lazy_* call failed).");
+		return NULL;
+	}
+
+	Matrix* result = NULL;
+	if (mat_init(&result, node->n_rows, node->n_columns) != UTIL_OK)
+		return NULL;
+	if (mat_lazy_eval_inplace(node, &result) != UTIL_OK)
+	{
+		mat_free(&result);
+		return NULL;
+	}
+	INSTR_END(sizeof(Matrix) + node->n_rows * node->n_columns * sizeof(float), node->n_rows * node->n_columns * sizeof(float), 0);
+
+	return result;
+}
+
+UtilStatus mat_lazy_eval_inplace(MatNode* node, Matrix** target)
+{
+	INSTR_BEGIN(MAT_LAZY_EVAL);
+	if (!node)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Cannot evaluate a NULL node (a previous mat_lazy_* call failed).");
+	if ((*target)->n_rows != node->n_rows || (*target)->n_columns != node->n_columns)
+		return util_raise(UTIL_ERROR_DIMENSION, "Target dimensions must match the node's dimensions when evaluating.");
+
+	__begin_eval(node);
+	Sink sink = { (*target)->data, 0.0 };
+	UtilStatus status = __compute(node, &sink);
+	if (status != UTIL_OK)
+	{
+		__reset_buffers(node->graph);
+		return status;
+	}
+	INSTR_END(0, (*target)->n_rows * (*target)->n_columns * sizeof(float), 0);
+
+	return UTIL_OK;
+}
+
+float mat_lazy_sum(MatNode* node)
+{
+	INSTR_BEGIN(MAT_LAZY_SUM);
+	if (!node)
+	{
+		util_raise(UTIL_ERROR_ARGUMENT, "Cannot evaluate a NULL node (a previous mat_lazy_* call failed).");
+		return NAN;
+	}
+
+	__begin_eval(node);
+	Sink sink = { NULL, 0.0 };
+	if (__compute(node, &sink) != UTIL_OK)
+	{
+		__reset_buffers(node->graph);
+		return NAN;
+	}
+
+	INSTR_END(0, 0, 0);
+
+	return (float)sink.sum;
+}
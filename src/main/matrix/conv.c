@@ -0,0 +1,321 @@
+#include "matrix.h"
+#include "vector.h"
+#include "util.h"
+#include "instrument.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// the im2col path lowers and multiplies bands of at least this many output pixels at a time, so every gemm call
+// has enough rows to amortize its blocking while the bands are still small enough to share out between threads
+#define CONV_BAND_PIXELS 256
+
+// number of threads for the parallel convolution, from the calling thread's context (1 without OpenMP)
+static size_t __n_threads(void)
+{
+#ifdef _OPENMP
+	const size_t n_threads = util_get_context()->n_threads;
+	return n_threads > 0 ? n_threads : (size_t)omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+static size_t __output_extent(const size_t size, const size_t kernel, const size_t stride, const size_t padding)
+{
+	return (size + 2 * padding - kernel) / stride + 1;
+}
+
+// whether the output extent is defined: a non-zero stride and a kernel that fits inside the padded input
+static bool __valid_shape(const MatConv2d* params)
+{
+	return params->stride > 0 && params->kernel_height > 0 && params->kernel_width > 0
+		&& params->height + 2 * params->padding >= params->kernel_height && params->width + 2 * params->padding >= params->kernel_width;
+}
+
+static UtilStatus __check_shape(const MatConv2d* params)
+{
+	if (params->stride == 0 || params->kernel_height == 0 || params->kernel_width == 0)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Stride and kernel size must be non-zero when convolving.");
+	if (params->height + 2 * params->padding < params->kernel_height || params->width + 2 * params->padding < params->kernel_width)
+		return util_raise(UTIL_ERROR_DIMENSION, "Kernel can't be larger than the padded input when convolving.");
+
+	return UTIL_OK;
+}
+
+UtilStatus mat_conv2d_output_size(const MatConv2d* params, size_t* height, size_t* width)
+{
+	UtilStatus status = __check_shape(params);
+	if (status != UTIL_OK)
+		return status;
+
+	*height = __output_extent(params->height, params->kernel_height, params->stride, params->padding);
+	*width = __output_extent(params->width, params->kernel_width, params->stride, params->padding);
+
+	return UTIL_OK;
+}
+
+static bool __use_direct(const MatConv2d* params)
+{
+	if (params->algorithm == MAT_CONV_AUTO)
+		return params->kernel_height == 3 && params->kernel_width == 3;
+
+	return params->algorithm == MAT_CONV_DIRECT;
+}
+
+// output rows per band, both paths work on independent bands of output rows
+static size_t __band_rows(const size_t out_width)
+{
+	return out_width >= CONV_BAND_PIXELS ? 1 : CONV_BAND_PIXELS / out_width;
+}
+
+// threads working on bands at once, each of which needs its own slice of the workspace
+static size_t __n_slices(const size_t n_bands)
+{
+	const size_t n_threads = __n_threads();
+	return n_bands < n_threads ? n_bands : n_threads;
+}
+
+// floats of workspace for n_slices bands lowered at once. 0 for the direct path, and for shapes mat_conv2d rejects anyway
+static size_t __workspace_size(const MatConv2d* params, const size_t in_channels, const bool parallel)
+{
+	if (__use_direct(params) || !__valid_shape(params))
+		return 0;
+
+	const size_t out_height = __output_extent(params->height, params->kernel_height, params->stride, params->padding);
+	const size_t out_width = __output_extent(params->width, params->kernel_width, params->stride, params->padding);
+	const size_t band_rows = __band_rows(out_width);
+	const size_t n_bands = (out_height + band_rows - 1) / band_rows;
+	const size_t n_slices = parallel ? __n_slices(n_bands) : 1;
+	return n_slices * band_rows * out_width * params->kernel_height * params->kernel_width * in_channels;
+}
+
+size_t mat_conv2d_workspace_size(const MatConv2d* params, const size_t in_channels)
+{
+	return __workspace_size(params, in_channels, false);
+}
+
+size_t mat_conv2d_parallel_workspace_size(const MatConv2d* params, const size_t in_channels)
+{
+	return __workspace_size(params, in_channels, true);
+}
+
+// same as mat_gemm's epilogue, on rows of n_filters outputs starting at output pixel first_pixel
+static void __apply_epilogue(float* rows, const size_t first_pixel, const size_t n_rows, const size_t n_filters, const MatEpilogue* epilogue)
+{
+	for (size_t r = 0; r < n_rows; ++r)
+	{
+		float* row = &rows[r * n_filters];
+		if (epilogue->bias)
+			for (size_t f = 0; f < n_filters; ++f)
+				row[f] += epilogue->bias->data[f];
+		if (epilogue->activation)
+			for (size_t f = 0; f < n_filters; ++f)
+				row[f] = epilogue->activation(row[f], epilogue->activation_argv);
+		if (epilogue->scale != 1.0f)
+			for (size_t f = 0; f < n_filters; ++f)
+				row[f] *= epilogue->scale;
+	}
+
+	if (epilogue->tile)
+		epilogue->tile(rows, first_pixel, 0, n_rows, n_filters, n_filters, epilogue->tile_argv);
+}
+
+// write the receptive field of every output pixel in rows [first_row, last_row) of the output as one row of cols,
+// in the same (kernel row, kernel column, channel) order as the filter rows. out-of-bounds (padding) taps are zeros.
+static void __im2col(const Matrix* input, const MatConv2d* params, const size_t out_width, const size_t first_row, const size_t last_row, float* cols)
+{
+	const size_t n_channels = input->n_columns;
+	const size_t patch = params->kernel_height * params->kernel_width * n_channels;
+
+	for (size_t oy = first_row; oy < last_row; ++oy)
+		for (size_t ox = 0; ox < out_width; ++ox)
+		{
+			float* dst = &cols[((oy - first_row) * out_width + ox) * patch];
+			for (size_t ky = 0; ky < params->kernel_height; ++ky)
+			{
+				// unsigned wrap-around makes taps in the top / left padding fail the bounds check too
+				const size_t iy = oy * params->stride + ky - params->padding;
+				for (size_t kx = 0; kx < params->kernel_width; ++kx)
+				{
+					const size_t ix = ox * params->stride + kx - params->padding;
+					float* tap = &dst[(ky * params->kernel_width + kx) * n_channels];
+					// channels are contiguous in the input, so each tap is a single copy
+					if (iy < params->height && ix < params->width)
+						memcpy(tap, &input->data[(iy * params->width + ix) * n_channels], n_channels * sizeof(float));
+					else
+						memset(tap, 0, n_channels * sizeof(float));
+				}
+			}
+		}
+}
+
+// compute output rows [first_row, last_row) straight from the input into out (which starts at first_row).
+// every tap scales a filter row into the pixel's outputs, so the innermost loop runs over the contiguous filters
+static void __conv_direct(const Matrix* input, const Matrix* filters, const MatConv2d* params, const size_t out_width, const size_t first_row, const size_t last_row, float* out)
+{
+	const size_t n_channels = input->n_columns;
+	const size_t n_filters = filters->n_columns;
+
+	for (size_t oy = first_row; oy < last_row; ++oy)
+		for (size_t ox = 0; ox < out_width; ++ox)
+		{
+			float* acc = &out[((oy - first_row) * out_width + ox) * n_filters];
+			for (size_t f = 0; f < n_filters; ++f)
+				acc[f] = 0.0f;
+
+			for (size_t ky = 0; ky < params->kernel_height; ++ky)
+			{
+				const size_t iy = oy * params->stride + ky - params->padding;
+				if (iy >= params->height)
+					continue;
+
+				for (size_t kx = 0; kx < params->kernel_width; ++kx)
+				{
+					const size_t ix = ox * params->stride + kx - params->padding;
+					if (ix >= params->width)
+						continue;
+
+					const float* pixel = &input->data[(iy * params->width + ix) * n_channels];
+					const float* weights = &filters->data[(ky * params->kernel_width + kx) * n_channels * n_filters];
+					for (size_t c = 0; c < n_channels; ++c)
+					{
+						const float value = pixel[c];
+						const float* w_row = &weights[c * n_filters];
+						for (size_t f = 0; f < n_filters; ++f)
+							acc[f] += value * w_row[f];
+					}
+				}
+			}
+		}
+}
+
+static UtilStatus __check_conv2d(const Matrix* input, const Matrix* filters, const MatConv2d* params, const float* workspace, const Matrix* target, const MatEpilogue* epilogue)
+{
+	size_t out_height, out_width;
+	UtilStatus status = mat_conv2d_output_size(params, &out_height, &out_width);
+	if (status != UTIL_OK)
+		return status;
+	if (params->algorithm != MAT_CONV_AUTO && params->algorithm != MAT_CONV_IM2COL && params->algorithm != MAT_CONV_DIRECT)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Unknown convolution algorithm.");
+	if (input->n_rows != params->height * params->width)
+		return util_raise(UTIL_ERROR_DIMENSION, "Input must have height * width rows when convolving.");
+	if (filters->n_rows != params->kernel_height * params->kernel_width * input->n_columns)
+		return util_raise(UTIL_ERROR_DIMENSION, "Filters must have kernel_height * kernel_width * channels rows when convolving.");
+	if (target->n_rows != out_height * out_width || target->n_columns != filters->n_columns)
+		return util_raise(UTIL_ERROR_DIMENSION, "Target must be (output height * output width, filters) when convolving.");
+	if (epilogue && epilogue->bias && epilogue->bias->n_elem != filters->n_columns)
+		return util_raise(UTIL_ERROR_DIMENSION, "Bias length must match the number of filters.");
+	if (!workspace && mat_conv2d_workspace_size(params, input->n_columns) > 0)
+		return util_raise(UTIL_ERROR_ARGUMENT, "The im2col path needs a workspace of mat_conv2d_workspace_size (or mat_conv2d_parallel_workspace_size) floats.");
+
+	return UTIL_OK;
+}
+
+static UtilStatus __conv2d(
+		const Matrix* input,
+		const Matrix* filters,
+		const MatConv2d* params,
+		float* workspace,
+		Matrix** target,
+		const MatEpilogue* epilogue,
+		const bool parallel)
+{
+	INSTR_BEGIN(MAT_CONV2D);
+	UtilStatus status = __check_conv2d(input, filters, params, workspace, *target, epilogue);
+	if (status != UTIL_OK)
+		return status;
+
+	size_t out_height, out_width;
+	mat_conv2d_output_size(params, &out_height, &out_width); // validated above
+	const size_t n_filters = filters->n_columns;
+	const size_t patch = filters->n_rows;
+	const bool direct = __use_direct(params);
+
+	const size_t band_rows = __band_rows(out_width);
+	const size_t n_bands = (out_height + band_rows - 1) / band_rows;
+
+	MatTuning tuning;
+	mat_get_tuning(&tuning);
+
+	// OpenMP's threads start out on their own default contexts, so they run the bands under the caller's instead
+	// (its allocator and tuning reach the multiply kernel). nothing in here draws from the context's generator.
+	UtilContext* ctx = util_get_context();
+
+	// never more threads than the workspace has slices for
+	#pragma omp parallel num_threads((int)__n_slices(n_bands)) proc_bind(spread) if(parallel && out_height * out_width * n_filters >= tuning.parallel_threshold)
+	{
+		UtilContext* previous = util_get_context();
+		util_set_context(ctx);
+
+		#pragma omp for schedule(static)
+		for (size_t b = 0; b < n_bands; ++b)
+		{
+			INSTR_NESTED();
+			const size_t first_row = b * band_rows;
+			const size_t last_row = first_row + band_rows < out_height ? first_row + band_rows : out_height;
+			const size_t n_pixels = (last_row - first_row) * out_width;
+			float* out = &(*target)->data[first_row * out_width * n_filters];
+
+			if (direct)
+			{
+				__conv_direct(input, filters, params, out_width, first_row, last_row, out);
+				if (epilogue)
+					__apply_epilogue(out, first_row * out_width, n_pixels, n_filters, epilogue);
+				continue;
+			}
+
+			// each thread lowers its bands into its own slice of the workspace, so threads never touch each other's data
+			size_t slice = 0;
+#ifdef _OPENMP
+			slice = (size_t)omp_get_thread_num();
+#endif
+			float* cols = &workspace[slice * band_rows * out_width * patch];
+			__im2col(input, params, out_width, first_row, last_row, cols);
+
+			// (n_pixels, patch) x (patch, n_filters) lands directly in the band's rows of the target. nothing transposed, so the kernel doesn't allocate.
+			// the kernel only knows about the band, so a positional tile callback is called here with the band's offset instead
+			Matrix cols_view = { cols, n_pixels, patch, n_pixels * patch };
+			Matrix out_view = { out, n_pixels, n_filters, n_pixels * n_filters };
+			Matrix* out_target = &out_view;
+			MatEpilogue band_epilogue;
+			const MatEpilogue* gemm_epilogue = epilogue;
+			if (epilogue && epilogue->tile)
+			{
+				band_epilogue = *epilogue;
+				band_epilogue.tile = NULL;
+				gemm_epilogue = &band_epilogue;
+			}
+			const UtilStatus band_status = mat_gemm_unchecked(false, false, 1.0f, &cols_view, filters, 0.0f, &out_target, gemm_epilogue);
+			if (band_status != UTIL_OK)
+			{
+				#pragma omp atomic write
+				status = band_status;
+				continue;
+			}
+			if (epilogue && epilogue->tile)
+				epilogue->tile(out, first_row * out_width, 0, n_pixels, n_filters, n_filters, epilogue->tile_argv);
+		}
+
+		util_set_context(previous);
+	}
+
+	// the kernel already raised it, on whichever thread ran the band
+	if (status != UTIL_OK)
+		return status;
+
+	INSTR_END(0, (input->n_rows * input->n_columns + patch * n_filters + out_height * out_width * n_filters) * sizeof(float), 2 * out_height * out_width * n_filters * patch);
+
+	return UTIL_OK;
+}
+
+UtilStatus mat_conv2d(const Matrix* input, const Matrix* filters, const MatConv2d* params, float* workspace, Matrix** target, const MatEpilogue* epilogue)
+{
+	return __conv2d(input, filters, params, workspace, target, epilogue, false);
+}
+
+UtilStatus mat_conv2d_parallel(const Matrix* input, const Matrix* filters, const MatConv2d* params, float* workspace, Matrix** target, const MatEpilogue* epilogue)
+{
+	return __conv2d(input, filters, params, workspace, target, epilogue, true);
+}
@@ -0,0 +1,286 @@
+#include <math.h>
+#include "matrix.h"
+#include "util.h"
+#include "instrument.h"
+
+// distances are computed in (DISTANCE_TILE_ROWS, DISTANCE_TILE_COLUMNS) tiles of the full distance matrix
+// by mat_knn, so its scratch space doesn't depend on the size of the inputs
+#define DISTANCE_TILE_ROWS 64
+#define DISTANCE_TILE_COLUMNS 1024
+
+// squared L2 norm of every row, accumulated in double so long rows don't lose precision
+static void __row_norms(const Matrix* mat, float* norms)
+{
+	for (size_t r = 0; r < mat->n_rows; ++r)
+	{
+		const float* row = &mat->data[r * mat->n_columns];
+		double sum = 0.0;
+		for (size_t c = 0; c < mat->n_columns; ++c)
+			sum += (double)row[c] * row[c];
+		norms[r] = (float)sum;
+	}
+}
+
+// non-owning matrix over n_rows consecutive rows of mat, starting at first_row. never free this.
+static Matrix __row_view(const Matrix* mat, const size_t first_row, const size_t n_rows)
+{
+	Matrix view;
+	view.data = &mat->data[first_row * mat->n_columns];
+	view.n_rows = n_rows;
+	view.n_columns = mat->n_columns;
+	view.capacity = n_rows * mat->n_columns;
+	return view;
+}
+
+// distances between rows [a_first, a_first + n_rows) of a and rows [b_first, b_first + n_columns) of b, written
+// into out (n_rows, n_columns). the dot products come from the gemm kernel: ||a - b||^2 = ||a||^2 + ||b||^2 - 2 a.b
+static UtilStatus __distance_tile(
+		const Matrix* a,
+		const float* a_norms,
+		const size_t a_first,
+		const size_t n_rows,
+		const Matrix* b,
+		const float* b_norms,
+		const size_t b_first,
+		const size_t n_columns,
+		const MatMetric metric,
+		float* out)
+{
+	const Matrix a_view = __row_view(a, a_first, n_rows);
+	const Matrix b_view = __row_view(b, b_first, n_columns);
+	Matrix out_view = { out, n_rows, n_columns, n_rows * n_columns };
+	Matrix* target = &out_view;
+
+	UtilStatus status = mat_gemm_unchecked(false, true, 1.0f, &a_view, &b_view, 0.0f, &target, NULL);
+	if (status != UTIL_OK)
+		return status;
+
+	for (size_t r = 0; r < n_rows; ++r)
+	{
+		const float a_norm = a_norms[a_first + r];
+		float* row = &out[r * n_columns];
+		for (size_t c = 0; c < n_columns; ++c)
+		{
+			const float b_norm = b_norms[b_first + c];
+			const float dot = row[c];
+			if (metric == MAT_METRIC_COSINE)
+			{
+				// rows with no direction aren't similar to anything
+				const float denominator = sqrtf(a_norm) * sqrtf(b_norm);
+				row[c] = denominator > 0.0f ? 1.0f - dot / denominator : 1.0f;
+			}
+			else
+			{
+				// cancellation can push near-identical rows slightly below 0
+				float squared = a_norm + b_norm - 2.0f * dot;
+				if (squared < 0.0f)
+					squared = 0.0f;
+				row[c] = metric == MAT_METRIC_EUCLIDEAN ? sqrtf(squared) : squared;
+			}
+		}
+	}
+
+	return UTIL_OK;
+}
+
+static UtilStatus __check_distance(const Matrix* a, const Matrix* b, const MatMetric metric)
+{
+	if (a->n_columns != b->n_columns)
+		return util_raise(UTIL_ERROR_DIMENSION, "Both matrices must have the same column count when computing distances.");
+	if (metric != MAT_METRIC_EUCLIDEAN && metric != MAT_METRIC_SQUARED_EUCLIDEAN && metric != MAT_METRIC_COSINE)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Unknown distance metric.");
+
+	return UTIL_OK;
+}
+
+// compute the norms of both inputs into one allocation, a's first. NULL if it can't be allocated
+static float* __norms(const Matrix* a, const Matrix* b)
+{
+	float* norms = util_malloc((a->n_rows + b->n_rows + 1) * sizeof(float));
+	if (!norms)
+		return NULL;
+
+	__row_norms(a, norms);
+	__row_norms(b, &norms[a->n_rows]);
+	return norms;
+}
+
+Matrix* mat_pairwise_distances(const Matrix* a, const Matrix* b, const MatMetric metric)
+{
+	INSTR_BEGIN(MAT_PAIRWISE_DISTANCES);
+	if (__check_distance(a, b, metric) != UTIL_OK)
+		return NULL;
+
+	Matrix* distances = NULL;
+	if (mat_init(&distances, a->n_rows, b->n_rows) != UTIL_OK)
+		return NULL;
+
+	float* norms = __norms(a, b);
+	if (!norms)
+	{
+		mat_free(&distances);
+		util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory while computing distances.");
+		return NULL;
+	}
+
+	// the result is already (n, m), so it serves as the tile buffer - go one row tile at a time to keep the fix-up pass in cache
+	UtilStatus status = UTIL_OK;
+	for (size_t r = 0; r < a->n_rows && status == UTIL_OK; r += DISTANCE_TILE_ROWS)
+	{
+		const size_t n_rows = a->n_rows - r < DISTANCE_TILE_ROWS ? a->n_rows - r : DISTANCE_TILE_ROWS;
+		status = __distance_tile(a, norms, r, n_rows, b, &norms[a->n_rows], 0, b->n_rows, metric, &distances->data[r * b->n_rows]);
+	}
+
+	util_free(norms);
+	if (status != UTIL_OK)
+	{
+		mat_free(&distances);
+		return NULL;
+	}
+
+	INSTR_END(sizeof(Matrix) + a->n_rows * b->n_rows * sizeof(float), (a->n_rows + b->n_rows) * a->n_columns * sizeof(float) + a->n_rows * b->n_rows * sizeof(float), 2 * a->n_rows * b->n_rows * a->n_columns);
+
+	return distances;
+}
+
+// bounded max-heap of the k closest candidates seen so far for one query row, the farthest one on top
+typedef struct Neighbours
+{
+	float* distances;
+	size_t* indices;
+	size_t size;
+} Neighbours;
+
+static void __swap_neighbours(Neighbours* heap, const size_t i, const size_t j)
+{
+	const float distance = heap->distances[i];
+	heap->distances[i] = heap->distances[j];
+	heap->distances[j] = distance;
+
+	const size_t index = heap->indices[i];
+	heap->indices[i] = heap->indices[j];
+	heap->indices[j] = index;
+}
+
+static void __sift_down(Neighbours* heap, size_t i, const size_t size)
+{
+	while (true)
+	{
+		size_t largest = i;
+		const size_t left = 2 * i + 1, right = 2 * i + 2;
+		if (left < size && heap->distances[left] > heap->distances[largest])
+			largest = left;
+		if (right < size && heap->distances[right] > heap->distances[largest])
+			largest = right;
+		if (largest == i)
+			return;
+
+		__swap_neighbours(heap, i, largest);
+		i = largest;
+	}
+}
+
+static void __push_neighbour(Neighbours* heap, const size_t k, const float distance, const size_t index)
+{
+	if (heap->size < k)
+	{
+		// sift the new candidate up
+		size_t i = heap->size++;
+		heap->distances[i] = distance;
+		heap->indices[i] = index;
+		while (i > 0 && heap->distances[(i - 1) / 2] < heap->distances[i])
+		{
+			__swap_neighbours(heap, i, (i - 1) / 2);
+			i = (i - 1) / 2;
+		}
+	}
+	else if (distance < heap->distances[0])
+	{
+		// closer than the farthest one we're keeping, replace it
+		heap->distances[0] = distance;
+		heap->indices[0] = index;
+		__sift_down(heap, 0, k);
+	}
+}
+
+// heap sort in place, leaving the neighbours ordered from closest to farthest
+static void __sort_neighbours(Neighbours* heap)
+{
+	for (size_t end = heap->size; end > 1; --end)
+	{
+		__swap_neighbours(heap, 0, end - 1);
+		__sift_down(heap, 0, end - 1);
+	}
+}
+
+UtilStatus mat_knn(const Matrix* a, const Matrix* b, const size_t k, const MatMetric metric, size_t* indices, float* distances)
+{
+	INSTR_BEGIN(MAT_KNN);
+	UtilStatus status = __check_distance(a, b, metric);
+	if (status != UTIL_OK)
+		return status;
+	if (k == 0 || k > b->n_rows)
+		return util_raise(UTIL_ERROR_ARGUMENT, "k must be between 1 and the number of rows in b.");
+
+	float* norms = __norms(a, b);
+	float* tile = util_malloc(DISTANCE_TILE_ROWS * DISTANCE_TILE_COLUMNS * sizeof(float));
+	// storage for the heaps of one row tile
+	float* heap_distances = util_malloc(DISTANCE_TILE_ROWS * k * sizeof(float));
+	size_t* heap_indices = util_malloc(DISTANCE_TILE_ROWS * k * sizeof(size_t));
+	if (!norms || !tile || !heap_distances || !heap_indices)
+	{
+		util_free(norms);
+		util_free(tile);
+		util_free(heap_distances);
+		util_free(heap_indices);
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory while searching nearest neighbours.");
+	}
+	const float* b_norms = &norms[a->n_rows];
+
+	for (size_t r = 0; r < a->n_rows && status == UTIL_OK; r += DISTANCE_TILE_ROWS)
+	{
+		const size_t n_rows = a->n_rows - r < DISTANCE_TILE_ROWS ? a->n_rows - r : DISTANCE_TILE_ROWS;
+		Neighbours heaps[DISTANCE_TILE_ROWS];
+		for (size_t i = 0; i < n_rows; ++i)
+		{
+			heaps[i].distances = &heap_distances[i * k];
+			heaps[i].indices = &heap_indices[i * k];
+			heaps[i].size = 0;
+		}
+
+		// stream over b in column tiles, only ever holding one (n_rows, DISTANCE_TILE_COLUMNS) block of distances
+		for (size_t c = 0; c < b->n_rows && status == UTIL_OK; c += DISTANCE_TILE_COLUMNS)
+		{
+			const size_t n_columns = b->n_rows - c < DISTANCE_TILE_COLUMNS ? b->n_rows - c : DISTANCE_TILE_COLUMNS;
+			status = __distance_tile(a, norms, r, n_rows, b, b_norms, c, n_columns, metric, tile);
+			if (status != UTIL_OK)
+				break;
+
+			for (size_t i = 0; i < n_rows; ++i)
+			{
+				const float* row = &tile[i * n_columns];
+				for (size_t j = 0; j < n_columns; ++j)
+					__push_neighbour(&heaps[i], k, row[j], c + j);
+			}
+		}
+		if (status != UTIL_OK)
+			break;
+
+		for (size_t i = 0; i < n_rows; ++i)
+		{
+			__sort_neighbours(&heaps[i]);
+			memcpy(&indices[(r + i) * k], heaps[i].indices, k * sizeof(size_t));
+			if (distances)
+				memcpy(&distances[(r + i) * k], heaps[i].distances, k * sizeof(float));
+		}
+	}
+
+	util_free(norms);
+	util_free(tile);
+	util_free(heap_distances);
+	util_free(heap_indices);
+
+	INSTR_END((a->n_rows + b->n_rows + DISTANCE_TILE_ROWS * DISTANCE_TILE_COLUMNS) * sizeof(float) + DISTANCE_TILE_ROWS * k * (sizeof(float) + sizeof(size_t)), (a->n_rows + b->n_rows) * a->n_columns * sizeof(float), 2 * a->n_rows * b->n_rows * a->n_columns);
+
+	return status;
+}
@@ -0,0 +1,358 @@
+#include <math.h>
+#include <stdint.h>
+#include "matrix.h"
+#include "util.h"
+#include "instrument.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define GROUPBY_INITIAL_GROUPS 16
+
+// open-addressing hash table from key to group. the groups themselves are stored in the order their keys were
+// first inserted, which is what gives mat_groupby_agg its output order (and makes merging tables order-preserving).
+typedef struct GroupTable
+{
+	// allocator of the thread that called mat_groupby_agg - the parallel workers have contexts of their own
+	const UtilContext* ctx;
+	UtilStatus status;
+	size_t* slots; // group index + 1 per slot, 0 means empty
+	size_t n_slots; // always a power of 2, at least twice the number of groups
+	uint32_t* keys; // normalized key bits per group
+	size_t* counts; // rows per group
+	double* values; // n_aggs accumulators per group (+ 1 so the buffer is never empty when there are no aggregates)
+	size_t n_groups;
+	size_t capacity;
+	size_t n_aggs;
+} GroupTable;
+
+#ifdef _OPENMP
+// number of threads for the parallel group-by, from the calling thread's context
+static int __n_threads(void)
+{
+	const size_t n_threads = util_get_context()->n_threads;
+	return n_threads > 0 ? (int)n_threads : omp_get_max_threads();
+}
+#endif
+
+// bits of the key with -0 folded into 0 and every NaN into the same NaN, so equal keys hash equally
+static uint32_t __key_bits(float key)
+{
+	if (key != key)
+		key = NAN;
+	else if (key == 0.0f)
+		key = 0.0f;
+
+	uint32_t bits;
+	memcpy(&bits, &key, sizeof(bits));
+	return bits;
+}
+
+static size_t __hash_slot(const uint32_t bits, const size_t n_slots)
+{
+	// fibonacci hashing, the high half of the product is well mixed even for keys differing only in the low bits
+	return (size_t)(((uint64_t)bits * 0x9E3779B97F4A7C15ull) >> 32) & (n_slots - 1);
+}
+
+static UtilStatus __table_init(GroupTable* table, const UtilContext* ctx, const size_t n_aggs)
+{
+	table->ctx = ctx;
+	table->n_slots = 2 * GROUPBY_INITIAL_GROUPS;
+	table->capacity = GROUPBY_INITIAL_GROUPS;
+	table->n_groups = 0;
+	table->n_aggs = n_aggs;
+	table->slots = ctx->alloc(table->n_slots * sizeof(size_t), ctx->alloc_argv);
+	table->keys = ctx->alloc(table->capacity * sizeof(uint32_t), ctx->alloc_argv);
+	table->counts = ctx->alloc(table->capacity * sizeof(size_t), ctx->alloc_argv);
+	table->values = ctx->alloc(table->capacity * (n_aggs + 1) * sizeof(double), ctx->alloc_argv);
+	if (!table->slots || !table->keys || !table->counts || !table->values)
+		return UTIL_ERROR_ALLOCATION;
+
+	memset(table->slots, 0, table->n_slots * sizeof(size_t));
+	return UTIL_OK;
+}
+
+static void __table_free(GroupTable* table)
+{
+	// tables of threads that never started were never initialized
+	const UtilContext* ctx = table->ctx;
+	if (!ctx)
+		return;
+
+	void* buffers[] = { table->slots, table->keys, table->counts, table->values };
+	for (size_t i = 0; i < sizeof(buffers) / sizeof(buffers[0]); ++i)
+		if (buffers[i])
+			ctx->dealloc(buffers[i], ctx->alloc_argv);
+}
+
+// double the number of slots and re-insert every group
+static UtilStatus __grow_slots(GroupTable* table)
+{
+	const UtilContext* ctx = table->ctx;
+	const size_t n_slots = 2 * table->n_slots;
+	size_t* slots = ctx->alloc(n_slots * sizeof(size_t), ctx->alloc_argv);
+	if (!slots)
+		return UTIL_ERROR_ALLOCATION;
+
+	memset(slots, 0, n_slots * sizeof(size_t));
+	for (size_t g = 0; g < table->n_groups; ++g)
+	{
+		size_t slot = __hash_slot(table->keys[g], n_slots);
+		while (slots[slot])
+			slot = (slot + 1) & (n_slots - 1);
+		slots[slot] = g + 1;
+	}
+
+	ctx->dealloc(table->slots, ctx->alloc_argv);
+	table->slots = slots;
+	table->n_slots = n_slots;
+	return UTIL_OK;
+}
+
+// double the storage for groups. each buffer is swapped in as soon as it's reallocated, so a failure halfway leaves the table consistent
+static UtilStatus __grow_groups(GroupTable* table)
+{
+	const UtilContext* ctx = table->ctx;
+	const size_t capacity = 2 * table->capacity;
+
+	uint32_t* keys = ctx->realloc(table->keys, capacity * sizeof(uint32_t), ctx->alloc_argv);
+	if (!keys)
+		return UTIL_ERROR_ALLOCATION;
+	table->keys = keys;
+
+	size_t* counts = ctx->realloc(table->counts, capacity * sizeof(size_t), ctx->alloc_argv);
+	if (!counts)
+		return UTIL_ERROR_ALLOCATION;
+	table->counts = counts;
+
+	double* values = ctx->realloc(table->values, capacity * (table->n_aggs + 1) * sizeof(double), ctx->alloc_argv);
+	if (!values)
+		return UTIL_ERROR_ALLOCATION;
+	table->values = values;
+
+	table->capacity = capacity;
+	return UTIL_OK;
+}
+
+// find the group of a key, adding an empty one (identity accumulators) if it's new
+static UtilStatus __find_group(GroupTable* table, const uint32_t bits, const MatAgg* aggs, size_t* group)
+{
+	size_t slot = __hash_slot(bits, table->n_slots);
+	while (table->slots[slot])
+	{
+		const size_t g = table->slots[slot] - 1;
+		if (table->keys[g] == bits)
+		{
+			*group = g;
+			return UTIL_OK;
+		}
+		slot = (slot + 1) & (table->n_slots - 1);
+	}
+
+	if (table->n_groups == table->capacity)
+	{
+		UtilStatus status = __grow_groups(table);
+		if (status != UTIL_OK)
+			return status;
+	}
+
+	const size_t g = table->n_groups++;
+	table->keys[g] = bits;
+	table->counts[g] = 0;
+	double* values = &table->values[g * table->n_aggs];
+	for (size_t a = 0; a < table->n_aggs; ++a)
+		values[a] = aggs[a].op == MAT_AGG_MIN ? INFINITY : aggs[a].op == MAT_AGG_MAX ? -INFINITY : 0.0;
+	table->slots[slot] = g + 1;
+	*group = g;
+
+	// keep the load factor at most 1/2 so probe sequences stay short
+	if (2 * table->n_groups > table->n_slots)
+		return __grow_slots(table);
+
+	return UTIL_OK;
+}
+
+// fold a row's value (or another table's accumulator) into an accumulator. a NaN sticks: nothing compares smaller or larger
+static void __fold(double* value, const double other, const MatAggOp op)
+{
+	switch (op)
+	{
+		case MAT_AGG_SUM:
+		case MAT_AGG_MEAN:
+			*value += other;
+			break;
+		case MAT_AGG_MIN:
+			if (other != other || other < *value)
+				*value = other;
+			break;
+		case MAT_AGG_MAX:
+			if (other != other || other > *value)
+				*value = other;
+			break;
+		case MAT_AGG_COUNT:
+			// taken from the group's row count
+			break;
+	}
+}
+
+// group rows [first, last) of mat into the table
+static UtilStatus __group_rows(
+		GroupTable* table,
+		const Matrix* mat,
+		const size_t key_col,
+		const MatAgg* aggs,
+		const size_t first,
+		const size_t last)
+{
+	for (size_t r = first; r < last; ++r)
+	{
+		const float* row = &mat->data[r * mat->n_columns];
+		size_t g;
+		UtilStatus status = __find_group(table, __key_bits(row[key_col]), aggs, &g);
+		if (status != UTIL_OK)
+			return status;
+
+		++table->counts[g];
+		double* values = &table->values[g * table->n_aggs];
+		for (size_t a = 0; a < table->n_aggs; ++a)
+			if (aggs[a].op != MAT_AGG_COUNT) // its column doesn't have to exist
+				__fold(&values[a], row[aggs[a].column], aggs[a].op);
+	}
+
+	return UTIL_OK;
+}
+
+// fold every group of source into target, in source's order
+static UtilStatus __merge_tables(GroupTable* target, const GroupTable* source, const MatAgg* aggs)
+{
+	for (size_t s = 0; s < source->n_groups; ++s)
+	{
+		size_t g;
+		UtilStatus status = __find_group(target, source->keys[s], aggs, &g);
+		if (status != UTIL_OK)
+			return status;
+
+		target->counts[g] += source->counts[s];
+		double* values = &target->values[g * target->n_aggs];
+		for (size_t a = 0; a < target->n_aggs; ++a)
+			__fold(&values[a], source->values[s * source->n_aggs + a], aggs[a].op);
+	}
+
+	return UTIL_OK;
+}
+
+static UtilStatus __check_groupby(const Matrix* mat, const size_t key_col, const MatAgg* aggs, const size_t n_aggs)
+{
+	if (key_col >= mat->n_columns)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Key column out of range when grouping rows.");
+	if (n_aggs > 0 && !aggs)
+		return util_raise(UTIL_ERROR_ARGUMENT, "No aggregates given when grouping rows.");
+
+	for (size_t a = 0; a < n_aggs; ++a)
+	{
+		if (aggs[a].column >= mat->n_columns && aggs[a].op != MAT_AGG_COUNT)
+			return util_raise(UTIL_ERROR_ARGUMENT, "Aggregate column out of range when grouping rows.");
+		if (aggs[a].op != MAT_AGG_SUM && aggs[a].op != MAT_AGG_COUNT && aggs[a].op != MAT_AGG_MEAN && aggs[a].op != MAT_AGG_MIN && aggs[a].op != MAT_AGG_MAX)
+			return util_raise(UTIL_ERROR_ARGUMENT, "Unknown aggregate when grouping rows.");
+	}
+
+	return UTIL_OK;
+}
+
+// write one row per group: the key, then the finished aggregates
+static Matrix* __groups_to_matrix(const GroupTable* table, const MatAgg* aggs)
+{
+	const size_t n_aggs = table->n_aggs;
+	Matrix* result = NULL;
+	if (mat_init(&result, table->n_groups, 1 + n_aggs) != UTIL_OK)
+		return NULL;
+
+	for (size_t g = 0; g < table->n_groups; ++g)
+	{
+		float* row = &result->data[g * (1 + n_aggs)];
+		memcpy(&row[0], &table->keys[g], sizeof(float));
+
+		const double* values = &table->values[g * n_aggs];
+		for (size_t a = 0; a < n_aggs; ++a)
+		{
+			if (aggs[a].op == MAT_AGG_COUNT)
+				row[1 + a] = (float)table->counts[g];
+			else if (aggs[a].op == MAT_AGG_MEAN)
+				row[1 + a] = (float)(values[a] / table->counts[g]);
+			else
+				row[1 + a] = (float)values[a];
+		}
+	}
+
+	return result;
+}
+
+static Matrix* __groupby_agg(const Matrix* mat, const size_t key_col, const MatAgg* aggs, const size_t n_aggs, const bool parallel)
+{
+	INSTR_BEGIN(MAT_GROUPBY_AGG);
+	if (__check_groupby(mat, key_col, aggs, n_aggs) != UTIL_OK)
+		return NULL;
+
+	size_t n_tables = 1;
+#ifdef _OPENMP
+	MatTuning params;
+	mat_get_tuning(&params);
+	if (parallel && mat->n_rows * (1 + n_aggs) >= params.parallel_threshold)
+		n_tables = (size_t)__n_threads();
+#endif
+
+	GroupTable* tables = util_calloc(n_tables, sizeof(GroupTable));
+	if (!tables)
+	{
+		util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory while grouping rows.");
+		return NULL;
+	}
+	const UtilContext* ctx = util_get_context();
+
+	#pragma omp parallel num_threads(n_tables) proc_bind(spread) if(n_tables > 1)
+	{
+		size_t t = 0, n_workers = 1;
+#ifdef _OPENMP
+		t = (size_t)omp_get_thread_num();
+		n_workers = (size_t)omp_get_num_threads();
+#endif
+		// contiguous slices, so merging the tables in thread order sees the keys in the same order a serial pass would
+		const size_t first = mat->n_rows * t / n_workers;
+		const size_t last = mat->n_rows * (t + 1) / n_workers;
+		tables[t].status = __table_init(&tables[t], ctx, n_aggs);
+		if (tables[t].status == UTIL_OK)
+			tables[t].status = __group_rows(&tables[t], mat, key_col, aggs, first, last);
+	}
+
+	UtilStatus status = tables[0].status;
+	for (size_t t = 1; t < n_tables && status == UTIL_OK; ++t)
+		status = tables[t].status == UTIL_OK ? __merge_tables(&tables[0], &tables[t], aggs) : tables[t].status;
+
+	Matrix* result = NULL;
+	if (status == UTIL_OK)
+		result = __groups_to_matrix(&tables[0], aggs);
+	else
+		util_raise(status, "Couldn't allocate memory while grouping rows.");
+
+	for (size_t t = 0; t < n_tables; ++t)
+		__table_free(&tables[t]);
+	util_free(tables);
+
+	if (!result)
+		return NULL;
+
+	INSTR_END(sizeof(Matrix) + result->n_rows * result->n_columns * sizeof(float), mat->n_rows * (1 + n_aggs) * sizeof(float), mat->n_rows * n_aggs);
+
+	return result;
+}
+
+Matrix* mat_groupby_agg(const Matrix* mat, const size_t key_col, const MatAgg* aggs, const size_t n_aggs)
+{
+	return __groupby_agg(mat, key_col, aggs, n_aggs, false);
+}
+
+Matrix* mat_groupby_agg_parallel(const Matrix* mat, const size_t key_col, const MatAgg* aggs, const size_t n_aggs)
+{
+	return __groupby_agg(mat, key_col, aggs, n_aggs, true);
+}
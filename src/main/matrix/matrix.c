@@ -1,44 +1,251 @@
+#include <math.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "matrix.h"
 #include "vector.h"
 #include "util.h"
+#include "instrument.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef CMATRIX_NUMA
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// from linux/mempolicy.h, spelled out so building doesn't depend on libnuma's headers
+#define NUMA_MPOL_DEFAULT 0
+#define NUMA_MPOL_INTERLEAVE 3
+#define NUMA_MPOL_F_MEMS_ALLOWED (1 << 2)
+#define NUMA_MAX_NODES 1024
+
+// smallest buffer that gets interleaved. the policy sticks to the address range, so the buffer has to own its pages:
+// glibc serves requests this large (its largest dynamic mmap threshold) from a private mapping that is unmapped on
+// free. smaller ones live in the shared heap, where mbind would also move the policy of unrelated allocations.
+#define NUMA_INTERLEAVE_MIN_BYTES ((size_t)32 << 20)
+
+// smallest buffer whose pages are first-touched by the thread team. below that, the cost of starting the team outweighs
+// whatever placing a few pages buys
+#define NUMA_FIRST_TOUCH_MIN_BYTES ((size_t)1 << 20)
+#endif
 
 static size_t compute_offset(const size_t r, const size_t c, const size_t n_columns)
 {
 	return c + r * n_columns;
 }
 
-void mat_init(Matrix** mat, const size_t n_rows, const size_t n_columns)
+// process-wide kernel parameters. filled in on first use from the tuning profile if there is one, otherwise from the host's cache sizes
+static MatTuning tuning;
+static pthread_once_t tuning_once = PTHREAD_ONCE_INIT;
+static pthread_rwlock_t tuning_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void __load_tuning(void)
+{
+	mat_tuning_defaults(&tuning);
+	mat_tuning_load(NULL, &tuning);
+}
+
+// copy of the parameters in effect for the calling thread (its context's, if it has any)
+static MatTuning __get_tuning(void)
+{
+	const MatTuning* local = util_get_context()->tuning;
+	if (local)
+		return *local;
+
+	pthread_once(&tuning_once, __load_tuning);
+
+	pthread_rwlock_rdlock(&tuning_lock);
+	MatTuning result = tuning;
+	pthread_rwlock_unlock(&tuning_lock);
+
+	return result;
+}
+
+#ifdef _OPENMP
+// number of threads for the parallel regions, from the calling thread's context
+static int __n_threads(void)
+{
+	const size_t n_threads = util_get_context()->n_threads;
+	return n_threads > 0 ? (int)n_threads : omp_get_max_threads();
+}
+#endif
+
+#ifdef CMATRIX_NUMA
+// set the policy of the whole pages inside [data, data + bytes). only pages the buffer has entirely to itself are
+// touched, and the policy is just a placement hint: if the kernel refuses (no NUMA support, seccomp, ...) the pages
+// simply stay first-touch
+static void __numa_policy(void* data, const size_t bytes, const int mode, const unsigned long* nodes, const unsigned long max_node)
+{
+	const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+	const uintptr_t first = ((uintptr_t)data + page - 1) & ~(page - 1);
+	const uintptr_t last = ((uintptr_t)data + bytes) & ~(page - 1);
+	if (last > first)
+		syscall(SYS_mbind, (void*)first, last - first, mode, nodes, max_node, 0);
+}
+
+// spread the pages of a fresh buffer round-robin over the nodes the process may use
+static void __numa_interleave(void* data, const size_t bytes)
+{
+	if (bytes < NUMA_INTERLEAVE_MIN_BYTES)
+		return;
+
+	unsigned long nodes[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+	if (syscall(SYS_get_mempolicy, NULL, nodes, NUMA_MAX_NODES, NULL, NUMA_MPOL_F_MEMS_ALLOWED) != 0)
+		return;
+
+	__numa_policy(data, bytes, NUMA_MPOL_INTERLEAVE, nodes, NUMA_MAX_NODES);
+}
+
+// undo __numa_interleave before a buffer goes back to the allocator, in case a custom allocator recycles the range
+static void __numa_release(void* data, const size_t bytes)
+{
+	if (data && bytes >= NUMA_INTERLEAVE_MIN_BYTES)
+		__numa_policy(data, bytes, NUMA_MPOL_DEFAULT, NULL, 0);
+}
+#endif
+
+// whether a buffer of bytes should be written by a thread team so its pages land next to the threads that use it.
+// only in USE_NUMA builds with OpenMP, only for large buffers, and never from a thread that's already part of a team
+// or of the async pool (a nested team would just oversubscribe the cores)
+static bool __first_touch_parallel(const size_t bytes)
+{
+#if defined(CMATRIX_NUMA) && defined(_OPENMP)
+	return bytes >= NUMA_FIRST_TOUCH_MIN_BYTES && !omp_in_parallel() && !util_is_pool_worker();
+#else
+	(void)bytes;
+	return false;
+#endif
+}
+
+// write value to every element. blocks of gemm_block_rows rows are split between threads exactly like __gemm splits the
+// row blocks of its output (static schedule over the same blocks, same thread count, threads spread over the cores),
+// so the thread that first-touches a row block of a product is the one that computes it later and the pages land on its node
+static void __fill_rows(float* data, const size_t n_rows, const size_t n_columns, const float value, const bool parallel)
+{
+	const size_t block_rows = __get_tuning().gemm_block_rows;
+	const size_t n_row_blocks = (n_rows + block_rows - 1) / block_rows;
+
+	#pragma omp parallel for schedule(static) num_threads(__n_threads()) proc_bind(spread) if(parallel)
+	for (size_t rb = 0; rb < n_row_blocks; ++rb)
+		for (size_t r = rb * block_rows; r < n_rows && r < (rb + 1) * block_rows; ++r)
+			for (size_t c = 0; c < n_columns; ++c)
+				data[r * n_columns + c] = value;
+}
+
+// zeroed buffer for a (n_rows, n_columns) matrix, from calloc unless it's large enough to be zeroed by the thread
+// team (see __first_touch_parallel). in USE_NUMA builds the very large ones are interleaved before anything touches them
+static float* __alloc_data(const size_t n_rows, const size_t n_columns)
+{
+	const size_t n_elem = n_rows * n_columns;
+	if (n_elem <= SIZE_MAX / sizeof(float) && __first_touch_parallel(n_elem * sizeof(float)))
+	{
+		float* data = util_malloc(n_elem * sizeof(float));
+		if (!data)
+			return NULL;
+
+#ifdef CMATRIX_NUMA
+		__numa_interleave(data, n_elem * sizeof(float));
+#endif
+		__fill_rows(data, n_rows, n_columns, 0.0f, true);
+		return data;
+	}
+
+	float* data = util_calloc(n_elem, sizeof(float));
+#ifdef CMATRIX_NUMA
+	// calloc hands out pages this large untouched, so the policy still applies to all of them
+	if (data)
+		__numa_interleave(data, n_elem * sizeof(float));
+#endif
+	return data;
+}
+
+// give back a buffer from __alloc_data / __set_capacity holding capacity floats
+static void __free_data(float* data, const size_t capacity)
+{
+#ifdef CMATRIX_NUMA
+	__numa_release(data, capacity * sizeof(float));
+#else
+	(void)capacity;
+#endif
+	util_free(data);
+}
+
+void mat_get_tuning(MatTuning* target)
+{
+	*target = __get_tuning();
+}
+
+UtilStatus mat_set_tuning(const MatTuning* source)
+{
+	if (source->gemm_block_rows == 0 || source->gemm_block_columns == 0 || source->gemm_block_k == 0 || source->transpose_block == 0)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Block sizes in MatTuning must be non-zero.");
+	if (source->gemm_block_rows > MAT_TUNING_MAX_BLOCK || source->gemm_block_columns > MAT_TUNING_MAX_BLOCK || source->gemm_block_k > MAT_TUNING_MAX_BLOCK || source->transpose_block > MAT_TUNING_MAX_BLOCK)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Block sizes in MatTuning can't be larger than MAT_TUNING_MAX_BLOCK.");
+	if (source->strassen_cutoff == 1)
+		return util_raise(UTIL_ERROR_ARGUMENT, "The Strassen-Winograd cutoff must be 0 (disabled) or at least 2.");
+
+	// make sure the lazy load can't overwrite these later
+	pthread_once(&tuning_once, __load_tuning);
+
+	pthread_rwlock_wrlock(&tuning_lock);
+	tuning = *source;
+	pthread_rwlock_unlock(&tuning_lock);
+
+	return UTIL_OK;
+}
+
+UtilStatus mat_init(Matrix** mat, const size_t n_rows, const size_t n_columns)
 {
-	void* m_alloc = malloc(sizeof(Matrix));
+	INSTR_BEGIN(MAT_INIT);
+	*mat = NULL;
+
+	void* m_alloc = util_malloc(sizeof(Matrix));
 	if (!m_alloc)
-		util_error("Couldn't allocate memory for Matrix.");
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for Matrix.");
+
+	// an empty matrix may not get a buffer at all, that's fine (it can still be appended to)
+	void* d_alloc = __alloc_data(n_rows, n_columns);
+	if (!d_alloc && n_rows * n_columns > 0)
+	{
+		util_free(m_alloc);
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for Matrix data.");
+	}
+
 	*mat = m_alloc;
 	(*mat)->n_rows = n_rows;
 	(*mat)->n_columns = n_columns;
-
-	void* d_alloc = calloc(n_rows * n_columns, sizeof(float));
-	if (!d_alloc)
-		util_error("Couldn't allocate memory for Matrix data.");
+	(*mat)->capacity = n_rows * n_columns;
 	(*mat)->data = d_alloc;
+	INSTR_END(sizeof(Matrix) + n_rows * n_columns * sizeof(float), 0, 0);
+
+	return UTIL_OK;
 }
 
-void mat_reshape(Matrix** mat, const size_t r, const size_t c)
+UtilStatus mat_reshape(Matrix** mat, const size_t r, const size_t c)
 {
-	(*mat)->n_rows = r;
-	(*mat)->n_columns = c;
+	INSTR_BEGIN(MAT_RESHAPE);
+	void* d_alloc = __alloc_data(r, c);
+	if (!d_alloc && r * c > 0)
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate enough memory when trying to reshape Matrix.");
 
-	void* d_alloc = calloc(r * c, sizeof(float));
-	if (!d_alloc)
-		util_error("Couldn't allocate enough memory when trying to reshape Matrix.");
+	__free_data((*mat)->data, (*mat)->capacity); // dealloc old memory before reassigning
 
-	free((*mat)->data); // dealloc old memory before reassigning
+	(*mat)->n_rows = r;
+	(*mat)->n_columns = c;
+	(*mat)->capacity = r * c;
 	(*mat)->data = d_alloc;
+	INSTR_END(r * c * sizeof(float), 0, 0);
+
+	return UTIL_OK;
 }
 
 Matrix* mat_create(const float* data, const size_t n_rows, const size_t n_columns)
 {
+	INSTR_BEGIN(MAT_CREATE);
 	Matrix* mat = NULL;
-	mat_init(&mat, n_rows, n_columns);
+	if (mat_init(&mat, n_rows, n_columns) != UTIL_OK)
+		return NULL;
 	size_t offset_idx = 0;
 
 	for (size_t r = 0; r < n_rows; ++r)
@@ -50,22 +257,31 @@ Matrix* mat_create(const float* data, const size_t n_rows, const size_t n_column
 		}
 	}
 
+	INSTR_END(sizeof(Matrix) + n_rows * n_columns * sizeof(float), 2 * n_rows * n_columns * sizeof(float), 0);
+
 	return mat;
 }
 
 void mat_random(Matrix** mat, const float lower_bound, const float upper_bound)
 {
-	srand(time(NULL));
+	mat_random_r(mat, lower_bound, upper_bound, &util_get_context()->rng);
+}
 
+void mat_random_r(Matrix** mat, const float lower_bound, const float upper_bound, UtilRng* rng)
+{
+	INSTR_BEGIN(MAT_RANDOM);
 	for (size_t r = 0; r < (*mat)->n_rows; ++r)
 		for (size_t c = 0; c < (*mat)->n_columns; ++c)
-			(*mat)->data[compute_offset(r, c, (*mat)->n_columns)] = util_rand_between(lower_bound, upper_bound);
+			(*mat)->data[compute_offset(r, c, (*mat)->n_columns)] = util_rand_between_r(rng, lower_bound, upper_bound);
+	INSTR_END(0, (*mat)->n_rows * (*mat)->n_columns * sizeof(float), 0);
 }
 
 void mat_fill(Matrix** mat, const float value)
 {
-	for (size_t i = 0; i < (*mat)->n_rows * (*mat)->n_columns; ++i)
-		(*mat)->data[i] = value;
+	INSTR_BEGIN(MAT_FILL);
+	const size_t n_elem = (*mat)->n_rows * (*mat)->n_columns;
+	__fill_rows((*mat)->data, (*mat)->n_rows, (*mat)->n_columns, value, __first_touch_parallel(n_elem * sizeof(float)));
+	INSTR_END(0, (*mat)->n_rows * (*mat)->n_columns * sizeof(float), 0);
 }
 
 float mat_at(const Matrix* mat, const size_t r, const size_t c)
@@ -80,74 +296,100 @@ void mat_set(Matrix** mat, const size_t r, const size_t c, const float value)
 
 Vector* mat_get_row(const Matrix* mat, const size_t row)
 {
+	INSTR_BEGIN(MAT_GET_ROW);
 	Vector* v = NULL;
-	vec_init(&v, mat->n_columns);
+	if (vec_init(&v, mat->n_columns) != UTIL_OK)
+		return NULL;
 
 	for (size_t c = 0; c < mat->n_columns; ++c)
 		v->data[c] = mat->data[compute_offset(row, c, mat->n_columns)];
 
+	INSTR_END(sizeof(Vector) + mat->n_columns * sizeof(float), 2 * mat->n_columns * sizeof(float), 0);
+
 	return v;
 }
 
 void mat_get_row_inplace(const Matrix* mat, const size_t row, Vector** vec)
 {
+	INSTR_BEGIN(MAT_GET_ROW_INPLACE);
 	/*for (size_t c = 0; c < mat->n_columns; ++c)
 		(*vec)->data[c] = mat->data[compute_offset(row, c, mat->n_columns)];*/
 
 	// an optimization for copying contiguous data from a matrix
 	// from experimentation, this has improved performance a decent amount
 	memcpy((*vec)->data, &mat->data[row * mat->n_columns], mat->n_columns * sizeof(float));
+	INSTR_END(0, 2 * mat->n_columns * sizeof(float), 0);
 }
 
 Vector* mat_get_column(const Matrix* mat, const size_t column)
 {
+	INSTR_BEGIN(MAT_GET_COLUMN);
 	Vector* v = NULL;
-	vec_init(&v, mat->n_rows);
+	if (vec_init(&v, mat->n_rows) != UTIL_OK)
+		return NULL;
 
 	for (size_t r = 0; r < mat->n_rows; ++r)
 		v->data[r] = mat->data[compute_offset(r, column, mat->n_columns)];
 
+	INSTR_END(sizeof(Vector) + mat->n_rows * sizeof(float), 2 * mat->n_rows * sizeof(float), 0);
+
 	return v;
 }
 
 void mat_get_column_inplace(const Matrix* mat, const size_t column, Vector** vec)
 {
+	INSTR_BEGIN(MAT_GET_COLUMN_INPLACE);
 	for (size_t r = 0; r < mat->n_rows; ++r)
 		(*vec)->data[r] = mat->data[compute_offset(r, column, mat->n_columns)];
+	INSTR_END(0, 2 * mat->n_rows * sizeof(float), 0);
 }
 
 Matrix* mat_transpose(const Matrix* mat)
 {
+	INSTR_BEGIN(MAT_TRANSPOSE);
 	Matrix* tpose = NULL;
-	mat_init(&tpose, mat->n_columns, mat->n_rows);
+	if (mat_init(&tpose, mat->n_columns, mat->n_rows) != UTIL_OK)
+		return NULL;
+	mat_transpose_inplace(mat, &tpose);
 
-	for (size_t r = 0; r < mat->n_rows; ++r)
-		for (size_t c = 0; c < mat->n_columns; ++c)
-			tpose->data[compute_offset(c, r, tpose->n_columns)] = mat->data[compute_offset(r, c, mat->n_columns)];
+	INSTR_END(sizeof(Matrix) + mat->n_rows * mat->n_columns * sizeof(float), 2 * mat->n_rows * mat->n_columns * sizeof(float), 0);
 
 	return tpose;
 }
 
 void mat_transpose_inplace(const Matrix* mat, Matrix** target)
 {
+	INSTR_BEGIN(MAT_TRANSPOSE_INPLACE);
 	// the nice thing is that we can avoid additional allocation because multiplication is commutative, so the total size of data remains the same
 	(*target)->n_rows = mat->n_columns;
 	(*target)->n_columns = mat->n_rows;
 
-	// this double loop is faster than my attempt to make it linear time - probably because it had more comparisons
-	for (size_t r = 0; r < mat->n_rows; ++r)
-		for (size_t c = 0; c < mat->n_columns; ++c)
-			(*target)->data[compute_offset(c, r, (*target)->n_columns)] = mat->data[compute_offset(r, c, mat->n_columns)];
+	// walk the matrix in square tiles so both the rows we read and the columns we write stay in cache
+	const size_t block = __get_tuning().transpose_block;
+	for (size_t r_lower = 0; r_lower < mat->n_rows; r_lower += block)
+	{
+		const size_t r_upper = r_lower + block < mat->n_rows ? r_lower + block : mat->n_rows;
+		for (size_t c_lower = 0; c_lower < mat->n_columns; c_lower += block)
+		{
+			const size_t c_upper = c_lower + block < mat->n_columns ? c_lower + block : mat->n_columns;
+			for (size_t r = r_lower; r < r_upper; ++r)
+				for (size_t c = c_lower; c < c_upper; ++c)
+					(*target)->data[compute_offset(c, r, (*target)->n_columns)] = mat->data[compute_offset(r, c, mat->n_columns)];
+		}
+	}
+	INSTR_END(0, 2 * mat->n_rows * mat->n_columns * sizeof(float), 0);
 }
 
 void mat_print(const Matrix* mat)
 {
+	INSTR_BEGIN(MAT_PRINT);
 	for (size_t r = 0; r < mat->n_rows; ++r)
 	{
 		for (size_t c = 0; c < mat->n_columns; ++c)
 			printf("%f ", mat_at(mat, r, c));
 		printf("\n");
 	}
+	INSTR_END(0, mat->n_rows * mat->n_columns * sizeof(float), 0);
 }
 
 static Matrix* __naive_multiplication(const Matrix* mat1, const Matrix* mat2)
@@ -177,238 +419,686 @@ static Matrix* __naive_multiplication(const Matrix* mat1, const Matrix* mat2)
 	return result;
 }
 
-static Matrix* __transpose_trick(const Matrix* mat1, const Matrix* mat2)
+static size_t __min(size_t a, size_t b)
 {
-	Matrix* result = NULL;
-	mat_init(&result, mat1->n_rows, mat2->n_columns);
+	return a < b ? a : b;
+}
 
-	Matrix* mat2_tpose = mat_transpose(mat2);
+// packing buffer for transposed mat2 panels, kept per thread across multiplies so the kernel doesn't allocate on every call.
+// it comes from the C allocator rather than the context's (which may change between calls) and is free'd when the thread exits
+static pthread_key_t packing_key;
+static pthread_once_t packing_once = PTHREAD_ONCE_INIT;
+static __thread float* packing = NULL;
+static __thread size_t packing_size = 0;
 
-	// OpenMP can utilize this loop structure better than calling get_row functions which introduce too much data dependency
-	for (size_t r = 0; r < result->n_rows; ++r)
+static void __create_packing_key(void)
+{
+	pthread_key_create(&packing_key, free);
+}
+
+// the calling thread's packing buffer, grown to at least size floats (NULL if that fails)
+static float* __packing_buffer(const size_t size)
+{
+	if (size <= packing_size)
+		return packing;
+
+	float* alloc = realloc(packing, size * sizeof(float));
+	if (!alloc)
+		return NULL;
+
+	pthread_once(&packing_once, __create_packing_key);
+	pthread_setspecific(packing_key, alloc);
+	packing = alloc;
+	packing_size = size;
+
+	return alloc;
+}
+
+static void __apply_epilogue(float* tile, const size_t n_rows, const size_t n_columns, const size_t ldc, const size_t r_offset, const size_t c_offset, const MatEpilogue* epilogue)
+{
+	for (size_t r = 0; r < n_rows; ++r)
 	{
-		for (size_t c = 0; c < result->n_columns; ++c)
-		{
-			for (size_t k = 0; k < mat2_tpose->n_columns; ++k)
-			{
-				mat_set(&result, r, c, mat_at(result, r, c) + mat_at(mat1, r, k) * mat_at(mat2_tpose, c, k));
-			}
-		}
+		float* row = &tile[r * ldc];
+		if (epilogue->bias)
+			for (size_t c = 0; c < n_columns; ++c)
+				row[c] += epilogue->bias->data[c_offset + c];
+		if (epilogue->activation)
+			for (size_t c = 0; c < n_columns; ++c)
+				row[c] = epilogue->activation(row[c], epilogue->activation_argv);
+		if (epilogue->scale != 1.0f)
+			for (size_t c = 0; c < n_columns; ++c)
+				row[c] *= epilogue->scale;
 	}
 
-	mat_free(&mat2_tpose);
-
-	return result;
+	if (epilogue->tile)
+		epilogue->tile(tile, r_offset, c_offset, n_rows, n_columns, ldc, epilogue->tile_argv);
 }
 
-static Matrix* __transpose_trick_parallel(const Matrix* mat1, const Matrix* mat2)
+// c = alpha * op(a) * op(b) + beta * c on raw row-major buffers, where op(a) is (m, k) and op(b) is (k, n).
+// lda/ldb/ldc are the row strides of the buffers as they are stored (i.e., before the transpose).
+// transposed operands are read in place; a transposed mat2 panel is packed once per block (into the thread's
+// cached packing buffer) so the inner loop always streams contiguous memory. params is the caller's snapshot of the tuning.
+static UtilStatus __gemm(
+		const bool trans1,
+		const bool trans2,
+		const size_t m,
+		const size_t n,
+		const size_t k,
+		const float alpha,
+		const float* a,
+		const size_t lda,
+		const float* b,
+		const size_t ldb,
+		const float beta,
+		float* c,
+		const size_t ldc,
+		const MatEpilogue* epilogue,
+		const MatTuning* params,
+		const bool parallel)
 {
-	Matrix* result = NULL;
-	mat_init(&result, mat1->n_rows, mat2->n_columns);
+	// a (block_k, block_columns) panel of mat2 is reused across block_rows rows of the output before moving on
+	const size_t block_rows = params->gemm_block_rows;
+	const size_t block_columns = params->gemm_block_columns;
+	const size_t block_k = params->gemm_block_k;
+	const size_t n_row_blocks = (m + block_rows - 1) / block_rows;
 
-	Matrix* mat2_tpose = mat_transpose(mat2);
+	// set by any thread which couldn't get its packing buffer. it skips its share of the work and the whole call fails
+	bool failed = false;
 
-	// OpenMP can utilize this loop structure better than calling get_row functions which introduce too much data dependency
-	#pragma omp parallel for collapse(3)
-	for (size_t r = 0; r < result->n_rows; ++r)
+	#pragma omp parallel num_threads(__n_threads()) proc_bind(spread) if(parallel && m * n >= params->parallel_threshold)
 	{
-		for (size_t c = 0; c < result->n_columns; ++c)
+		float* packed = trans2 ? __packing_buffer(block_k * block_columns) : NULL;
+		if (trans2 && !packed)
+		{
+			#pragma omp atomic write
+			failed = true;
+		}
+
+		#pragma omp for schedule(static)
+		for (size_t rb = 0; rb < n_row_blocks; ++rb)
 		{
-			for (size_t k = 0; k < mat2_tpose->n_columns; ++k)
+			if (trans2 && !packed)
+				continue;
+
+			const size_t r_lower = rb * block_rows;
+			const size_t r_upper = __min(r_lower + block_rows, m);
+
+			for (size_t c_lower = 0; c_lower < n; c_lower += block_columns)
 			{
-				mat_set(&result, r, c, mat_at(result, r, c) + mat_at(mat1, r, k) * mat_at(mat2_tpose, c, k));
+				const size_t n_cols = __min(block_columns, n - c_lower);
+
+				// scale (or reset) the existing tile. beta == 0 must ignore whatever is in c, even NaN
+				for (size_t r = r_lower; r < r_upper; ++r)
+				{
+					float* c_row = &c[r * ldc + c_lower];
+					if (beta == 0.0f)
+						for (size_t j = 0; j < n_cols; ++j)
+							c_row[j] = 0.0f;
+					else if (beta != 1.0f)
+						for (size_t j = 0; j < n_cols; ++j)
+							c_row[j] *= beta;
+				}
+
+				for (size_t k_lower = 0; k_lower < k; k_lower += block_k)
+				{
+					const size_t n_inner = __min(block_k, k - k_lower);
+
+					const float* panel = &b[k_lower * ldb + c_lower];
+					size_t ldp = ldb;
+					if (trans2)
+					{
+						for (size_t kk = 0; kk < n_inner; ++kk)
+							for (size_t j = 0; j < n_cols; ++j)
+								packed[kk * n_cols + j] = b[(c_lower + j) * ldb + k_lower + kk];
+						panel = packed;
+						ldp = n_cols;
+					}
+
+					for (size_t r = r_lower; r < r_upper; ++r)
+					{
+						float* c_row = &c[r * ldc + c_lower];
+						for (size_t kk = 0; kk < n_inner; ++kk)
+						{
+							const float a_val = alpha * (trans1 ? a[(k_lower + kk) * lda + r] : a[r * lda + k_lower + kk]);
+							const float* p_row = &panel[kk * ldp];
+							for (size_t j = 0; j < n_cols; ++j)
+								c_row[j] += a_val * p_row[j];
+						}
+					}
+				}
+
+				// the tile is final now and still in cache, so this is the cheapest point to finish it off
+				if (epilogue)
+					__apply_epilogue(&c[r_lower * ldc + c_lower], r_upper - r_lower, n_cols, ldc, r_lower, c_lower, epilogue);
 			}
 		}
 	}
 
-	mat_free(&mat2_tpose);
+	if (failed)
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory while multiplying matrices.");
 
-	return result;
+	return UTIL_OK;
 }
 
-static void __transpose_trick_inplace(const Matrix* mat1, const Matrix* mat2, Matrix** target)
+static UtilStatus __check_gemm(const bool trans1, const bool trans2, const Matrix* mat1, const Matrix* mat2, const Matrix* target, const MatEpilogue* epilogue)
 {
-	// reset target to 0 incase user calls this multiple times (this caused a bug in my Perceptron...)
-	mat_fill(target, 0.0f);
+	const size_t m = trans1 ? mat1->n_columns : mat1->n_rows;
+	const size_t k1 = trans1 ? mat1->n_rows : mat1->n_columns;
+	const size_t k2 = trans2 ? mat2->n_columns : mat2->n_rows;
+	const size_t n = trans2 ? mat2->n_rows : mat2->n_columns;
+
+	if (k1 != k2)
+		return util_raise(UTIL_ERROR_DIMENSION, "mat1's column size must match mat2's row size when multiplying matrices.");
+	if (target->n_rows != m || target->n_columns != n)
+		return util_raise(UTIL_ERROR_DIMENSION, "Target dimensions must match the product's dimensions when multiplying matrices.");
+	if (epilogue && epilogue->bias && epilogue->bias->n_elem != n)
+		return util_raise(UTIL_ERROR_DIMENSION, "Bias length must match the target's column size.");
+
+	return UTIL_OK;
+}
 
-	Matrix* mat2_tpose = mat_transpose(mat2);
+static UtilStatus __gemm_matrix(const bool trans1, const bool trans2, const float alpha, const Matrix* mat1, const Matrix* mat2, const float beta, Matrix** target, const MatEpilogue* epilogue, const MatTuning* params, const bool parallel)
+{
+	return __gemm(
+		trans1, trans2,
+		(*target)->n_rows, (*target)->n_columns, trans1 ? mat1->n_rows : mat1->n_columns,
+		alpha,
+		mat1->data, mat1->n_columns,
+		mat2->data, mat2->n_columns,
+		beta,
+		(*target)->data, (*target)->n_columns,
+		epilogue,
+		params,
+		parallel);
+}
+
+#ifdef CMATRIX_INSTRUMENT
+// bytes read + written by a multiply, assuming each operand is streamed through once
+static uint64_t __gemm_bytes(const Matrix* mat1, const Matrix* mat2, const Matrix* target)
+{
+	return (uint64_t)(mat1->n_rows * mat1->n_columns + mat2->n_rows * mat2->n_columns + 2 * target->n_rows * target->n_columns) * sizeof(float);
+}
+
+static uint64_t __gemm_flops(const bool trans1, const Matrix* mat1, const Matrix* target)
+{
+	const size_t k = trans1 ? mat1->n_rows : mat1->n_columns;
+	return 2 * (uint64_t)target->n_rows * target->n_columns * k;
+}
+#endif
 
-	for (size_t r = 0; r < (*target)->n_rows; ++r)
+UtilStatus mat_gemm(const bool trans1, const bool trans2, const float alpha, const Matrix* mat1, const Matrix* mat2, const float beta, Matrix** target, const MatEpilogue* epilogue)
+{
+	UtilStatus status = __check_gemm(trans1, trans2, mat1, mat2, *target, epilogue);
+	if (status != UTIL_OK)
 	{
-		for (size_t c = 0; c < (*target)->n_columns; ++c)
-		{
-			for (size_t k = 0; k < mat2_tpose->n_columns; ++k)
-			{
-				mat_set(target, r, c, mat_at(*target, r, c) + mat_at(mat1, r, k) * mat_at(mat2_tpose, c, k));
-			}
-		}
+		INSTR_CALL(MAT_GEMM);
+		return status;
 	}
 
-	mat_free(&mat2_tpose);
+	return mat_gemm_unchecked(trans1, trans2, alpha, mat1, mat2, beta, target, epilogue);
 }
 
-static void __transpose_trick_inplace_parallel(const Matrix* mat1, const Matrix* mat2, Matrix** target)
+UtilStatus mat_gemm_unchecked(const bool trans1, const bool trans2, const float alpha, const Matrix* mat1, const Matrix* mat2, const float beta, Matrix** target, const MatEpilogue* epilogue)
 {
-	// reset target to 0 incase user calls this multiple times (this caused a bug in my Perceptron...)
-	mat_fill(target, 0.0f);
+	INSTR_BEGIN(MAT_GEMM);
+	const MatTuning params = __get_tuning();
+	UtilStatus status = __gemm_matrix(trans1, trans2, alpha, mat1, mat2, beta, target, epilogue, &params, false);
+	INSTR_END(0, __gemm_bytes(mat1, mat2, *target), __gemm_flops(trans1, mat1, *target));
 
-	Matrix* mat2_tpose = mat_transpose(mat2);
+	return status;
+}
 
-	Vector* row_vec = NULL;
-	vec_init(&row_vec, mat1->n_rows);
+UtilStatus mat_gemm_parallel(const bool trans1, const bool trans2, const float alpha, const Matrix* mat1, const Matrix* mat2, const float beta, Matrix** target, const MatEpilogue* epilogue)
+{
+	INSTR_BEGIN(MAT_GEMM_PARALLEL);
+	UtilStatus status = __check_gemm(trans1, trans2, mat1, mat2, *target, epilogue);
+	if (status != UTIL_OK)
+		return status;
 
-	Vector* col_vec = NULL;
-	vec_init(&col_vec, mat2_tpose->n_rows); // due to transpose, the size will be similar to row_vec
+	const MatTuning params = __get_tuning();
+	status = __gemm_matrix(trans1, trans2, alpha, mat1, mat2, beta, target, epilogue, &params, true);
+	INSTR_END(0, __gemm_bytes(mat1, mat2, *target), __gemm_flops(trans1, mat1, *target));
+
+	return status;
+}
+
+UtilStatus mat_set_strassen_cutoff(const size_t cutoff)
+{
+	if (cutoff == 1)
+		return util_raise(UTIL_ERROR_ARGUMENT, "The Strassen-Winograd cutoff must be 0 (disabled) or at least 2.");
+
+	pthread_once(&tuning_once, __load_tuning);
+
+	pthread_rwlock_wrlock(&tuning_lock);
+	tuning.strassen_cutoff = cutoff;
+	pthread_rwlock_unlock(&tuning_lock);
+
+	return UTIL_OK;
+}
+
+size_t mat_get_strassen_cutoff(void)
+{
+	// the process-wide value, not the calling thread's snapshot, so it always reads back what the setter wrote
+	pthread_once(&tuning_once, __load_tuning);
+
+	pthread_rwlock_rdlock(&tuning_lock);
+	const size_t cutoff = tuning.strassen_cutoff;
+	pthread_rwlock_unlock(&tuning_lock);
+
+	return cutoff;
+}
+
+static bool __use_strassen(const size_t m, const size_t n, const size_t k, const size_t strassen_cutoff)
+{
+	// multiplications where every dimension is larger than the cutoff are split with Strassen-Winograd.
+	// odd dimensions can't be split evenly, those levels use the base kernel instead
+	return strassen_cutoff > 0
+		&& m > strassen_cutoff && n > strassen_cutoff && k > strassen_cutoff
+		&& m % 2 == 0 && n % 2 == 0 && k % 2 == 0;
+}
+
+// number of floats __strassen needs as scratch space for an (m, k) x (k, n) product. the recursion must see the
+// same cutoff as this, which is why both take it from one snapshot instead of reading the current tuning
+static size_t __strassen_workspace_size(const size_t m, const size_t n, const size_t k, const size_t strassen_cutoff)
+{
+	if (!__use_strassen(m, n, k, strassen_cutoff))
+		return 0;
+
+	const size_t hm = m / 2, hn = n / 2, hk = k / 2;
+	return hm * hk + hk * hn + hm * hn + __strassen_workspace_size(hm, hn, hk, strassen_cutoff);
+}
+
+// out = x + sign * y on (n_rows, n_columns) blocks with their own row strides
+static void __block_add(
+		const size_t n_rows,
+		const size_t n_columns,
+		const float* x,
+		const size_t ldx,
+		const float* y,
+		const size_t ldy,
+		const float sign,
+		float* out,
+		const size_t ldo,
+		const size_t parallel_threshold,
+		const bool parallel)
+{
+	#pragma omp parallel for schedule(static) num_threads(__n_threads()) proc_bind(spread) if(parallel && n_rows * n_columns >= parallel_threshold)
+	for (size_t r = 0; r < n_rows; ++r)
+		for (size_t c = 0; c < n_columns; ++c)
+			out[r * ldo + c] = x[r * ldx + c] + sign * y[r * ldy + c];
+}
 
-	#pragma omp parallel for collapse(3)
-	for (size_t r = 0; r < (*target)->n_rows; ++r)
+// c = a x b with Strassen-Winograd (7 sub-products instead of 8 per level). the quadrant products are
+// written straight into c's quadrants where possible so each level only needs three temporaries,
+// which are carved out of the preallocated workspace instead of being allocated per level.
+// NOTE: the sub-products are deliberately not run as parallel tasks: they share those temporaries and build on
+// each other's quadrants, so running them concurrently would need private buffers for every product (more than
+// doubling the workspace) and would still synchronize on the final sums. instead the parallel variant splits the
+// base kernel and the block additions between all threads, which keeps every core busy on each sub-product.
+static void __strassen(
+		const size_t m,
+		const size_t n,
+		const size_t k,
+		const float* a,
+		const size_t lda,
+		const float* b,
+		const size_t ldb,
+		float* c,
+		const size_t ldc,
+		float* workspace,
+		const MatTuning* params,
+		const bool parallel)
+{
+	if (!__use_strassen(m, n, k, params->strassen_cutoff))
 	{
-		for (size_t c = 0; c < (*target)->n_columns; ++c)
-		{
-			for (size_t k = 0; k < mat2_tpose->n_columns; ++k)
-			{
-				mat_set(target, r, c, mat_at(*target, r, c) + mat_at(mat1, r, k) * mat_at(mat2_tpose, c, k));
-			}
-		}
+		// the non-transposed kernel doesn't allocate anything, so it can't fail here
+		__gemm(false, false, m, n, k, 1.0f, a, lda, b, ldb, 0.0f, c, ldc, NULL, params, parallel);
+		return;
 	}
 
-	mat_free(&mat2_tpose);
+	const size_t threshold = params->parallel_threshold;
+
+	const size_t hm = m / 2, hn = n / 2, hk = k / 2;
+
+	const float* a11 = a;
+	const float* a12 = a + hk;
+	const float* a21 = a + hm * lda;
+	const float* a22 = a21 + hk;
+	const float* b11 = b;
+	const float* b12 = b + hn;
+	const float* b21 = b + hk * ldb;
+	const float* b22 = b21 + hn;
+	float* c11 = c;
+	float* c12 = c + hn;
+	float* c21 = c + hm * ldc;
+	float* c22 = c21 + hn;
+
+	float* x = workspace; // (hm, hk) - sums of a's quadrants
+	float* y = x + hm * hk; // (hk, hn) - sums of b's quadrants
+	float* z = y + hk * hn; // (hm, hn) - products / partial results
+	float* next = z + hm * hn;
+
+	// c11 = m2 + m1
+	__strassen(hm, hn, hk, a12, lda, b21, ldb, c11, ldc, next, params, parallel);
+	__strassen(hm, hn, hk, a11, lda, b11, ldb, z, hn, next, params, parallel);
+	__block_add(hm, hn, c11, ldc, z, hn, 1.0f, c11, ldc, threshold, parallel);
+
+	// c22 = m5 = s1 x t1
+	__block_add(hm, hk, a21, lda, a22, lda, 1.0f, x, hk, threshold, parallel);
+	__block_add(hk, hn, b12, ldb, b11, ldb, -1.0f, y, hn, threshold, parallel);
+	__strassen(hm, hn, hk, x, hk, y, hn, c22, ldc, next, params, parallel);
+
+	// c12 = m6 = s2 x t2, z = u2 = m1 + m6
+	__block_add(hm, hk, x, hk, a11, lda, -1.0f, x, hk, threshold, parallel);
+	__block_add(hk, hn, b22, ldb, y, hn, -1.0f, y, hn, threshold, parallel);
+	__strassen(hm, hn, hk, x, hk, y, hn, c12, ldc, next, params, parallel);
+	__block_add(hm, hn, z, hn, c12, ldc, 1.0f, z, hn, threshold, parallel);
+
+	// c21 = u3 = u2 + m7 with m7 = s3 x t3
+	__block_add(hm, hk, a11, lda, a21, lda, -1.0f, x, hk, threshold, parallel);
+	__block_add(hk, hn, b22, ldb, b12, ldb, -1.0f, y, hn, threshold, parallel);
+	__strassen(hm, hn, hk, x, hk, y, hn, c21, ldc, next, params, parallel);
+	__block_add(hm, hn, c21, ldc, z, hn, 1.0f, c21, ldc, threshold, parallel);
+
+	// z = u4 = u2 + m5, c22 = u7 = u3 + m5
+	__block_add(hm, hn, z, hn, c22, ldc, 1.0f, z, hn, threshold, parallel);
+	__block_add(hm, hn, c22, ldc, c21, ldc, 1.0f, c22, ldc, threshold, parallel);
+
+	// c12 = u5 = u4 + m3 with m3 = s4 x b22 and s4 = s3 + a12 - a22
+	__block_add(hm, hk, x, hk, a12, lda, 1.0f, x, hk, threshold, parallel);
+	__block_add(hm, hk, x, hk, a22, lda, -1.0f, x, hk, threshold, parallel);
+	__strassen(hm, hn, hk, x, hk, b22, ldb, c12, ldc, next, params, parallel);
+	__block_add(hm, hn, c12, ldc, z, hn, 1.0f, c12, ldc, threshold, parallel);
+
+	// c21 = u6 = u3 - m4 with m4 = a22 x t4 and t4 = t3 + b11 - b21
+	__block_add(hk, hn, y, hn, b11, ldb, 1.0f, y, hn, threshold, parallel);
+	__block_add(hk, hn, y, hn, b21, ldb, -1.0f, y, hn, threshold, parallel);
+	__strassen(hm, hn, hk, a22, lda, y, hn, z, hn, next, params, parallel);
+	__block_add(hm, hn, c21, ldc, z, hn, -1.0f, c21, ldc, threshold, parallel);
+}
+
+// target = mat1 x mat2, using Strassen-Winograd when it's enabled and the product is large enough
+// NOTE: dimensions must already be checked
+static UtilStatus __multiply_matrix(const Matrix* mat1, const Matrix* mat2, Matrix** target, const bool parallel)
+{
+	// one snapshot for the whole product: the workspace is sized for this cutoff, so the recursion must not pick up a newer one
+	const MatTuning params = __get_tuning();
+	const size_t m = mat1->n_rows, n = mat2->n_columns, k = mat1->n_columns;
+	if (!__use_strassen(m, n, k, params.strassen_cutoff))
+		return __gemm_matrix(false, false, 1.0f, mat1, mat2, 0.0f, target, NULL, &params, parallel);
+
+	float* workspace = util_malloc(__strassen_workspace_size(m, n, k, params.strassen_cutoff) * sizeof(float));
+	if (!workspace)
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate workspace while multiplying matrices.");
 
+	__strassen(m, n, k, mat1->data, k, mat2->data, n, (*target)->data, n, workspace, &params, parallel);
+
+	util_free(workspace);
+
+	return UTIL_OK;
 }
 
 Matrix* mat_multiply(const Matrix* mat1, const Matrix* mat2)
 {
+	INSTR_BEGIN(MAT_MULTIPLY);
 	if (mat1->n_columns != mat2->n_rows)
-		util_error("mat1's column size must match mat2's row size when multiplying matrices.");
+	{
+		util_raise(UTIL_ERROR_DIMENSION, "mat1's column size must match mat2's row size when multiplying matrices.");
+		return NULL;
+	}
 
-	return __transpose_trick(mat1, mat2);
+	Matrix* result = NULL;
+	if (mat_init(&result, mat1->n_rows, mat2->n_columns) != UTIL_OK)
+		return NULL;
+	if (__multiply_matrix(mat1, mat2, &result, false) != UTIL_OK)
+	{
+		mat_free(&result);
+		return NULL;
+	}
+
+	INSTR_END(sizeof(Matrix) + result->n_rows * result->n_columns * sizeof(float), __gemm_bytes(mat1, mat2, result), __gemm_flops(false, mat1, result));
+
+	return result;
 }
 
 Matrix* mat_multiply_parallel(const Matrix* mat1, const Matrix* mat2)
 {
+	INSTR_BEGIN(MAT_MULTIPLY_PARALLEL);
 	if (mat1->n_columns != mat2->n_rows)
-		util_error("mat1's column size must match mat2's row size when multiplying matrices.");
+	{
+		util_raise(UTIL_ERROR_DIMENSION, "mat1's column size must match mat2's row size when multiplying matrices.");
+		return NULL;
+	}
+
+	Matrix* result = NULL;
+	if (mat_init(&result, mat1->n_rows, mat2->n_columns) != UTIL_OK)
+		return NULL;
+	if (__multiply_matrix(mat1, mat2, &result, true) != UTIL_OK)
+	{
+		mat_free(&result);
+		return NULL;
+	}
+
+	INSTR_END(sizeof(Matrix) + result->n_rows * result->n_columns * sizeof(float), __gemm_bytes(mat1, mat2, result), __gemm_flops(false, mat1, result));
 
-	return __transpose_trick_parallel(mat1, mat2);
+	return result;
 }
 
-void mat_multiply_inplace(const Matrix* mat1, const Matrix* mat2, Matrix** target)
+UtilStatus mat_multiply_inplace(const Matrix* mat1, const Matrix* mat2, Matrix** target)
 {
-	if (mat1->n_columns != mat2->n_rows)
-		util_error("mat1's column size must match mat2's row size when multiplying matrices.");
+	UtilStatus status = __check_gemm(false, false, mat1, mat2, *target, NULL);
+	if (status != UTIL_OK)
+	{
+		INSTR_CALL(MAT_MULTIPLY_INPLACE);
+		return status;
+	}
 
-	__transpose_trick_inplace(mat1, mat2, target);
+	return mat_multiply_inplace_unchecked(mat1, mat2, target);
 }
 
-void mat_multiply_inplace_parallel(const Matrix* mat1, const Matrix* mat2, Matrix** target)
+UtilStatus mat_multiply_inplace_unchecked(const Matrix* mat1, const Matrix* mat2, Matrix** target)
 {
-	if (mat1->n_columns != mat2->n_rows)
-		util_error("mat1's column size must match mat2's row size when multiplying matrices.");
+	INSTR_BEGIN(MAT_MULTIPLY_INPLACE);
+	// beta = 0 overwrites the target, so there's no need to reset it first
+	UtilStatus status = __multiply_matrix(mat1, mat2, target, false);
+	INSTR_END(0, __gemm_bytes(mat1, mat2, *target), __gemm_flops(false, mat1, *target));
 
-	__transpose_trick_inplace_parallel(mat1, mat2, target);
+	return status;
+}
+
+UtilStatus mat_multiply_inplace_parallel(const Matrix* mat1, const Matrix* mat2, Matrix** target)
+{
+	INSTR_BEGIN(MAT_MULTIPLY_INPLACE_PARALLEL);
+	UtilStatus status = __check_gemm(false, false, mat1, mat2, *target, NULL);
+	if (status != UTIL_OK)
+		return status;
+
+	status = __multiply_matrix(mat1, mat2, target, true);
+	INSTR_END(0, __gemm_bytes(mat1, mat2, *target), __gemm_flops(false, mat1, *target));
+
+	return status;
 }
 
 void mat_apply(Matrix** mat, float (*apply_func)(float x, float* argv), float* argv)
 {
+	INSTR_BEGIN(MAT_APPLY);
 	for (size_t i = 0; i < (*mat)->n_rows * (*mat)->n_columns; ++i)
 		(*mat)->data[i] = apply_func((*mat)->data[i], argv);
+	INSTR_END(0, 2 * (*mat)->n_rows * (*mat)->n_columns * sizeof(float), (*mat)->n_rows * (*mat)->n_columns);
 }
 
 void mat_add_s(Matrix** mat, const float value)
 {
+	INSTR_BEGIN(MAT_ADD_S);
 	for (size_t i = 0; i < (*mat)->n_columns * (*mat)->n_rows; ++i)
 		(*mat)->data[i] += value;
+	INSTR_END(0, 2 * (*mat)->n_rows * (*mat)->n_columns * sizeof(float), (*mat)->n_rows * (*mat)->n_columns);
 }
 
-void mat_substract_s(Matrix** mat, const float value)
+void mat_subtract_s(Matrix** mat, const float value)
 {
+	INSTR_BEGIN(MAT_SUBTRACT_S);
 	for (size_t i = 0; i < (*mat)->n_columns * (*mat)->n_rows; ++i)
 		(*mat)->data[i] -= value;
+	INSTR_END(0, 2 * (*mat)->n_rows * (*mat)->n_columns * sizeof(float), (*mat)->n_rows * (*mat)->n_columns);
+}
+
+void mat_substract_s(Matrix** mat, const float value)
+{
+	mat_subtract_s(mat, value);
 }
 
 void mat_multiply_s(Matrix** mat, const float value)
 {
+	INSTR_BEGIN(MAT_MULTIPLY_S);
 	for (size_t i = 0; i < (*mat)->n_columns * (*mat)->n_rows; ++i)
 		(*mat)->data[i] *= value;
+	INSTR_END(0, 2 * (*mat)->n_rows * (*mat)->n_columns * sizeof(float), (*mat)->n_rows * (*mat)->n_columns);
 }
 
 void mat_divide_s(Matrix** mat, const float value)
 {
+	INSTR_BEGIN(MAT_DIVIDE_S);
 	for (size_t i = 0; i < (*mat)->n_columns * (*mat)->n_rows; ++i)
 		(*mat)->data[i] /= value;
+	INSTR_END(0, 2 * (*mat)->n_rows * (*mat)->n_columns * sizeof(float), (*mat)->n_rows * (*mat)->n_columns);
 }
 
-void mat_add_e(Matrix** target, const Matrix* mat)
+UtilStatus mat_add_e(Matrix** target, const Matrix* mat)
 {
-	if (mat->n_rows != (*target)->n_rows && mat->n_columns != (*target)->n_columns)
-		util_error("Matrix dimensions must match exactly when trying to perform element-wise operations.");
+	if (mat->n_rows != (*target)->n_rows || mat->n_columns != (*target)->n_columns)
+	{
+		INSTR_CALL(MAT_ADD_E);
+		return util_raise(UTIL_ERROR_DIMENSION, "Matrix dimensions must match exactly when trying to perform element-wise operations.");
+	}
+
+	mat_add_e_unchecked(target, mat);
 
+	return UTIL_OK;
+}
+
+void mat_add_e_unchecked(Matrix** target, const Matrix* mat)
+{
+	INSTR_BEGIN(MAT_ADD_E);
 	for (size_t i = 0; i < mat->n_rows * mat->n_columns; ++i)
 		(*target)->data[i] += mat->data[i];
+	INSTR_END(0, 3 * mat->n_rows * mat->n_columns * sizeof(float), mat->n_rows * mat->n_columns);
 }
 
-void mat_subtract_e(Matrix** target, const Matrix* mat)
+UtilStatus mat_subtract_e(Matrix** target, const Matrix* mat)
 {
-	if (mat->n_rows != (*target)->n_rows && mat->n_columns != (*target)->n_columns)
-		util_error("Matrix dimensions must match exactly when trying to perform element-wise operations.");
+	if (mat->n_rows != (*target)->n_rows || mat->n_columns != (*target)->n_columns)
+	{
+		INSTR_CALL(MAT_SUBTRACT_E);
+		return util_raise(UTIL_ERROR_DIMENSION, "Matrix dimensions must match exactly when trying to perform element-wise operations.");
+	}
+
+	mat_subtract_e_unchecked(target, mat);
+
+	return UTIL_OK;
+}
 
+void mat_subtract_e_unchecked(Matrix** target, const Matrix* mat)
+{
+	INSTR_BEGIN(MAT_SUBTRACT_E);
 	for (size_t i = 0; i < mat->n_rows * mat->n_columns; ++i)
 		(*target)->data[i] -= mat->data[i];
+	INSTR_END(0, 3 * mat->n_rows * mat->n_columns * sizeof(float), mat->n_rows * mat->n_columns);
 }
 
-void mat_multiply_e(Matrix** target, const Matrix* mat)
+UtilStatus mat_multiply_e(Matrix** target, const Matrix* mat)
 {
-	if (mat->n_rows != (*target)->n_rows && mat->n_columns != (*target)->n_columns)
-		util_error("Matrix dimensions must match exactly when trying to perform element-wise operations.");
+	if (mat->n_rows != (*target)->n_rows || mat->n_columns != (*target)->n_columns)
+	{
+		INSTR_CALL(MAT_MULTIPLY_E);
+		return util_raise(UTIL_ERROR_DIMENSION, "Matrix dimensions must match exactly when trying to perform element-wise operations.");
+	}
+
+	mat_multiply_e_unchecked(target, mat);
+
+	return UTIL_OK;
+}
 
+void mat_multiply_e_unchecked(Matrix** target, const Matrix* mat)
+{
+	INSTR_BEGIN(MAT_MULTIPLY_E);
 	for (size_t i = 0; i < mat->n_rows * mat->n_columns; ++i)
 		(*target)->data[i] *= mat->data[i];
+	INSTR_END(0, 3 * mat->n_rows * mat->n_columns * sizeof(float), mat->n_rows * mat->n_columns);
 }
 
-void mat_divide_e(Matrix** target, const Matrix* mat)
+UtilStatus mat_divide_e(Matrix** target, const Matrix* mat)
 {
-	if (mat->n_rows != (*target)->n_rows && mat->n_columns != (*target)->n_columns)
-		util_error("Matrix dimensions must match exactly when trying to perform element-wise operations.");
+	if (mat->n_rows != (*target)->n_rows || mat->n_columns != (*target)->n_columns)
+	{
+		INSTR_CALL(MAT_DIVIDE_E);
+		return util_raise(UTIL_ERROR_DIMENSION, "Matrix dimensions must match exactly when trying to perform element-wise operations.");
+	}
+
+	mat_divide_e_unchecked(target, mat);
+
+	return UTIL_OK;
+}
 
+void mat_divide_e_unchecked(Matrix** target, const Matrix* mat)
+{
+	INSTR_BEGIN(MAT_DIVIDE_E);
 	for (size_t i = 0; i < mat->n_rows * mat->n_columns; ++i)
 		(*target)->data[i] /= mat->data[i];
+	INSTR_END(0, 3 * mat->n_rows * mat->n_columns * sizeof(float), mat->n_rows * mat->n_columns);
 }
 
 Matrix* mat_copy(const Matrix* mat)
 {
+	INSTR_BEGIN(MAT_COPY);
 	Matrix* mcpy = NULL;
-	mat_init(&mcpy, mat->n_rows, mat->n_columns);
+	if (mat_init(&mcpy, mat->n_rows, mat->n_columns) != UTIL_OK)
+		return NULL;
 
 	for (size_t i = 0; i < mat->n_rows * mat->n_columns; ++i)
 		mcpy->data[i] = mat->data[i];
 
+	INSTR_END(sizeof(Matrix) + mat->n_rows * mat->n_columns * sizeof(float), 2 * mat->n_rows * mat->n_columns * sizeof(float), 0);
+
 	return mcpy;
 }
 
 Matrix* mat_subset(const Matrix* mat, const size_t r_lower, const size_t r_upper, const size_t c_lower, const size_t c_upper)
 {
+	INSTR_BEGIN(MAT_SUBSET);
 	Matrix* subset = NULL;
-	mat_init(&subset, r_upper - r_lower + 1, c_upper - c_lower + 1);
+	if (mat_init(&subset, r_upper - r_lower + 1, c_upper - c_lower + 1) != UTIL_OK)
+		return NULL;
 
 	for (size_t r = r_lower; r <= r_upper; ++r)
 		for (size_t c = c_lower; c <= c_upper; ++c)
 			mat_set(&subset, r - r_lower, c - c_lower, mat_at(mat, r, c));
 	
+	INSTR_END(sizeof(Matrix) + subset->n_rows * subset->n_columns * sizeof(float), 2 * subset->n_rows * subset->n_columns * sizeof(float), 0);
+
 	return subset;
 }
 
 float mat_sum(const Matrix* mat)
 {
+	INSTR_BEGIN(MAT_SUM);
 	float result = 0.0f;
 	for (size_t i = 0; i < mat->n_rows * mat->n_columns; ++i)
 		result += mat->data[i];
 
+	INSTR_END(0, mat->n_rows * mat->n_columns * sizeof(float), mat->n_rows * mat->n_columns);
+
 	return result;
 }
 
 float mat_mean(const Matrix* mat)
 {
-	return mat_sum(mat) / (float)(mat->n_rows * mat->n_columns);
+	INSTR_BEGIN(MAT_MEAN);
+	float result = mat_sum(mat) / (float)(mat->n_rows * mat->n_columns);
+
+	INSTR_END(0, mat->n_rows * mat->n_columns * sizeof(float), mat->n_rows * mat->n_columns);
+
+	return result;
 }
 
 static bool check_used_index(size_t* used_indices, size_t n_indices, size_t search_index)
@@ -422,22 +1112,41 @@ static bool check_used_index(size_t* used_indices, size_t n_indices, size_t sear
 
 Matrix* mat_sample(const Matrix* mat, const size_t n_samples, bool with_replacement, size_t* sample_indices)
 {
+	return mat_sample_r(mat, n_samples, with_replacement, sample_indices, &util_get_context()->rng);
+}
+
+Matrix* mat_sample_r(const Matrix* mat, const size_t n_samples, bool with_replacement, size_t* sample_indices, UtilRng* rng)
+{
+	INSTR_BEGIN(MAT_SAMPLE);
+	if (mat->n_rows == 0 && n_samples > 0)
+	{
+		util_raise(UTIL_ERROR_ARGUMENT, "Cannot sample rows from an empty matrix.");
+		return NULL;
+	}
 	if (!with_replacement && n_samples > mat->n_rows)
-		util_error("Cannot sample without replacement with a size larger than the matrix's row count.");
+	{
+		util_raise(UTIL_ERROR_ARGUMENT, "Cannot sample without replacement with a size larger than the matrix's row count.");
+		return NULL;
+	}
 
 	Matrix* sample = NULL;
-	mat_init(&sample, n_samples, mat->n_columns);
+	if (mat_init(&sample, n_samples, mat->n_columns) != UTIL_OK)
+		return NULL;
 
 	// would be better to insert the elements sorted and binary search, but for now
 	// I will use a naive linear implementation
-	size_t* used_indices = calloc(n_samples, sizeof(size_t));
+	size_t* used_indices = util_calloc(n_samples, sizeof(size_t));
+	if (!used_indices)
+	{
+		mat_free(&sample);
+		util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory while sampling matrix.");
+		return NULL;
+	}
 	size_t n_used_indices = 0;
 
-	srand(time(NULL));
-
 	while (n_used_indices < n_samples)
 	{
-		size_t rand_idx = (size_t)util_rand_between(0.0f, (float)mat->n_rows);
+		size_t rand_idx = (size_t)(util_rng_next(rng) % mat->n_rows);
 		if (n_used_indices > 0 && !with_replacement && !check_used_index(used_indices, n_used_indices, rand_idx))
 		{
 			for (size_t c = 0; c < sample->n_columns; ++c)
@@ -480,18 +1189,22 @@ Matrix* mat_sample(const Matrix* mat, const size_t n_samples, bool with_replacem
 		}
 	}
 
-	free(used_indices);
+	util_free(used_indices);
+
+	INSTR_END(sizeof(Matrix) + sample->n_rows * sample->n_columns * sizeof(float) + n_samples * sizeof(size_t), 2 * sample->n_rows * sample->n_columns * sizeof(float), 0);
 
 	return sample;
 }
 
 void mat_free(Matrix** mat)
 {
-	free((*mat)->data);
+	INSTR_BEGIN(MAT_FREE);
+	__free_data((*mat)->data, (*mat)->capacity);
 	(*mat)->data = NULL;
 
-	free(*mat);
+	util_free(*mat);
 	*mat = NULL;
+	INSTR_END(0, 0, 0);
 }
 
 Matrix* mat_filter(
@@ -500,6 +1213,7 @@ Matrix* mat_filter(
 		float* predicate_args,
 		size_t** filtered_idx)
 {
+	INSTR_BEGIN(MAT_FILTER);
 	// we don't know ahead of time how many
 	// rows will match the predicate, so first
 	// we allocate a temp matrix the same size as the original
@@ -518,18 +1232,28 @@ Matrix* mat_filter(
 	// after will be 0.
 	
 	Vector* current_row = NULL;
-	vec_init(&current_row, mat->n_columns);
+	if (vec_init(&current_row, mat->n_columns) != UTIL_OK)
+		return NULL;
 
 	Matrix* predicate_match = NULL;
-	mat_init(&predicate_match, mat->n_rows, mat->n_columns);
+	if (mat_init(&predicate_match, mat->n_rows, mat->n_columns) != UTIL_OK)
+	{
+		vec_free(&current_row);
+		return NULL;
+	}
 
 	size_t filtered_rows = 0;
 	if (*filtered_idx != NULL)
-		free(*filtered_idx);
-	void* alloc = calloc(mat->n_rows, sizeof(size_t));
-	if (!alloc)
-		util_error("Couldn't allocate memory while filtering matrix.");
+		util_free(*filtered_idx);
+	void* alloc = util_calloc(mat->n_rows, sizeof(size_t));
 	*filtered_idx = alloc;
+	if (!alloc)
+	{
+		mat_free(&predicate_match);
+		vec_free(&current_row);
+		util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory while filtering matrix.");
+		return NULL;
+	}
 
 	for (size_t r = 0; r < mat->n_rows; ++r)
 	{
@@ -551,42 +1275,112 @@ Matrix* mat_filter(
 	// free the temp one and return
 	
 	Matrix* filtered = NULL;
-	mat_init(&filtered, filtered_rows, mat->n_columns);
-	for (size_t r = 0; r < filtered_rows; ++r)
-		for (size_t c = 0; c < mat->n_columns; ++c)
-			mat_set(&filtered, r, c, mat_at(predicate_match, r, c));
+	if (mat_init(&filtered, filtered_rows, mat->n_columns) == UTIL_OK)
+		for (size_t r = 0; r < filtered_rows; ++r)
+			for (size_t c = 0; c < mat->n_columns; ++c)
+				mat_set(&filtered, r, c, mat_at(predicate_match, r, c));
 	mat_free(&predicate_match);
 	vec_free(&current_row);
 
+	if (!filtered)
+		return NULL;
+
+	INSTR_END(sizeof(Vector) + mat->n_columns * sizeof(float) + 2 * sizeof(Matrix) + (mat->n_rows * mat->n_columns + filtered->n_rows * filtered->n_columns) * sizeof(float) + mat->n_rows * sizeof(size_t), (2 * mat->n_rows * mat->n_columns + 2 * filtered->n_rows * filtered->n_columns) * sizeof(float), 0);
+
 	return filtered;
 }
 
+static UtilStatus __check_row_indices(const size_t* idx, const size_t n_idx, const size_t n_rows)
+{
+	for (size_t i = 0; i < n_idx; ++i)
+		if (idx[i] >= n_rows)
+			return util_raise(UTIL_ERROR_ARGUMENT, "Row index out of range.");
+
+	return UTIL_OK;
+}
+
+// rows are contiguous, so each one is a single memcpy
+static void __gather_rows(const Matrix* mat, const size_t* idx, const size_t n_idx, float* out)
+{
+	const size_t row_size = mat->n_columns * sizeof(float);
+	for (size_t r = 0; r < n_idx; ++r)
+		memcpy(&out[r * mat->n_columns], &mat->data[idx[r] * mat->n_columns], row_size);
+}
+
 Matrix* mat_subset_idx(
 		const Matrix* mat,
 		const size_t* sample_idx,
 		const size_t n_samples)
 {
+	INSTR_BEGIN(MAT_SUBSET_IDX);
+	if (__check_row_indices(sample_idx, n_samples, mat->n_rows) != UTIL_OK)
+		return NULL;
+
 	Matrix* sampled = NULL;
-	mat_init(&sampled, n_samples, mat->n_columns);
-	for (size_t r = 0; r < n_samples; ++r)
-		for (size_t c = 0; c < mat->n_columns; ++c)
-			mat_set(&sampled, r, c, mat_at(mat, sample_idx[r], c));
+	if (mat_init(&sampled, n_samples, mat->n_columns) != UTIL_OK)
+		return NULL;
+	__gather_rows(mat, sample_idx, n_samples, sampled->data);
+
+	INSTR_END(sizeof(Matrix) + sampled->n_rows * sampled->n_columns * sizeof(float), 2 * sampled->n_rows * sampled->n_columns * sizeof(float), 0);
 
 	return sampled;
 }
 
+UtilStatus mat_gather_rows(const Matrix* mat, const size_t* idx, const size_t n_idx, Matrix** target)
+{
+	INSTR_BEGIN(MAT_GATHER_ROWS);
+	if ((*target)->n_rows != n_idx || (*target)->n_columns != mat->n_columns)
+		return util_raise(UTIL_ERROR_DIMENSION, "Target must have one row per index and the same column count when gathering rows.");
+
+	UtilStatus status = __check_row_indices(idx, n_idx, mat->n_rows);
+	if (status != UTIL_OK)
+		return status;
+
+	__gather_rows(mat, idx, n_idx, (*target)->data);
+	INSTR_END(0, 2 * n_idx * mat->n_columns * sizeof(float), 0);
+
+	return UTIL_OK;
+}
+
+UtilStatus mat_scatter_rows(const Matrix* mat, const size_t* idx, Matrix** target)
+{
+	INSTR_BEGIN(MAT_SCATTER_ROWS);
+	if ((*target)->n_columns != mat->n_columns)
+		return util_raise(UTIL_ERROR_DIMENSION, "Target must have the same column count when scattering rows.");
+
+	UtilStatus status = __check_row_indices(idx, mat->n_rows, (*target)->n_rows);
+	if (status != UTIL_OK)
+		return status;
+
+	const size_t row_size = mat->n_columns * sizeof(float);
+	for (size_t r = 0; r < mat->n_rows; ++r)
+		memcpy(&(*target)->data[idx[r] * mat->n_columns], &mat->data[r * mat->n_columns], row_size);
+	INSTR_END(0, 2 * mat->n_rows * mat->n_columns * sizeof(float), 0);
+
+	return UTIL_OK;
+}
+
 void __swap_rows(Matrix** mat, size_t r1, size_t r2)
 {
-	Vector* r1_vec = mat_get_row(*mat, r1);
+	// swapping element by element doesn't need a temporary row, so sorting can't fail on allocation
+	float* row1 = &(*mat)->data[r1 * (*mat)->n_columns];
+	float* row2 = &(*mat)->data[r2 * (*mat)->n_columns];
 	for (size_t c = 0; c < (*mat)->n_columns; ++c)
 	{
-		mat_set(mat, r1, c, mat_at(*mat, r2, c));
-		mat_set(mat, r2, c, vec_at(r1_vec, c));
+		const float tmp = row1[c];
+		row1[c] = row2[c];
+		row2[c] = tmp;
 	}
-	vec_free(&r1_vec);
 }
 
-void __mat_sort(Matrix** mat, size_t c, size_t left_idx, size_t right_idx, bool ascending)
+// bytes read and written by the sort so far (the keys compared and the rows swapped), only kept in instrumented builds
+#ifdef CMATRIX_INSTRUMENT
+#define SORT_MOVED(bytes) (*bytes_moved += (uint64_t)(bytes))
+#else
+#define SORT_MOVED(bytes) ((void)0)
+#endif
+
+void __mat_sort(Matrix** mat, size_t c, size_t left_idx, size_t right_idx, bool ascending, uint64_t* bytes_moved)
 {
 	if (left_idx >= right_idx)
 		return;
@@ -601,12 +1395,192 @@ void __mat_sort(Matrix** mat, size_t c, size_t left_idx, size_t right_idx, bool
 	}
 	__swap_rows(mat, iter, right_idx); // swap pivot to correct position
 
+	// the keys compared, plus two rows read and written per swap (one per row that went left of the pivot, and the pivot's)
+	SORT_MOVED((right_idx - left_idx + 1) * sizeof(float) + (iter - left_idx + 1) * 4 * (*mat)->n_columns * sizeof(float));
 	if (iter > 0) // prevent underflow
-		__mat_sort(mat, c, left_idx, iter - 1, ascending);
-	__mat_sort(mat, c, iter + 1, right_idx, ascending);
+		__mat_sort(mat, c, left_idx, iter - 1, ascending, bytes_moved);
+	__mat_sort(mat, c, iter + 1, right_idx, ascending, bytes_moved);
 }
 
 void mat_sort(Matrix** mat, size_t c, bool ascending)
 {
-	__mat_sort(mat, c, 0, (*mat)->n_rows - 1, ascending);
-}
\ No newline at end of file
+	INSTR_BEGIN(MAT_SORT);
+	uint64_t bytes_moved = 0;
+	if ((*mat)->n_rows > 0)
+		__mat_sort(mat, c, 0, (*mat)->n_rows - 1, ascending, &bytes_moved);
+	INSTR_END(0, bytes_moved, 0);
+}
+
+// (parenthesized so the call-site macros in matrix.h don't apply to the definitions)
+Matrix* (mat_hstack)(const Matrix* const* mats, const size_t n_mats)
+{
+	INSTR_BEGIN(MAT_HSTACK);
+	if (n_mats == 0)
+	{
+		util_raise(UTIL_ERROR_ARGUMENT, "Need at least one matrix to stack.");
+		return NULL;
+	}
+
+	const size_t n_rows = mats[0]->n_rows;
+	size_t n_columns = 0;
+	for (size_t i = 0; i < n_mats; ++i)
+	{
+		if (mats[i]->n_rows != n_rows)
+		{
+			util_raise(UTIL_ERROR_DIMENSION, "All matrices must have the same row count when stacking horizontally.");
+			return NULL;
+		}
+		n_columns += mats[i]->n_columns;
+	}
+
+	Matrix* stacked = NULL;
+	if (mat_init(&stacked, n_rows, n_columns) != UTIL_OK)
+		return NULL;
+
+	// each output row is the concatenation of the sources' rows, so every source row is copied exactly once
+	for (size_t r = 0; r < n_rows; ++r)
+	{
+		float* out = &stacked->data[r * n_columns];
+		for (size_t i = 0; i < n_mats; ++i)
+		{
+			memcpy(out, &mats[i]->data[r * mats[i]->n_columns], mats[i]->n_columns * sizeof(float));
+			out += mats[i]->n_columns;
+		}
+	}
+
+	INSTR_END(sizeof(Matrix) + n_rows * n_columns * sizeof(float), 2 * n_rows * n_columns * sizeof(float), 0);
+
+	return stacked;
+}
+
+Matrix* (mat_vstack)(const Matrix* const* mats, const size_t n_mats)
+{
+	INSTR_BEGIN(MAT_VSTACK);
+	if (n_mats == 0)
+	{
+		util_raise(UTIL_ERROR_ARGUMENT, "Need at least one matrix to stack.");
+		return NULL;
+	}
+
+	const size_t n_columns = mats[0]->n_columns;
+	size_t n_rows = 0;
+	for (size_t i = 0; i < n_mats; ++i)
+	{
+		if (mats[i]->n_columns != n_columns)
+		{
+			util_raise(UTIL_ERROR_DIMENSION, "All matrices must have the same column count when stacking vertically.");
+			return NULL;
+		}
+		n_rows += mats[i]->n_rows;
+	}
+
+	Matrix* stacked = NULL;
+	if (mat_init(&stacked, n_rows, n_columns) != UTIL_OK)
+		return NULL;
+
+	// row-major sources are already laid out the way they end up in the result, one copy each
+	float* out = stacked->data;
+	for (size_t i = 0; i < n_mats; ++i)
+	{
+		const size_t n_elem = mats[i]->n_rows * mats[i]->n_columns;
+		if (n_elem > 0)
+			memcpy(out, mats[i]->data, n_elem * sizeof(float));
+		out += n_elem;
+	}
+
+	INSTR_END(sizeof(Matrix) + n_rows * n_columns * sizeof(float), 2 * n_rows * n_columns * sizeof(float), 0);
+
+	return stacked;
+}
+
+// most floats a buffer can hold without its size in bytes overflowing
+#define MAX_ELEMENTS (SIZE_MAX / sizeof(float))
+
+// resize the buffer to hold exactly capacity floats, leaving the matrix untouched on failure
+static UtilStatus __set_capacity(Matrix** mat, const size_t capacity)
+{
+	// realloc to 0 bytes is implementation-defined, free the buffer explicitly instead
+	if (capacity == 0)
+	{
+		__free_data((*mat)->data, (*mat)->capacity);
+		(*mat)->data = NULL;
+		(*mat)->capacity = 0;
+		return UTIL_OK;
+	}
+
+	// on failure the old buffer is still the matrix's, placement included
+	float* alloc = util_realloc((*mat)->data, capacity * sizeof(float));
+	if (!alloc)
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory when trying to grow Matrix.");
+#ifdef CMATRIX_NUMA
+	// the buffer may have moved, so drop the old range's policy (a no-op if the allocator already unmapped it)
+	// and interleave wherever it ended up. pages that are already placed stay where they are either way
+	__numa_release((*mat)->data, (*mat)->capacity * sizeof(float));
+	__numa_interleave(alloc, capacity * sizeof(float));
+#endif
+
+	(*mat)->data = alloc;
+	(*mat)->capacity = capacity;
+
+	return UTIL_OK;
+}
+
+UtilStatus mat_reserve_rows(Matrix** mat, const size_t n_rows)
+{
+	INSTR_BEGIN(MAT_RESERVE_ROWS);
+	if ((*mat)->n_columns > 0 && n_rows > MAX_ELEMENTS / (*mat)->n_columns)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Too many rows to reserve in Matrix.");
+
+	const size_t needed = n_rows * (*mat)->n_columns;
+	const size_t old_capacity = (*mat)->capacity;
+	if (needed <= old_capacity)
+		return UTIL_OK;
+
+	UtilStatus status = __set_capacity(mat, needed);
+	INSTR_END(((*mat)->capacity - old_capacity) * sizeof(float), (*mat)->n_rows * (*mat)->n_columns * sizeof(float), 0);
+
+	return status;
+}
+
+UtilStatus mat_append_rows(Matrix** mat, const float* rows, const size_t n_rows)
+{
+	INSTR_BEGIN(MAT_APPEND_ROWS);
+	const size_t n_elem = (*mat)->n_rows * (*mat)->n_columns;
+	if ((*mat)->n_columns > 0 && n_rows > (MAX_ELEMENTS - n_elem) / (*mat)->n_columns)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Too many rows to append to Matrix.");
+
+	const size_t n_new = n_rows * (*mat)->n_columns;
+	const size_t old_capacity = (*mat)->capacity;
+
+	if (n_elem + n_new > old_capacity)
+	{
+		// double the capacity so a long run of appends copies every element O(1) times on average
+		size_t capacity = old_capacity <= MAX_ELEMENTS / 2 ? old_capacity * 2 : MAX_ELEMENTS;
+		if (capacity < n_elem + n_new)
+			capacity = n_elem + n_new;
+
+		UtilStatus status = __set_capacity(mat, capacity);
+		if (status != UTIL_OK)
+			return status;
+	}
+
+	if (n_new > 0)
+		memcpy(&(*mat)->data[n_elem], rows, n_new * sizeof(float));
+	(*mat)->n_rows += n_rows;
+	INSTR_END(((*mat)->capacity - old_capacity) * sizeof(float), 2 * n_new * sizeof(float), 0);
+
+	return UTIL_OK;
+}
+
+UtilStatus mat_shrink_to_fit(Matrix** mat)
+{
+	INSTR_BEGIN(MAT_SHRINK_TO_FIT);
+	const size_t n_elem = (*mat)->n_rows * (*mat)->n_columns;
+	if (n_elem == (*mat)->capacity)
+		return UTIL_OK;
+
+	UtilStatus status = __set_capacity(mat, n_elem);
+	INSTR_END(0, n_elem * sizeof(float), 0);
+
+	return status;
+}
@@ -0,0 +1,472 @@
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "matrix.h"
+#include "util.h"
+#include "instrument.h"
+
+// stream layout (all header fields little-endian):
+//   0  "CMAT"
+//   4  u16 version
+//   6  u16 codec (MatCodec)
+//   8  u64 n_rows
+//   16 u64 n_columns
+//   24 u32 element size (always 4)
+//   28 u32 reserved (0)
+//   32 payload
+// the raw payload is the matrix data as is. the compressed payload is a sequence of frames, one per SERIAL_BLOCK
+// elements: u32 frame length, u32 encoded length of each of the 4 byte planes, then the encoded planes.
+#define SERIAL_MAGIC "CMAT"
+#define SERIAL_VERSION 1
+#define SERIAL_HEADER_SIZE 32
+
+// elements per compressed frame. small enough that decoding a frame's 4 planes stays in cache
+#define SERIAL_BLOCK 16384
+
+// buffered output for file descriptors
+#define SERIAL_STAGING 65536
+
+// RLE ops: control byte c < 128 is followed by c + 1 literal bytes, c >= 128 by one byte repeated c - 125 times
+#define RLE_MAX_LITERAL 128
+#define RLE_MIN_RUN 3
+#define RLE_MAX_RUN 130
+#define RLE_BOUND(n) ((n) + ((n) + RLE_MAX_LITERAL - 1) / RLE_MAX_LITERAL)
+
+#define FRAME_HEADER_SIZE (5 * sizeof(uint32_t))
+#define FRAME_BOUND(n_elem) (FRAME_HEADER_SIZE + sizeof(float) * RLE_BOUND(n_elem))
+
+static void __put_u16(uint8_t* out, const uint16_t value)
+{
+	out[0] = (uint8_t)value;
+	out[1] = (uint8_t)(value >> 8);
+}
+
+static void __put_u32(uint8_t* out, const uint32_t value)
+{
+	for (size_t i = 0; i < 4; ++i)
+		out[i] = (uint8_t)(value >> (8 * i));
+}
+
+static void __put_u64(uint8_t* out, const uint64_t value)
+{
+	for (size_t i = 0; i < 8; ++i)
+		out[i] = (uint8_t)(value >> (8 * i));
+}
+
+static uint16_t __get_u16(const uint8_t* in)
+{
+	return (uint16_t)(in[0] | in[1] << 8);
+}
+
+static uint32_t __get_u32(const uint8_t* in)
+{
+	uint32_t value = 0;
+	for (size_t i = 0; i < 4; ++i)
+		value |= (uint32_t)in[i] << (8 * i);
+	return value;
+}
+
+static uint64_t __get_u64(const uint8_t* in)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < 8; ++i)
+		value |= (uint64_t)in[i] << (8 * i);
+	return value;
+}
+
+// where the serialized bytes go: a file descriptor (through a staging buffer) or a caller's memory buffer
+typedef struct Writer
+{
+	int fd; // -1 for a memory buffer
+	uint8_t* buffer;
+	size_t size;
+	size_t pos;
+} Writer;
+
+static UtilStatus __write_all(const int fd, const uint8_t* data, size_t n)
+{
+	while (n > 0)
+	{
+		const ssize_t written = write(fd, data, n);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return util_raise(UTIL_ERROR_IO, "Couldn't write the matrix to the file descriptor.");
+		}
+
+		data += written;
+		n -= (size_t)written;
+	}
+
+	return UTIL_OK;
+}
+
+static UtilStatus __writer_flush(Writer* writer)
+{
+	if (writer->fd < 0 || writer->pos == 0)
+		return UTIL_OK;
+
+	const size_t n = writer->pos;
+	writer->pos = 0;
+	return __write_all(writer->fd, writer->buffer, n);
+}
+
+static UtilStatus __writer_put(Writer* writer, const void* data, const size_t n)
+{
+	// an empty matrix may not have a buffer at all
+	if (n == 0)
+		return UTIL_OK;
+
+	if (writer->fd < 0)
+	{
+		if (n > writer->size - writer->pos)
+			return util_raise(UTIL_ERROR_ARGUMENT, "Buffer is too small for the serialized matrix, see mat_write_bound.");
+		memcpy(&writer->buffer[writer->pos], data, n);
+		writer->pos += n;
+		return UTIL_OK;
+	}
+
+	if (n > writer->size - writer->pos)
+	{
+		UtilStatus status = __writer_flush(writer);
+		if (status != UTIL_OK)
+			return status;
+	}
+
+	// bigger than the staging buffer (e.g., a raw payload), no point in copying it
+	if (n > writer->size)
+		return __write_all(writer->fd, data, n);
+
+	memcpy(&writer->buffer[writer->pos], data, n);
+	writer->pos += n;
+	return UTIL_OK;
+}
+
+// where the serialized bytes come from. a file descriptor is read exactly as far as the matrix goes, so several
+// matrices can be read back to back from the same stream
+typedef struct Reader
+{
+	int fd; // -1 for a memory buffer
+	const uint8_t* buffer;
+	size_t size;
+	size_t pos;
+} Reader;
+
+// the next n bytes of the stream. they're read into scratch for a file descriptor, a memory buffer is used in place
+static const uint8_t* __reader_get(Reader* reader, const size_t n, uint8_t* scratch, UtilStatus* status)
+{
+	*status = UTIL_OK;
+	if (reader->fd < 0)
+	{
+		if (n > reader->size - reader->pos)
+		{
+			*status = util_raise(UTIL_ERROR_FORMAT, "Serialized matrix is truncated.");
+			return NULL;
+		}
+		const uint8_t* data = &reader->buffer[reader->pos];
+		reader->pos += n;
+		return data;
+	}
+
+	for (size_t done = 0; done < n;)
+	{
+		const ssize_t got = read(reader->fd, &scratch[done], n - done);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+		{
+			*status = got == 0
+				? util_raise(UTIL_ERROR_FORMAT, "Serialized matrix is truncated.")
+				: util_raise(UTIL_ERROR_IO, "Couldn't read the matrix from the file descriptor.");
+			return NULL;
+		}
+		done += (size_t)got;
+	}
+
+	return scratch;
+}
+
+// encode n bytes taken stride bytes apart (one byte plane of the floats) into out, at most RLE_BOUND(n) bytes
+static size_t __rle_encode(const uint8_t* in, const size_t stride, const size_t n, uint8_t* out)
+{
+	size_t i = 0, o = 0;
+	while (i < n)
+	{
+		const uint8_t value = in[i * stride];
+		size_t run = 1;
+		while (i + run < n && run < RLE_MAX_RUN && in[(i + run) * stride] == value)
+			++run;
+
+		if (run >= RLE_MIN_RUN)
+		{
+			out[o++] = (uint8_t)(run + 125);
+			out[o++] = value;
+			i += run;
+			continue;
+		}
+
+		// literals up to the next run that's worth encoding
+		const size_t start = i;
+		while (i < n && i - start < RLE_MAX_LITERAL
+				&& !(i + 2 < n && in[i * stride] == in[(i + 1) * stride] && in[i * stride] == in[(i + 2) * stride]))
+			++i;
+
+		out[o++] = (uint8_t)(i - start - 1);
+		for (size_t k = start; k < i; ++k)
+			out[o++] = in[k * stride];
+	}
+
+	return o;
+}
+
+// decode into exactly n bytes, stride bytes apart (back into their byte plane). false if the data doesn't decode to n bytes
+static bool __rle_decode(const uint8_t* in, const size_t n_in, uint8_t* out, const size_t stride, const size_t n)
+{
+	size_t i = 0, o = 0;
+	while (i < n_in)
+	{
+		const uint8_t control = in[i++];
+		if (control < 128)
+		{
+			const size_t length = (size_t)control + 1;
+			if (length > n_in - i || length > n - o)
+				return false;
+			for (size_t k = 0; k < length; ++k)
+				out[(o + k) * stride] = in[i + k];
+			i += length;
+			o += length;
+		}
+		else
+		{
+			const size_t length = (size_t)control - 125;
+			if (i == n_in || length > n - o)
+				return false;
+			const uint8_t value = in[i++];
+			for (size_t k = 0; k < length; ++k)
+				out[(o + k) * stride] = value;
+			o += length;
+		}
+	}
+
+	return o == n;
+}
+
+size_t mat_write_bound(const Matrix* mat, const MatCodec codec)
+{
+	const size_t n_elem = mat->n_rows * mat->n_columns;
+	if (codec == MAT_CODEC_RAW)
+		return SERIAL_HEADER_SIZE + n_elem * sizeof(float);
+
+	const size_t n_full = n_elem / SERIAL_BLOCK, tail = n_elem % SERIAL_BLOCK;
+	return SERIAL_HEADER_SIZE + n_full * FRAME_BOUND(SERIAL_BLOCK) + (tail > 0 ? FRAME_BOUND(tail) : 0);
+}
+
+static UtilStatus __write_shuffle_rle(const Matrix* mat, Writer* writer)
+{
+	uint8_t* frame = util_malloc(FRAME_BOUND(SERIAL_BLOCK));
+	if (!frame)
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory while writing a matrix.");
+
+	const uint8_t* bytes = (const uint8_t*)mat->data;
+	const size_t n_elem = mat->n_rows * mat->n_columns;
+	UtilStatus status = UTIL_OK;
+	for (size_t first = 0; first < n_elem && status == UTIL_OK; first += SERIAL_BLOCK)
+	{
+		const size_t n = n_elem - first < SERIAL_BLOCK ? n_elem - first : SERIAL_BLOCK;
+
+		// byte p of every float goes into plane p: the sign / exponent bytes of similar values and the zero bytes
+		// of sparse data end up next to each other, which is what makes the RLE pay off
+		size_t length = FRAME_HEADER_SIZE;
+		for (size_t p = 0; p < sizeof(float); ++p)
+		{
+			const size_t encoded = __rle_encode(&bytes[first * sizeof(float) + p], sizeof(float), n, &frame[length]);
+			__put_u32(&frame[(1 + p) * sizeof(uint32_t)], (uint32_t)encoded);
+			length += encoded;
+		}
+		__put_u32(frame, (uint32_t)(length - sizeof(uint32_t)));
+
+		status = __writer_put(writer, frame, length);
+	}
+
+	util_free(frame);
+	return status;
+}
+
+static UtilStatus __write(const Matrix* mat, const MatCodec codec, Writer* writer)
+{
+	if (codec != MAT_CODEC_RAW && codec != MAT_CODEC_SHUFFLE_RLE)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Unknown codec when writing a matrix.");
+
+	uint8_t header[SERIAL_HEADER_SIZE] = { 0 };
+	memcpy(header, SERIAL_MAGIC, 4);
+	__put_u16(&header[4], SERIAL_VERSION);
+	__put_u16(&header[6], (uint16_t)codec);
+	__put_u64(&header[8], mat->n_rows);
+	__put_u64(&header[16], mat->n_columns);
+	__put_u32(&header[24], sizeof(float));
+
+	UtilStatus status = __writer_put(writer, header, SERIAL_HEADER_SIZE);
+	if (status != UTIL_OK)
+		return status;
+
+	if (codec == MAT_CODEC_RAW)
+		status = __writer_put(writer, mat->data, mat->n_rows * mat->n_columns * sizeof(float));
+	else
+		status = __write_shuffle_rle(mat, writer);
+	if (status != UTIL_OK)
+		return status;
+
+	return __writer_flush(writer);
+}
+
+UtilStatus mat_write(const Matrix* mat, const MatCodec codec, const int fd)
+{
+	INSTR_BEGIN(MAT_WRITE);
+	if (fd < 0)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Invalid file descriptor when writing a matrix.");
+
+	uint8_t* staging = util_malloc(SERIAL_STAGING);
+	if (!staging)
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory while writing a matrix.");
+
+	Writer writer = { fd, staging, SERIAL_STAGING, 0 };
+	UtilStatus status = __write(mat, codec, &writer);
+	util_free(staging);
+	INSTR_END(0, mat->n_rows * mat->n_columns * sizeof(float), 0);
+
+	return status;
+}
+
+UtilStatus mat_write_buffer(const Matrix* mat, const MatCodec codec, void* buffer, const size_t size, size_t* written)
+{
+	INSTR_BEGIN(MAT_WRITE);
+	Writer writer = { -1, buffer, size, 0 };
+	UtilStatus status = __write(mat, codec, &writer);
+	if (status == UTIL_OK && written)
+		*written = writer.pos;
+	INSTR_END(0, mat->n_rows * mat->n_columns * sizeof(float), 0);
+
+	return status;
+}
+
+static UtilStatus __read_shuffle_rle(Reader* reader, Matrix* mat)
+{
+	// a memory buffer is decoded in place, only a file descriptor needs somewhere to read the frames into
+	uint8_t* scratch = NULL;
+	if (reader->fd >= 0)
+	{
+		scratch = util_malloc(FRAME_BOUND(SERIAL_BLOCK));
+		if (!scratch)
+			return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory while reading a matrix.");
+	}
+
+	uint8_t* bytes = (uint8_t*)mat->data;
+	const size_t n_elem = mat->n_rows * mat->n_columns;
+	UtilStatus status = UTIL_OK;
+	for (size_t first = 0; first < n_elem && status == UTIL_OK; first += SERIAL_BLOCK)
+	{
+		const size_t n = n_elem - first < SERIAL_BLOCK ? n_elem - first : SERIAL_BLOCK;
+
+		const uint8_t* length_field = __reader_get(reader, sizeof(uint32_t), scratch, &status);
+		if (!length_field)
+			break;
+		const size_t length = __get_u32(length_field);
+		if (length < FRAME_HEADER_SIZE - sizeof(uint32_t) || length > FRAME_BOUND(n) - sizeof(uint32_t))
+		{
+			status = util_raise(UTIL_ERROR_FORMAT, "Serialized matrix is corrupt.");
+			break;
+		}
+
+		const uint8_t* frame = __reader_get(reader, length, scratch, &status);
+		if (!frame)
+			break;
+
+		// the planes are decoded straight into their bytes of the target's floats
+		size_t offset = FRAME_HEADER_SIZE - sizeof(uint32_t);
+		for (size_t p = 0; p < sizeof(float) && status == UTIL_OK; ++p)
+		{
+			const size_t encoded = __get_u32(&frame[p * sizeof(uint32_t)]);
+			if (encoded > length - offset || !__rle_decode(&frame[offset], encoded, &bytes[first * sizeof(float) + p], sizeof(float), n))
+				status = util_raise(UTIL_ERROR_FORMAT, "Serialized matrix is corrupt.");
+			offset += encoded;
+		}
+		if (status == UTIL_OK && offset != length)
+			status = util_raise(UTIL_ERROR_FORMAT, "Serialized matrix is corrupt.");
+	}
+
+	util_free(scratch);
+	return status;
+}
+
+static UtilStatus __read(Reader* reader, Matrix** target)
+{
+	uint8_t scratch[SERIAL_HEADER_SIZE];
+	UtilStatus status;
+	const uint8_t* header = __reader_get(reader, SERIAL_HEADER_SIZE, scratch, &status);
+	if (!header)
+		return status;
+
+	const uint16_t codec = __get_u16(&header[6]);
+	const uint64_t n_rows = __get_u64(&header[8]);
+	const uint64_t n_columns = __get_u64(&header[16]);
+	if (memcmp(header, SERIAL_MAGIC, 4) != 0 || __get_u32(&header[24]) != sizeof(float) || __get_u32(&header[28]) != 0)
+		return util_raise(UTIL_ERROR_FORMAT, "Not a serialized matrix.");
+	if (__get_u16(&header[4]) != SERIAL_VERSION || (codec != MAT_CODEC_RAW && codec != MAT_CODEC_SHUFFLE_RLE))
+		return util_raise(UTIL_ERROR_FORMAT, "Unsupported serialized matrix version or codec.");
+	if (n_rows > SIZE_MAX || n_columns > SIZE_MAX || (n_columns > 0 && n_rows > SIZE_MAX / sizeof(float) / n_columns))
+		return util_raise(UTIL_ERROR_FORMAT, "Serialized matrix is too large.");
+
+	bool allocated = false;
+	if (!*target)
+	{
+		status = mat_init(target, (size_t)n_rows, (size_t)n_columns);
+		if (status != UTIL_OK)
+			return status;
+		allocated = true;
+	}
+	else if ((*target)->n_rows != n_rows || (*target)->n_columns != n_columns)
+		return util_raise(UTIL_ERROR_DIMENSION, "Target dimensions must match the serialized matrix.");
+
+	// everything above is checked before the target is touched, from here on the payload is decoded straight into it
+	if (codec == MAT_CODEC_RAW)
+	{
+		// a file descriptor is read straight into the matrix
+		const size_t size = (size_t)(n_rows * n_columns) * sizeof(float);
+		const uint8_t* data = __reader_get(reader, size, (uint8_t*)(*target)->data, &status);
+		if (data && size > 0 && data != (const uint8_t*)(*target)->data)
+			memcpy((*target)->data, data, size);
+	}
+	else
+		status = __read_shuffle_rle(reader, *target);
+
+	if (status != UTIL_OK && allocated)
+		mat_free(target);
+
+	return status;
+}
+
+UtilStatus mat_read(const int fd, Matrix** target)
+{
+	INSTR_BEGIN(MAT_READ);
+	if (fd < 0)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Invalid file descriptor when reading a matrix.");
+
+	Reader reader = { fd, NULL, 0, 0 };
+	UtilStatus status = __read(&reader, target);
+	INSTR_END(0, status == UTIL_OK ? (*target)->n_rows * (*target)->n_columns * sizeof(float) : 0, 0);
+
+	return status;
+}
+
+UtilStatus mat_read_buffer(const void* buffer, const size_t size, Matrix** target, size_t* consumed)
+{
+	INSTR_BEGIN(MAT_READ);
+	Reader reader = { -1, buffer, size, 0 };
+	UtilStatus status = __read(&reader, target);
+	if (status == UTIL_OK && consumed)
+		*consumed = reader.pos;
+	INSTR_END(0, status == UTIL_OK ? (*target)->n_rows * (*target)->n_columns * sizeof(float) : 0, 0);
+
+	return status;
+}
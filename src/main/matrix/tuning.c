@@ -0,0 +1,452 @@
+#include <time.h>
+#include "matrix.h"
+#include "util.h"
+
+#define DEFAULT_L1_BYTES (32 * 1024)
+#define DEFAULT_L2_BYTES (256 * 1024)
+#define DEFAULT_PARALLEL_THRESHOLD (64 * 64)
+
+// read the size (in bytes) of the cpu0 data/unified cache at the given level from sysfs, 0 if unavailable
+static size_t __read_cache_size(const int level)
+{
+	char path[128];
+	char type[32];
+	char size[32];
+
+	for (int index = 0; index < 8; ++index)
+	{
+		int cache_level = 0;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+		FILE* f = fopen(path, "r");
+		if (!f)
+			break;
+		int matched = fscanf(f, "%d", &cache_level);
+		fclose(f);
+		if (matched != 1 || cache_level != level)
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		matched = fscanf(f, "%31s", type);
+		fclose(f);
+		if (matched != 1 || strcmp(type, "Instruction") == 0)
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		matched = fscanf(f, "%31s", size);
+		fclose(f);
+		if (matched != 1)
+			continue;
+
+		// sizes look like "32K" or "8M"
+		char* unit = NULL;
+		size_t bytes = strtoul(size, &unit, 10);
+		if (*unit == 'K')
+			bytes *= 1024;
+		else if (*unit == 'M')
+			bytes *= 1024 * 1024;
+		return bytes;
+	}
+
+	return 0;
+}
+
+static size_t __clamp(size_t value, size_t lower, size_t upper)
+{
+	if (value < lower)
+		return lower;
+	if (value > upper)
+		return upper;
+	return value;
+}
+
+static size_t __round_down_pow2(size_t value)
+{
+	size_t pow2 = 1;
+	while (pow2 * 2 <= value)
+		pow2 *= 2;
+	return pow2;
+}
+
+void mat_tuning_defaults(MatTuning* tuning)
+{
+	size_t l1 = __read_cache_size(1);
+	size_t l2 = __read_cache_size(2);
+	if (l1 == 0)
+		l1 = DEFAULT_L1_BYTES;
+	if (l2 == 0)
+		l2 = DEFAULT_L2_BYTES;
+
+	// the packed (block_k, block_columns) panel of mat2 should take about half of L2,
+	// and the output tile that is updated against it about a quarter
+	tuning->gemm_block_k = 256;
+	tuning->gemm_block_columns = __clamp(__round_down_pow2(l2 / 2 / (tuning->gemm_block_k * sizeof(float))), 64, 1024);
+	tuning->gemm_block_rows = __clamp(__round_down_pow2(l2 / 4 / (tuning->gemm_block_columns * sizeof(float))), 16, 256);
+
+	// a source tile and a destination tile of transpose should fit in L1 together
+	size_t transpose_block = 1;
+	while ((transpose_block * 2) * (transpose_block * 2) * sizeof(float) * 2 <= l1)
+		transpose_block *= 2;
+	tuning->transpose_block = __clamp(transpose_block, 8, 128);
+
+	tuning->strassen_cutoff = 0;
+	tuning->parallel_threshold = DEFAULT_PARALLEL_THRESHOLD;
+}
+
+// resolve the profile path. returns false if there is nowhere to look
+static bool __profile_path(const char* path, char* buffer, size_t buffer_size)
+{
+	if (path)
+	{
+		snprintf(buffer, buffer_size, "%s", path);
+		return true;
+	}
+
+	const char* env_path = getenv("CMATRIX_TUNING_PROFILE");
+	if (env_path && *env_path)
+	{
+		snprintf(buffer, buffer_size, "%s", env_path);
+		return true;
+	}
+
+	const char* home = getenv("HOME");
+	if (home && *home)
+	{
+		snprintf(buffer, buffer_size, "%s/.cmatrix_tuning", home);
+		return true;
+	}
+
+	return false;
+}
+
+// zero block sizes would make the kernels loop forever and huge ones allocate absurd packing buffers
+static bool __valid_block(const size_t value)
+{
+	return value > 0 && value <= MAT_TUNING_MAX_BLOCK;
+}
+
+bool mat_tuning_load(const char* path, MatTuning* tuning)
+{
+	char resolved[1024];
+	if (!__profile_path(path, resolved, sizeof(resolved)))
+		return false;
+
+	FILE* f = fopen(resolved, "r");
+	if (!f)
+		return false;
+
+	// parse into a copy so a profile with a bad value doesn't leave tuning half-updated
+	MatTuning loaded = *tuning;
+	bool valid = true;
+
+	char key[64];
+	size_t value = 0;
+	while (valid && fscanf(f, "%63s %zu", key, &value) == 2)
+	{
+		if (strcmp(key, "gemm_block_rows") == 0)
+		{
+			valid = __valid_block(value);
+			loaded.gemm_block_rows = value;
+		}
+		else if (strcmp(key, "gemm_block_columns") == 0)
+		{
+			valid = __valid_block(value);
+			loaded.gemm_block_columns = value;
+		}
+		else if (strcmp(key, "gemm_block_k") == 0)
+		{
+			valid = __valid_block(value);
+			loaded.gemm_block_k = value;
+		}
+		else if (strcmp(key, "transpose_block") == 0)
+		{
+			valid = __valid_block(value);
+			loaded.transpose_block = value;
+		}
+		else if (strcmp(key, "strassen_cutoff") == 0)
+		{
+			// a cutoff of 1 would recurse down to single elements
+			valid = value != 1;
+			loaded.strassen_cutoff = value;
+		}
+		else if (strcmp(key, "parallel_threshold") == 0)
+			loaded.parallel_threshold = value;
+	}
+
+	fclose(f);
+
+	if (!valid)
+		return false;
+
+	*tuning = loaded;
+	return true;
+}
+
+bool mat_tuning_save(const char* path, const MatTuning* tuning)
+{
+	char resolved[1024];
+	if (!__profile_path(path, resolved, sizeof(resolved)))
+		return false;
+
+	FILE* f = fopen(resolved, "w");
+	if (!f)
+		return false;
+
+	fprintf(f, "gemm_block_rows %zu\n", tuning->gemm_block_rows);
+	fprintf(f, "gemm_block_columns %zu\n", tuning->gemm_block_columns);
+	fprintf(f, "gemm_block_k %zu\n", tuning->gemm_block_k);
+	fprintf(f, "transpose_block %zu\n", tuning->transpose_block);
+	fprintf(f, "strassen_cutoff %zu\n", tuning->strassen_cutoff);
+	fprintf(f, "parallel_threshold %zu\n", tuning->parallel_threshold);
+
+	return fclose(f) == 0;
+}
+
+static double __now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// the kernels pick up the calling thread's context tuning, so measuring a candidate just means pointing the
+// benchmark's private context at it. no other thread ever sees it
+static void __use_candidate(const MatTuning* candidate)
+{
+	util_get_context()->tuning = candidate;
+}
+
+// best of a few runs of target = mat1 x mat2 with the current candidate
+static double __time_multiply(const Matrix* mat1, const Matrix* mat2, Matrix** target, const bool parallel)
+{
+	double best = -1.0;
+	for (int run = 0; run < 3; ++run)
+	{
+		double start = __now();
+		if (parallel)
+			mat_multiply_inplace_parallel(mat1, mat2, target);
+		else
+			mat_multiply_inplace(mat1, mat2, target);
+		double elapsed = __now() - start;
+		if (best < 0.0 || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+static double __time_transpose(const Matrix* mat, Matrix** target)
+{
+	double best = -1.0;
+	for (int run = 0; run < 3; ++run)
+	{
+		double start = __now();
+		mat_transpose_inplace(mat, target);
+		double elapsed = __now() - start;
+		if (best < 0.0 || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+// allocate n_mats square matrices of the given size, all or nothing
+static UtilStatus __init_square(Matrix** mats, const size_t n_mats, const size_t size)
+{
+	for (size_t i = 0; i < n_mats; ++i)
+		if (mat_init(&mats[i], size, size) != UTIL_OK)
+		{
+			while (i-- > 0)
+				mat_free(&mats[i]);
+			return UTIL_ERROR_ALLOCATION;
+		}
+
+	return UTIL_OK;
+}
+
+static void __free_all(Matrix** mats, const size_t n_mats)
+{
+	for (size_t i = 0; i < n_mats; ++i)
+		mat_free(&mats[i]);
+}
+
+static UtilStatus __autotune(MatTuning* tuning)
+{
+	const bool tune_strassen = tuning->strassen_cutoff > 0;
+	Matrix* mats[3] = { NULL, NULL, NULL };
+
+	MatTuning current;
+	mat_tuning_defaults(&current);
+	__use_candidate(&current);
+
+	// gemm blocking
+	{
+		if (__init_square(mats, 3, 384) != UTIL_OK)
+			return UTIL_ERROR_ALLOCATION;
+		Matrix* a = mats[0];
+		Matrix* b = mats[1];
+		Matrix* c = mats[2];
+		mat_fill(&a, 1.0f);
+		mat_fill(&b, 1.0f);
+
+		const size_t rows[] = { 16, 32, 64, 128 };
+		const size_t columns[] = { 64, 128, 256, 512 };
+		const size_t inner[] = { 64, 128, 256, 512 };
+
+		MatTuning best = current;
+		double best_time = __time_multiply(a, b, &c, false);
+		for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); ++i)
+			for (size_t j = 0; j < sizeof(columns) / sizeof(columns[0]); ++j)
+				for (size_t k = 0; k < sizeof(inner) / sizeof(inner[0]); ++k)
+				{
+					MatTuning candidate = current;
+					candidate.gemm_block_rows = rows[i];
+					candidate.gemm_block_columns = columns[j];
+					candidate.gemm_block_k = inner[k];
+					__use_candidate(&candidate);
+
+					double elapsed = __time_multiply(a, b, &c, false);
+					if (elapsed < best_time)
+					{
+						best_time = elapsed;
+						best = candidate;
+					}
+				}
+
+		current = best;
+		__use_candidate(&current);
+
+		__free_all(mats, 3);
+	}
+
+	// transpose tiles
+	{
+		if (__init_square(mats, 2, 2048) != UTIL_OK)
+			return UTIL_ERROR_ALLOCATION;
+		Matrix* a = mats[0];
+		Matrix* t = mats[1];
+
+		const size_t blocks[] = { 8, 16, 32, 64, 128 };
+
+		MatTuning best = current;
+		double best_time = __time_transpose(a, &t);
+		for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); ++i)
+		{
+			MatTuning candidate = current;
+			candidate.transpose_block = blocks[i];
+			__use_candidate(&candidate);
+
+			double elapsed = __time_transpose(a, &t);
+			if (elapsed < best_time)
+			{
+				best_time = elapsed;
+				best = candidate;
+			}
+		}
+
+		current = best;
+		__use_candidate(&current);
+
+		__free_all(mats, 2);
+	}
+
+	// smallest square product where spawning threads pays off (without OpenMP both timings are the same
+	// kernel, so this only picks up noise - keep the default there)
+#ifdef _OPENMP
+	{
+		const size_t sizes[] = { 16, 32, 64, 128, 256 };
+		current.parallel_threshold = 0;
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]) && current.parallel_threshold == 0; ++i)
+		{
+			if (__init_square(mats, 3, sizes[i]) != UTIL_OK)
+				return UTIL_ERROR_ALLOCATION;
+			Matrix* a = mats[0];
+			Matrix* b = mats[1];
+			Matrix* c = mats[2];
+
+			MatTuning candidate = current;
+			candidate.parallel_threshold = 0;
+			__use_candidate(&candidate);
+			if (__time_multiply(a, b, &c, true) < __time_multiply(a, b, &c, false))
+				current.parallel_threshold = sizes[i] * sizes[i];
+
+			__free_all(mats, 3);
+		}
+		if (current.parallel_threshold == 0)
+			current.parallel_threshold = 256 * 256;
+		__use_candidate(&current);
+	}
+#endif
+
+	// Strassen-Winograd cutoff, only if the caller opted in
+	if (tune_strassen)
+	{
+		if (__init_square(mats, 3, 1024) != UTIL_OK)
+			return UTIL_ERROR_ALLOCATION;
+		Matrix* a = mats[0];
+		Matrix* b = mats[1];
+		Matrix* c = mats[2];
+		mat_fill(&a, 1.0f);
+		mat_fill(&b, 1.0f);
+
+		const size_t cutoffs[] = { 128, 256, 512 };
+
+		MatTuning best = current;
+		best.strassen_cutoff = 0;
+		__use_candidate(&best);
+		double best_time = __time_multiply(a, b, &c, false);
+		for (size_t i = 0; i < sizeof(cutoffs) / sizeof(cutoffs[0]); ++i)
+		{
+			MatTuning candidate = current;
+			candidate.strassen_cutoff = cutoffs[i];
+			__use_candidate(&candidate);
+
+			double elapsed = __time_multiply(a, b, &c, false);
+			if (elapsed < best_time)
+			{
+				best_time = elapsed;
+				best = candidate;
+			}
+		}
+
+		// the largest cutoff is kept if Strassen never won, so larger products can still use it
+		if (best.strassen_cutoff == 0)
+			best.strassen_cutoff = cutoffs[sizeof(cutoffs) / sizeof(cutoffs[0]) - 1];
+		current = best;
+
+		__free_all(mats, 3);
+	}
+	else
+		current.strassen_cutoff = 0;
+
+	*tuning = current;
+
+	return UTIL_OK;
+}
+
+UtilStatus mat_autotune(MatTuning* tuning)
+{
+	// benchmark on a private copy of the calling thread's context (its allocator, thread count, ...), so switching
+	// between candidates can't leak into another thread sharing the caller's context
+	UtilContext* previous = util_get_context();
+	UtilContext local = *previous;
+	util_set_context(&local);
+
+	MatTuning result = *tuning;
+	UtilStatus status = __autotune(&result);
+
+	util_set_context(previous);
+
+	// only the winner is ever installed process-wide
+	if (status == UTIL_OK)
+	{
+		*tuning = result;
+		status = mat_set_tuning(tuning);
+	}
+
+	return status;
+}
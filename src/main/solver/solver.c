@@ -0,0 +1,423 @@
+#include <math.h>
+#include "solver.h"
+#include "util.h"
+#include "instrument.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// A^T x over a dense matrix accumulates this many columns at a time in registers / L1 while streaming down the rows
+#define SOLVER_TILE 32
+
+#define SOLVER_DEFAULT_TOLERANCE 1e-5f
+
+#ifdef _OPENMP
+// number of threads for the parallel kernels, from the calling thread's context
+static int __n_threads(void)
+{
+	const size_t n_threads = util_get_context()->n_threads;
+	return n_threads > 0 ? (int)n_threads : omp_get_max_threads();
+}
+#endif
+
+// whether work over n elements is worth splitting between threads
+static bool __use_threads(const bool parallel, const size_t n)
+{
+	if (!parallel)
+		return false;
+
+	MatTuning tuning;
+	mat_get_tuning(&tuning);
+	return n >= tuning.parallel_threshold;
+}
+
+// the vector kernels: each one is a single pass over its vectors, with the reductions accumulated in double
+
+static double __dot(const float* x, const float* y, const size_t n, const bool threads)
+{
+	double sum = 0.0;
+	#pragma omp parallel for simd schedule(static) num_threads(__n_threads()) proc_bind(spread) reduction(+:sum) if(threads)
+	for (size_t i = 0; i < n; ++i)
+		sum += (double)x[i] * y[i];
+	return sum;
+}
+
+static void __scale(float* x, const float s, const size_t n, const bool threads)
+{
+	#pragma omp parallel for simd schedule(static) num_threads(__n_threads()) proc_bind(spread) if(threads)
+	for (size_t i = 0; i < n; ++i)
+		x[i] *= s;
+}
+
+// y = a x + b y
+static void __axpby(const float a, const float* x, const float b, float* y, const size_t n, const bool threads)
+{
+	#pragma omp parallel for simd schedule(static) num_threads(__n_threads()) proc_bind(spread) if(threads)
+	for (size_t i = 0; i < n; ++i)
+		y[i] = a * x[i] + b * y[i];
+}
+
+// y = a x + b y, returning ||y||^2
+static double __axpby_norm(const float a, const float* x, const float b, float* y, const size_t n, const bool threads)
+{
+	double sum = 0.0;
+	#pragma omp parallel for simd schedule(static) num_threads(__n_threads()) proc_bind(spread) reduction(+:sum) if(threads)
+	for (size_t i = 0; i < n; ++i)
+	{
+		y[i] = a * x[i] + b * y[i];
+		sum += (double)y[i] * y[i];
+	}
+	return sum;
+}
+
+// CG step: x += alpha p, r -= alpha q, returning ||r||^2
+static double __cg_update(const float alpha, const float* p, const float* q, float* x, float* r, const size_t n, const bool threads)
+{
+	double sum = 0.0;
+	#pragma omp parallel for simd schedule(static) num_threads(__n_threads()) proc_bind(spread) reduction(+:sum) if(threads)
+	for (size_t i = 0; i < n; ++i)
+	{
+		x[i] += alpha * p[i];
+		r[i] -= alpha * q[i];
+		sum += (double)r[i] * r[i];
+	}
+	return sum;
+}
+
+// LSQR step: x += a w, w = v + b w, returning ||x||^2
+static double __lsqr_update(const float a, const float b, const float* v, float* w, float* x, const size_t n, const bool threads)
+{
+	double sum = 0.0;
+	#pragma omp parallel for simd schedule(static) num_threads(__n_threads()) proc_bind(spread) reduction(+:sum) if(threads)
+	for (size_t i = 0; i < n; ++i)
+	{
+		x[i] += a * w[i];
+		w[i] = v[i] + b * w[i];
+		sum += (double)x[i] * x[i];
+	}
+	return sum;
+}
+
+static void __dense_apply(const Matrix* mat, const float* x, float* y, const bool transpose, const bool parallel)
+{
+	const size_t n_rows = mat->n_rows, n_columns = mat->n_columns;
+
+	if (!transpose)
+	{
+		#pragma omp parallel for schedule(static) num_threads(__n_threads()) proc_bind(spread) if(__use_threads(parallel, n_rows * n_columns))
+		for (size_t r = 0; r < n_rows; ++r)
+		{
+			const float* row = &mat->data[r * n_columns];
+			double sum = 0.0;
+			#pragma omp simd reduction(+:sum)
+			for (size_t c = 0; c < n_columns; ++c)
+				sum += (double)row[c] * x[c];
+			y[r] = (float)sum;
+		}
+		return;
+	}
+
+	// every thread owns whole column tiles of y and streams down all rows for them, so nothing needs combining afterwards
+	const size_t n_tiles = (n_columns + SOLVER_TILE - 1) / SOLVER_TILE;
+	#pragma omp parallel for schedule(static) num_threads(__n_threads()) proc_bind(spread) if(__use_threads(parallel, n_rows * n_columns))
+	for (size_t t = 0; t < n_tiles; ++t)
+	{
+		const size_t first = t * SOLVER_TILE;
+		const size_t width = n_columns - first < SOLVER_TILE ? n_columns - first : SOLVER_TILE;
+		double acc[SOLVER_TILE] = { 0.0 };
+		for (size_t r = 0; r < n_rows; ++r)
+		{
+			const float* row = &mat->data[r * n_columns + first];
+			const double value = x[r];
+			for (size_t j = 0; j < width; ++j)
+				acc[j] += row[j] * value;
+		}
+		for (size_t j = 0; j < width; ++j)
+			y[first + j] = (float)acc[j];
+	}
+}
+
+static void __dense_apply_serial(const float* x, float* y, const bool transpose, void* argv)
+{
+	__dense_apply(argv, x, y, transpose, false);
+}
+
+static void __dense_apply_parallel(const float* x, float* y, const bool transpose, void* argv)
+{
+	__dense_apply(argv, x, y, transpose, true);
+}
+
+static void __csr_apply(const MatCsr* csr, const float* x, float* y, const bool transpose, const bool parallel)
+{
+	if (!transpose)
+	{
+		#pragma omp parallel for schedule(static) num_threads(__n_threads()) proc_bind(spread) if(__use_threads(parallel, csr->row_ptr[csr->n_rows]))
+		for (size_t r = 0; r < csr->n_rows; ++r)
+		{
+			double sum = 0.0;
+			for (size_t k = csr->row_ptr[r]; k < csr->row_ptr[r + 1]; ++k)
+				sum += (double)csr->values[k] * x[csr->col_idx[k]];
+			y[r] = (float)sum;
+		}
+		return;
+	}
+
+	memset(y, 0, csr->n_columns * sizeof(float));
+	for (size_t r = 0; r < csr->n_rows; ++r)
+	{
+		const float value = x[r];
+		for (size_t k = csr->row_ptr[r]; k < csr->row_ptr[r + 1]; ++k)
+			y[csr->col_idx[k]] += csr->values[k] * value;
+	}
+}
+
+static void __csr_apply_serial(const float* x, float* y, const bool transpose, void* argv)
+{
+	__csr_apply(argv, x, y, transpose, false);
+}
+
+static void __csr_apply_parallel(const float* x, float* y, const bool transpose, void* argv)
+{
+	__csr_apply(argv, x, y, transpose, true);
+}
+
+MatOperator mat_operator_dense(const Matrix* mat)
+{
+	MatOperator op = { mat->n_rows, mat->n_columns, __dense_apply_serial, (void*)mat };
+	return op;
+}
+
+MatOperator mat_operator_dense_parallel(const Matrix* mat)
+{
+	MatOperator op = { mat->n_rows, mat->n_columns, __dense_apply_parallel, (void*)mat };
+	return op;
+}
+
+MatOperator mat_operator_csr(const MatCsr* csr)
+{
+	MatOperator op = { csr->n_rows, csr->n_columns, __csr_apply_serial, (void*)csr };
+	return op;
+}
+
+MatOperator mat_operator_csr_parallel(const MatCsr* csr)
+{
+	MatOperator op = { csr->n_rows, csr->n_columns, __csr_apply_parallel, (void*)csr };
+	return op;
+}
+
+size_t mat_cg_workspace_size(const MatOperator* op)
+{
+	// residual, search direction and A times the search direction
+	return 3 * op->n_columns;
+}
+
+size_t mat_lsqr_workspace_size(const MatOperator* op)
+{
+	// u and A v (n_rows each), v, w and A^T u (n_columns each)
+	return 2 * op->n_rows + 3 * op->n_columns;
+}
+
+static UtilStatus __check_solver(const MatOperator* op, const MatSolverOptions* options)
+{
+	if (!op->apply)
+		return util_raise(UTIL_ERROR_ARGUMENT, "Operator has no apply function.");
+	if (options && !(options->tolerance >= 0.0f))
+		return util_raise(UTIL_ERROR_ARGUMENT, "Solver tolerance must be non-negative.");
+	// a NaN or infinite damping would silently poison every iterate
+	if (options && (!isfinite(options->damping) || options->damping < 0.0f))
+		return util_raise(UTIL_ERROR_ARGUMENT, "Solver damping must be finite and non-negative.");
+
+	return UTIL_OK;
+}
+
+// caller's workspace, or a fresh one (then *owned is set and it has to be free'd)
+static float* __workspace(float* workspace, const size_t size, bool* owned)
+{
+	*owned = false;
+	if (workspace)
+		return workspace;
+
+	*owned = true;
+	workspace = util_malloc((size > 0 ? size : 1) * sizeof(float));
+	if (!workspace)
+		util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for the solver workspace.");
+	return workspace;
+}
+
+static UtilStatus __cg(const MatOperator* op, const float* b, float* x, const MatSolverOptions* options, float* workspace, MatSolverResult* result, const bool parallel)
+{
+	INSTR_BEGIN(MAT_CG);
+	UtilStatus status = __check_solver(op, options);
+	if (status != UTIL_OK)
+		return status;
+	if (op->n_rows != op->n_columns)
+		return util_raise(UTIL_ERROR_DIMENSION, "Conjugate gradients needs a square operator.");
+
+	const size_t n = op->n_columns;
+	const size_t max_iterations = options && options->max_iterations > 0 ? options->max_iterations : n;
+	const double tolerance = options && options->tolerance > 0.0f ? options->tolerance : SOLVER_DEFAULT_TOLERANCE;
+	const bool threads = __use_threads(parallel, n);
+
+	bool owned;
+	float* ws = __workspace(workspace, mat_cg_workspace_size(op), &owned);
+	if (!ws)
+		return UTIL_ERROR_ALLOCATION;
+	float* r = ws;
+	float* p = &ws[n];
+	float* q = &ws[2 * n];
+
+	// r = b - A x
+	op->apply(x, q, false, op->argv);
+	memcpy(r, b, n * sizeof(float));
+	double rr = __axpby_norm(-1.0f, q, 1.0f, r, n, threads);
+	memcpy(p, r, n * sizeof(float));
+
+	const double threshold = tolerance * sqrt(__dot(b, b, n, threads));
+	size_t iteration = 0;
+	while (iteration < max_iterations && sqrt(rr) > threshold)
+	{
+		op->apply(p, q, false, op->argv);
+		const double pq = __dot(p, q, n, threads);
+		if (!(pq > 0.0))
+		{
+			status = util_raise(UTIL_ERROR_ARGUMENT, "Operator isn't positive definite in conjugate gradients.");
+			break;
+		}
+
+		const double alpha = rr / pq;
+		const double rr_next = __cg_update((float)alpha, p, q, x, r, n, threads);
+		__axpby(1.0f, r, (float)(rr_next / rr), p, n, threads);
+		rr = rr_next;
+		++iteration;
+	}
+
+	if (result)
+	{
+		result->iterations = iteration;
+		result->residual_norm = (float)sqrt(rr);
+		result->converged = status == UTIL_OK && sqrt(rr) <= threshold;
+	}
+
+	if (owned)
+		util_free(ws);
+	INSTR_END(owned ? mat_cg_workspace_size(op) * sizeof(float) : 0, 0, 0);
+
+	return status;
+}
+
+static UtilStatus __lsqr(const MatOperator* op, const float* b, float* x, const MatSolverOptions* options, float* workspace, MatSolverResult* result, const bool parallel)
+{
+	INSTR_BEGIN(MAT_LSQR);
+	UtilStatus status = __check_solver(op, options);
+	if (status != UTIL_OK)
+		return status;
+
+	const size_t m = op->n_rows, n = op->n_columns;
+	const size_t max_iterations = options && options->max_iterations > 0 ? options->max_iterations : 2 * n;
+	const double tolerance = options && options->tolerance > 0.0f ? options->tolerance : SOLVER_DEFAULT_TOLERANCE;
+	const double damping = options ? options->damping : 0.0;
+	const bool threads_m = __use_threads(parallel, m), threads_n = __use_threads(parallel, n);
+
+	bool owned;
+	float* ws = __workspace(workspace, mat_lsqr_workspace_size(op), &owned);
+	if (!ws)
+		return UTIL_ERROR_ALLOCATION;
+	float* u = ws;
+	float* av = &ws[m];
+	float* v = &ws[2 * m];
+	float* w = &ws[2 * m + n];
+	float* atu = &ws[2 * m + 2 * n];
+
+	// Golub-Kahan bidiagonalization, started from the residual of the initial guess: beta u = b - A x, alpha v = A^T u
+	op->apply(x, av, false, op->argv);
+	memcpy(u, b, m * sizeof(float));
+	double beta = sqrt(__axpby_norm(-1.0f, av, 1.0f, u, m, threads_m));
+	if (beta > 0.0)
+		__scale(u, (float)(1.0 / beta), m, threads_m);
+
+	op->apply(u, v, true, op->argv);
+	double alpha = sqrt(__dot(v, v, n, threads_n));
+	if (alpha > 0.0)
+		__scale(v, (float)(1.0 / alpha), n, threads_n);
+	memcpy(w, v, n * sizeof(float));
+
+	const double b_norm = sqrt(__dot(b, b, m, threads_m));
+	double x_norm = sqrt(__dot(x, x, n, threads_n));
+	double a_norm2 = 0.0, damped2 = 0.0;
+	double phibar = beta, rhobar = alpha;
+	double r_norm = beta;
+	// ||A^T r||, zero right away if x already is a solution
+	double ar_norm = alpha * beta;
+	bool converged = ar_norm == 0.0;
+
+	size_t iteration = 0;
+	while (!converged && iteration < max_iterations)
+	{
+		// next step of the bidiagonalization: beta u = A v - alpha u, alpha v = A^T u - beta v
+		op->apply(v, av, false, op->argv);
+		beta = sqrt(__axpby_norm(1.0f, av, (float)-alpha, u, m, threads_m));
+		if (beta > 0.0)
+			__scale(u, (float)(1.0 / beta), m, threads_m);
+		a_norm2 += alpha * alpha + beta * beta + damping * damping;
+
+		op->apply(u, atu, true, op->argv);
+		alpha = sqrt(__axpby_norm(1.0f, atu, (float)-beta, v, n, threads_n));
+		if (alpha > 0.0)
+			__scale(v, (float)(1.0 / alpha), n, threads_n);
+
+		// rotate the damping term away, then the subdiagonal beta
+		const double rhobar1 = hypot(rhobar, damping);
+		const double psi = damping / rhobar1 * phibar;
+		phibar *= rhobar / rhobar1;
+
+		const double rho = hypot(rhobar1, beta);
+		const double c = rhobar1 / rho, s = beta / rho;
+		const double theta = s * alpha;
+		const double phi = c * phibar;
+		rhobar = -c * alpha;
+		phibar *= s;
+
+		x_norm = sqrt(__lsqr_update((float)(phi / rho), (float)(-theta / rho), v, w, x, n, threads_n));
+		++iteration;
+
+		damped2 += psi * psi;
+		r_norm = sqrt(phibar * phibar + damped2);
+		ar_norm = alpha * fabs(s * phi);
+		const double a_norm = sqrt(a_norm2);
+		converged = r_norm <= tolerance * (b_norm + a_norm * x_norm) || ar_norm <= tolerance * a_norm * r_norm;
+	}
+
+	if (result)
+	{
+		result->iterations = iteration;
+		result->residual_norm = (float)r_norm;
+		result->converged = converged;
+	}
+
+	if (owned)
+		util_free(ws);
+	INSTR_END(owned ? mat_lsqr_workspace_size(op) * sizeof(float) : 0, 0, 0);
+
+	return UTIL_OK;
+}
+
+UtilStatus mat_cg(const MatOperator* op, const float* b, float* x, const MatSolverOptions* options, float* workspace, MatSolverResult* result)
+{
+	return __cg(op, b, x, options, workspace, result, false);
+}
+
+UtilStatus mat_cg_parallel(const MatOperator* op, const float* b, float* x, const MatSolverOptions* options, float* workspace, MatSolverResult* result)
+{
+	return __cg(op, b, x, options, workspace, result, true);
+}
+
+UtilStatus mat_lsqr(const MatOperator* op, const float* b, float* x, const MatSolverOptions* options, float* workspace, MatSolverResult* result)
+{
+	return __lsqr(op, b, x, options, workspace, result, false);
+}
+
+UtilStatus mat_lsqr_parallel(const MatOperator* op, const float* b, float* x, const MatSolverOptions* options, float* workspace, MatSolverResult* result)
+{
+	return __lsqr(op, b, x, options, workspace, result, true);
+}
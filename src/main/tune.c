@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <string.h>
+#include "matrix.h"
+
+// benchmark the kernel parameters on this host and save them to a tuning profile
+// usage: tune [--strassen] [profile path]
+int main(int argc, char** argv)
+{
+	MatTuning tuning;
+	mat_tuning_defaults(&tuning);
+
+	const char* path = NULL;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--strassen") == 0)
+			tuning.strassen_cutoff = 1; // any non-zero value opts in
+		else
+			path = argv[i];
+	}
+
+	printf("Tuning, this takes a few seconds...\n");
+	if (mat_autotune(&tuning) != UTIL_OK)
+	{
+		printf("Couldn't allocate the benchmark matrices.\n");
+		return 1;
+	}
+
+	printf("gemm_block_rows %zu\n", tuning.gemm_block_rows);
+	printf("gemm_block_columns %zu\n", tuning.gemm_block_columns);
+	printf("gemm_block_k %zu\n", tuning.gemm_block_k);
+	printf("transpose_block %zu\n", tuning.transpose_block);
+	printf("strassen_cutoff %zu\n", tuning.strassen_cutoff);
+	printf("parallel_threshold %zu\n", tuning.parallel_threshold);
+
+	if (!mat_tuning_save(path, &tuning))
+	{
+		printf("Couldn't write the tuning profile.\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,150 @@
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "instrument.h"
+
+#define INSTR_NAME_ENTRY(id, name) name,
+static const char* op_names[INSTR_OP_COUNT] = { INSTR_OPS(INSTR_NAME_ENTRY) };
+#undef INSTR_NAME_ENTRY
+
+// every thread that records anything gets its own block of counters, which is pushed onto a global
+// list once and never removed (so counts from threads that have exited are kept). only the owning thread
+// writes to a block, the snapshot just reads all of them.
+typedef struct ThreadCounters
+{
+	InstrStats ops[INSTR_OP_COUNT];
+	struct ThreadCounters* next;
+} ThreadCounters;
+
+static ThreadCounters* all_counters = NULL;
+
+const char* util_instr_name(const InstrOp op)
+{
+	return op < INSTR_OP_COUNT ? op_names[op] : "unknown";
+}
+
+void util_instr_snapshot(InstrSnapshot* snapshot)
+{
+	memset(snapshot, 0, sizeof(InstrSnapshot));
+
+	for (ThreadCounters* counters = __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE); counters; counters = counters->next)
+	{
+		for (size_t i = 0; i < INSTR_OP_COUNT; ++i)
+		{
+			const InstrStats* stats = &counters->ops[i];
+			snapshot->ops[i].calls += __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+			snapshot->ops[i].nanoseconds += __atomic_load_n(&stats->nanoseconds, __ATOMIC_RELAXED);
+			snapshot->ops[i].bytes_allocated += __atomic_load_n(&stats->bytes_allocated, __ATOMIC_RELAXED);
+			snapshot->ops[i].bytes_moved += __atomic_load_n(&stats->bytes_moved, __ATOMIC_RELAXED);
+			snapshot->ops[i].flops += __atomic_load_n(&stats->flops, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void util_instr_reset(void)
+{
+	for (ThreadCounters* counters = __atomic_load_n(&all_counters, __ATOMIC_ACQUIRE); counters; counters = counters->next)
+	{
+		for (size_t i = 0; i < INSTR_OP_COUNT; ++i)
+		{
+			InstrStats* stats = &counters->ops[i];
+			__atomic_store_n(&stats->calls, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->nanoseconds, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->bytes_allocated, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->bytes_moved, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->flops, 0, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void util_instr_dump_json(FILE* f, const InstrSnapshot* snapshot)
+{
+	bool first = true;
+	fprintf(f, "{");
+	for (size_t i = 0; i < INSTR_OP_COUNT; ++i)
+	{
+		const InstrStats* stats = &snapshot->ops[i];
+		if (stats->calls == 0)
+			continue;
+
+		fprintf(f, "%s\n\t\"%s\": {\"calls\": %llu, \"nanoseconds\": %llu, \"bytes_allocated\": %llu, \"bytes_moved\": %llu, \"flops\": %llu}",
+			first ? "" : ",",
+			op_names[i],
+			(unsigned long long)stats->calls,
+			(unsigned long long)stats->nanoseconds,
+			(unsigned long long)stats->bytes_allocated,
+			(unsigned long long)stats->bytes_moved,
+			(unsigned long long)stats->flops);
+		first = false;
+	}
+	fprintf(f, "%s}\n", first ? "" : "\n");
+}
+
+#ifdef CMATRIX_INSTRUMENT
+
+static __thread ThreadCounters* local_counters = NULL;
+
+// instrumented calls currently running on this thread, only the outermost one records
+static __thread unsigned depth = 0;
+
+static ThreadCounters* __register_thread(void)
+{
+	ThreadCounters* counters = calloc(1, sizeof(ThreadCounters));
+	if (!counters)
+		return NULL; // can't record, but instrumentation must never take the application down
+
+	// lock-free push onto the global list
+	ThreadCounters* head = __atomic_load_n(&all_counters, __ATOMIC_RELAXED);
+	do
+		counters->next = head;
+	while (!__atomic_compare_exchange_n(&all_counters, &head, counters, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return counters;
+}
+
+static uint64_t __now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void __add(uint64_t* counter, const uint64_t value)
+{
+	// single writer, so a relaxed load + store is enough (and avoids a locked instruction)
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+InstrScope util_instr_begin(const InstrOp op)
+{
+	// INSTR_OP_COUNT (INSTR_NESTED) never records, it only keeps the calls below it from being outermost
+	InstrScope scope = { op, 0, 0, 0, 0, depth++ == 0 && op < INSTR_OP_COUNT };
+	if (scope.outermost)
+		scope.start = __now();
+
+	return scope;
+}
+
+void util_instr_end(InstrScope* scope)
+{
+	depth--;
+	if (!scope->outermost)
+		return;
+
+	const uint64_t end = __now();
+
+	if (!local_counters)
+		local_counters = __register_thread();
+	if (!local_counters)
+		return;
+
+	InstrStats* stats = &local_counters->ops[scope->op];
+	__add(&stats->calls, 1);
+	__add(&stats->nanoseconds, end - scope->start);
+	__add(&stats->bytes_allocated, scope->bytes_allocated);
+	__add(&stats->bytes_moved, scope->bytes_moved);
+	__add(&stats->flops, scope->flops);
+}
+
+#endif
@@ -1,12 +1,226 @@
+#include <stdbool.h>
+#include <string.h>
 #include "util.h"
 
-void util_error(const char* msg)
+static void __default_handler(const UtilStatus status, const char* msg, void* argv)
 {
+	(void)status;
+	(void)argv;
 	printf("%s\n", msg);
 	exit(-1);
 }
 
+// handler and argv are swapped together so a thread raising an error never sees a mismatched pair
+typedef struct ErrorHandler
+{
+	UtilErrorHandler handler;
+	void* argv;
+} ErrorHandler;
+
+static const ErrorHandler default_error_handler = { __default_handler, NULL };
+static const ErrorHandler* error_handler = &default_error_handler;
+
+static __thread UtilStatus last_status = UTIL_OK;
+static __thread const char* last_message = "";
+
+void util_set_error_handler(UtilErrorHandler handler, void* argv)
+{
+	const ErrorHandler* replacement = &default_error_handler;
+	if (handler)
+	{
+		// NOTE: replaced handlers are never free'd, another thread may still be calling them. this is meant to be called a handful of times at most.
+		ErrorHandler* alloc = malloc(sizeof(ErrorHandler));
+		if (!alloc)
+		{
+			util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for error handler.");
+			return;
+		}
+		alloc->handler = handler;
+		alloc->argv = argv;
+		replacement = alloc;
+	}
+
+	__atomic_store_n(&error_handler, replacement, __ATOMIC_RELEASE);
+}
+
+void util_error_return(const UtilStatus status, const char* msg, void* argv)
+{
+	(void)status;
+	(void)msg;
+	(void)argv;
+}
+
+UtilStatus util_raise(const UtilStatus status, const char* msg)
+{
+	last_status = status;
+	last_message = msg;
+	const ErrorHandler* current = __atomic_load_n(&error_handler, __ATOMIC_ACQUIRE);
+	current->handler(status, msg, current->argv);
+	return status;
+}
+
+UtilStatus util_last_error(void)
+{
+	return last_status;
+}
+
+const char* util_last_error_message(void)
+{
+	return last_message;
+}
+
+void util_clear_error(void)
+{
+	last_status = UTIL_OK;
+	last_message = "";
+}
+
+void util_error(const char* msg)
+{
+	util_raise(UTIL_ERROR_ARGUMENT, msg);
+}
+
+// splitmix64 step, used to spread seeds over the whole state (xorshift must never start at 0)
+static uint64_t __mix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	x ^= x >> 31;
+	return x ? x : 0x9E3779B97F4A7C15ull;
+}
+
+void util_rng_seed(UtilRng* rng, const uint64_t seed)
+{
+	rng->state = __mix(seed);
+}
+
+uint64_t util_rng_next(UtilRng* rng)
+{
+	uint64_t x = rng->state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	rng->state = x;
+	return x * 0x2545F4914F6CDD1Dull;
+}
+
+float util_rand_between_r(UtilRng* rng, const float lower_bound, const float upper_bound)
+{
+	// top 24 bits give every float in [0, 1) the same chance
+	const float unit = (float)(util_rng_next(rng) >> 40) / (float)(1ull << 24);
+	return lower_bound + unit * (upper_bound - lower_bound);
+}
+
 float util_rand_between(const float lower_bound, const float upper_bound)
 {
-	return lower_bound + ((float)rand() / (float)RAND_MAX) * (upper_bound - lower_bound);
-}
\ No newline at end of file
+	return util_rand_between_r(&util_get_context()->rng, lower_bound, upper_bound);
+}
+
+static void* __default_alloc(size_t size, void* argv)
+{
+	(void)argv;
+	return malloc(size);
+}
+
+static void* __default_realloc(void* ptr, size_t size, void* argv)
+{
+	(void)argv;
+	return realloc(ptr, size);
+}
+
+static void __default_dealloc(void* ptr, void* argv)
+{
+	(void)argv;
+	free(ptr);
+}
+
+// distinguishes contexts initialized within the same clock tick
+static uint64_t context_counter = 0;
+
+void util_context_init(UtilContext* ctx)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	const uint64_t count = __atomic_add_fetch(&context_counter, 1, __ATOMIC_RELAXED);
+	util_rng_seed(&ctx->rng, ((uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec) ^ __mix(count));
+
+	ctx->n_threads = 0;
+	ctx->alloc = __default_alloc;
+	ctx->realloc = __default_realloc;
+	ctx->dealloc = __default_dealloc;
+	ctx->alloc_argv = NULL;
+	ctx->tuning = NULL;
+}
+
+static __thread UtilContext default_context;
+static __thread bool default_context_ready = false;
+static __thread UtilContext* current_context = NULL;
+
+void util_set_context(UtilContext* ctx)
+{
+	current_context = ctx;
+}
+
+UtilContext* util_get_context(void)
+{
+	if (current_context)
+		return current_context;
+
+	if (!default_context_ready)
+	{
+		util_context_init(&default_context);
+		default_context_ready = true;
+	}
+	return &default_context;
+}
+
+static __thread bool pool_worker = false;
+
+void util_set_pool_worker(const bool worker)
+{
+	pool_worker = worker;
+}
+
+bool util_is_pool_worker(void)
+{
+	return pool_worker;
+}
+
+void* util_malloc(const size_t size)
+{
+	UtilContext* ctx = util_get_context();
+	return ctx->alloc(size, ctx->alloc_argv);
+}
+
+void* util_calloc(const size_t n_elem, const size_t size)
+{
+	// the C allocator hands out fresh pages already zeroed (and untouched), only a custom one needs the memset
+	UtilContext* ctx = util_get_context();
+	if (ctx->alloc == __default_alloc)
+		return calloc(n_elem, size);
+
+	// guard the multiplication like calloc does
+	if (size != 0 && n_elem > SIZE_MAX / size)
+		return NULL;
+
+	void* ptr = ctx->alloc(n_elem * size, ctx->alloc_argv);
+	if (ptr)
+		memset(ptr, 0, n_elem * size);
+	return ptr;
+}
+
+void* util_realloc(void* ptr, const size_t size)
+{
+	UtilContext* ctx = util_get_context();
+	return ctx->realloc(ptr, size, ctx->alloc_argv);
+}
+
+void util_free(void* ptr)
+{
+	if (!ptr)
+		return;
+
+	UtilContext* ctx = util_get_context();
+	ctx->dealloc(ptr, ctx->alloc_argv);
+}
@@ -1,38 +1,58 @@
+#include <math.h>
 #include "vector.h"
 #include "util.h"
+#include "instrument.h"
 
-void vec_init(Vector** vec, const size_t n_elem)
+UtilStatus vec_init(Vector** vec, const size_t n_elem)
 {
-	void* v_alloc = malloc(sizeof(Vector));
+	INSTR_BEGIN(VEC_INIT);
+	*vec = NULL;
+
+	void* v_alloc = util_malloc(sizeof(Vector));
 	if (!v_alloc)
-		util_error("Couldn't allocate memory for vector.");
-	*vec = v_alloc;
-	(*vec)->n_elem = n_elem;
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for vector.");
 
-	void* d_alloc = calloc(n_elem, sizeof(float));
+	void* d_alloc = util_calloc(n_elem, sizeof(float));
 	if (!d_alloc)
-		util_error("Couldn't allocate memory for vector data.");
+	{
+		util_free(v_alloc);
+		return util_raise(UTIL_ERROR_ALLOCATION, "Couldn't allocate memory for vector data.");
+	}
+
+	*vec = v_alloc;
+	(*vec)->n_elem = n_elem;
 	(*vec)->data = d_alloc;
+	INSTR_END(sizeof(Vector) + n_elem * sizeof(float), 0, 0);
+
+	return UTIL_OK;
 }
 
 Vector* vec_create(const float* data, const size_t n_elem)
 {
+	INSTR_BEGIN(VEC_CREATE);
 	Vector* vec = NULL;
-	vec_init(&vec, n_elem);
+	if (vec_init(&vec, n_elem) != UTIL_OK)
+		return NULL;
 
 	for (size_t i = 0; i < n_elem; ++i)
 		vec->data[i] = data[i];
 
+	INSTR_END(sizeof(Vector) + n_elem * sizeof(float), 2 * n_elem * sizeof(float), 0);
+
 	return vec;
 }
 
 Vector* vec_copy(const Vector* vec)
 {
+	INSTR_BEGIN(VEC_COPY);
 	Vector* v_copy = NULL;
-	vec_init(&v_copy, vec->n_elem);
+	if (vec_init(&v_copy, vec->n_elem) != UTIL_OK)
+		return NULL;
 	for (size_t i = 0; i < vec->n_elem; ++i)
 		v_copy->data[i] = vec->data[i];
 
+	INSTR_END(sizeof(Vector) + vec->n_elem * sizeof(float), 2 * vec->n_elem * sizeof(float), 0);
+
 	return v_copy;
 }
 
@@ -49,102 +69,201 @@ void vec_set(Vector** vec, const size_t i, const float value)
 float vec_dot(const Vector* vec1, const Vector* vec2)
 {
 	if (vec1->n_elem != vec2->n_elem)
-		util_error("Vectors must be same size before taking dot product.");
+	{
+		INSTR_CALL(VEC_DOT);
+		util_raise(UTIL_ERROR_DIMENSION, "Vectors must be same size before taking dot product.");
+		return NAN;
+	}
 
+	return vec_dot_unchecked(vec1, vec2);
+}
+
+float vec_dot_unchecked(const Vector* vec1, const Vector* vec2)
+{
+	INSTR_BEGIN(VEC_DOT);
 	float result = 0.0f;
 	for (size_t i = 0; i < vec1->n_elem; ++i)
 		result += vec1->data[i] * vec2->data[i];
 
+	INSTR_END(0, 2 * vec1->n_elem * sizeof(float), 2 * vec1->n_elem);
+
 	return result;
 }
 
 void vec_random(Vector** vec, const float lower_bound, const float upper_bound)
 {
-	srand(time(NULL));
+	vec_random_r(vec, lower_bound, upper_bound, &util_get_context()->rng);
+}
 
+void vec_random_r(Vector** vec, const float lower_bound, const float upper_bound, UtilRng* rng)
+{
+	INSTR_BEGIN(VEC_RANDOM);
 	for (size_t i = 0; i < (*vec)->n_elem; ++i)
-		(*vec)->data[i] = util_rand_between(lower_bound, upper_bound);
+		(*vec)->data[i] = util_rand_between_r(rng, lower_bound, upper_bound);
+	INSTR_END(0, (*vec)->n_elem * sizeof(float), 0);
 }
 
 void vec_fill(Vector** vec, const float value)
 {
+	INSTR_BEGIN(VEC_FILL);
 	for (size_t i = 0; i < (*vec)->n_elem; ++i)
 		(*vec)->data[i] = value;
+	INSTR_END(0, (*vec)->n_elem * sizeof(float), 0);
 }
 
 void vec_apply(Vector** vec, float (*apply_func)(float x, float* argv), float* argv)
 {
+	INSTR_BEGIN(VEC_APPLY);
 	for (size_t i = 0; i < (*vec)->n_elem; ++i)
 		(*vec)->data[i] = apply_func((*vec)->data[i], argv);
+	INSTR_END(0, 2 * (*vec)->n_elem * sizeof(float), (*vec)->n_elem);
 }
 
 void vec_add_s(Vector** vec, const float value)
 {
+	INSTR_BEGIN(VEC_ADD_S);
 	for (size_t i = 0; i < (*vec)->n_elem; ++i)
 		(*vec)->data[i] += value;
+	INSTR_END(0, 2 * (*vec)->n_elem * sizeof(float), (*vec)->n_elem);
 }
 
 void vec_subtract_s(Vector** vec, const float value)
 {
+	INSTR_BEGIN(VEC_SUBTRACT_S);
 	for (size_t i = 0; i < (*vec)->n_elem; ++i)
 		(*vec)->data[i] -= value;
+	INSTR_END(0, 2 * (*vec)->n_elem * sizeof(float), (*vec)->n_elem);
 }
 
 void vec_multiply_s(Vector** vec, const float value)
 {
+	INSTR_BEGIN(VEC_MULTIPLY_S);
 	for (size_t i = 0; i < (*vec)->n_elem; ++i)
 		(*vec)->data[i] *= value;
+	INSTR_END(0, 2 * (*vec)->n_elem * sizeof(float), (*vec)->n_elem);
 }
 
 void vec_divide_s(Vector** vec, const float value)
 {
+	INSTR_BEGIN(VEC_DIVIDE_S);
 	for (size_t i = 0; i < (*vec)->n_elem; ++i)
 		(*vec)->data[i] /= value;
+	INSTR_END(0, 2 * (*vec)->n_elem * sizeof(float), (*vec)->n_elem);
+}
+
+UtilStatus vec_add_e(Vector** target, const Vector* vec)
+{
+	if ((*target)->n_elem != vec->n_elem)
+	{
+		INSTR_CALL(VEC_ADD_E);
+		return util_raise(UTIL_ERROR_DIMENSION, "Vectors must be same size when trying to perform element-wise operations.");
+	}
+
+	vec_add_e_unchecked(target, vec);
+
+	return UTIL_OK;
 }
 
-void vec_add_e(Vector** target, const Vector* vec)
+void vec_add_e_unchecked(Vector** target, const Vector* vec)
 {
+	INSTR_BEGIN(VEC_ADD_E);
 	for (size_t i = 0; i < (*target)->n_elem; ++i)
 		(*target)->data[i] += vec->data[i];
+	INSTR_END(0, 3 * (*target)->n_elem * sizeof(float), (*target)->n_elem);
+}
+
+UtilStatus vec_subtract_e(Vector** target, const Vector* vec)
+{
+	if ((*target)->n_elem != vec->n_elem)
+	{
+		INSTR_CALL(VEC_SUBTRACT_E);
+		return util_raise(UTIL_ERROR_DIMENSION, "Vectors must be same size when trying to perform element-wise operations.");
+	}
+
+	vec_subtract_e_unchecked(target, vec);
+
+	return UTIL_OK;
 }
 
-void vec_subtract_e(Vector** target, const Vector* vec)
+void vec_subtract_e_unchecked(Vector** target, const Vector* vec)
 {
+	INSTR_BEGIN(VEC_SUBTRACT_E);
 	for (size_t i = 0; i < (*target)->n_elem; ++i)
 		(*target)->data[i] -= vec->data[i];
+	INSTR_END(0, 3 * (*target)->n_elem * sizeof(float), (*target)->n_elem);
+}
+
+UtilStatus vec_multiply_e(Vector** target, const Vector* vec)
+{
+	if ((*target)->n_elem != vec->n_elem)
+	{
+		INSTR_CALL(VEC_MULTIPLY_E);
+		return util_raise(UTIL_ERROR_DIMENSION, "Vectors must be same size when trying to perform element-wise operations.");
+	}
+
+	vec_multiply_e_unchecked(target, vec);
+
+	return UTIL_OK;
 }
 
-void vec_multiply_e(Vector** target, const Vector* vec)
+void vec_multiply_e_unchecked(Vector** target, const Vector* vec)
 {
+	INSTR_BEGIN(VEC_MULTIPLY_E);
 	for (size_t i = 0; i < (*target)->n_elem; ++i)
 		(*target)->data[i] *= vec->data[i];
+	INSTR_END(0, 3 * (*target)->n_elem * sizeof(float), (*target)->n_elem);
+}
+
+UtilStatus vec_divide_e(Vector** target, const Vector* vec)
+{
+	if ((*target)->n_elem != vec->n_elem)
+	{
+		INSTR_CALL(VEC_DIVIDE_E);
+		return util_raise(UTIL_ERROR_DIMENSION, "Vectors must be same size when trying to perform element-wise operations.");
+	}
+
+	vec_divide_e_unchecked(target, vec);
+
+	return UTIL_OK;
 }
 
-void vec_divide_e(Vector** target, const Vector* vec)
+void vec_divide_e_unchecked(Vector** target, const Vector* vec)
 {
+	INSTR_BEGIN(VEC_DIVIDE_E);
 	for (size_t i = 0; i < (*target)->n_elem; ++i)
 		(*target)->data[i] /= vec->data[i];
+	INSTR_END(0, 3 * (*target)->n_elem * sizeof(float), (*target)->n_elem);
 }
 
 float vec_sum(const Vector* vec)
 {
+	INSTR_BEGIN(VEC_SUM);
 	float result = 0.0f;
 	for (size_t i = 0; i < vec->n_elem; ++i)
 		result += vec->data[i];
 	
+	INSTR_END(0, vec->n_elem * sizeof(float), vec->n_elem);
+
 	return result;
 }
 
 float vec_mean(const Vector* vec)
 {
-	return vec_sum(vec) / (float)vec->n_elem;
+	INSTR_BEGIN(VEC_MEAN);
+	float result = vec_sum(vec) / (float)vec->n_elem;
+
+	INSTR_END(0, vec->n_elem * sizeof(float), vec->n_elem);
+
+	return result;
 }
 
 void vec_free(Vector** vec)
 {
-	free((*vec)->data);
+	INSTR_BEGIN(VEC_FREE);
+	util_free((*vec)->data);
 	(*vec)->data = NULL;
 
-	free(*vec);
+	util_free(*vec);
 	*vec = NULL;
+	INSTR_END(0, 0, 0);
 }
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+// abort the test with the location of the first failed check
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			exit(1); \
+		} \
+	} while (0)
+
+// max |x - y| over n elements, relative to the largest |y|
+static inline float test_relative_error(const float* x, const float* y, const size_t n)
+{
+	float max_diff = 0.0f;
+	float max_ref = 0.0f;
+	for (size_t i = 0; i < n; ++i)
+	{
+		const float diff = fabsf(x[i] - y[i]);
+		if (isnan(diff))
+			return INFINITY;
+		if (diff > max_diff)
+			max_diff = diff;
+		if (fabsf(y[i]) > max_ref)
+			max_ref = fabsf(y[i]);
+	}
+	return max_ref > 0.0f ? max_diff / max_ref : max_diff;
+}
+
+// c = a x b with the textbook triple loop (accumulating in double), as a reference for the kernels
+static inline void test_reference_multiply(const float* a, const float* b, float* c, const size_t m, const size_t n, const size_t k)
+{
+	for (size_t r = 0; r < m; ++r)
+		for (size_t j = 0; j < n; ++j)
+		{
+			double sum = 0.0;
+			for (size_t i = 0; i < k; ++i)
+				sum += (double)a[r * k + i] * b[i * n + j];
+			c[r * n + j] = (float)sum;
+		}
+}
+
+#endif
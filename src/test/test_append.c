@@ -0,0 +1,61 @@
+#include "matrix.h"
+#include "util.h"
+#include "test.h"
+
+// growing a matrix row by row: contents, capacity bookkeeping, shrinking, and sizes that can't be addressed.
+// also stacking plain and const Matrix* arrays, neither of which may need a cast
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	Matrix* mat = NULL;
+	CHECK(mat_init(&mat, 0, 3) == UTIL_OK);
+
+	// append 1000 rows one at a time, then check every element landed where it should
+	float row[3];
+	for (size_t r = 0; r < 1000; ++r)
+	{
+		for (size_t c = 0; c < 3; ++c)
+			row[c] = (float)(r * 3 + c);
+		CHECK(mat_append_rows(&mat, row, 1) == UTIL_OK);
+		CHECK(mat->capacity >= mat->n_rows * mat->n_columns);
+	}
+	CHECK(mat->n_rows == 1000);
+	for (size_t i = 0; i < 3000; ++i)
+		CHECK(mat->data[i] == (float)i);
+
+	CHECK(mat_shrink_to_fit(&mat) == UTIL_OK);
+	CHECK(mat->capacity == 3000);
+
+	CHECK(mat_reserve_rows(&mat, 2000) == UTIL_OK);
+	CHECK(mat->capacity == 6000 && mat->n_rows == 1000);
+	CHECK(mat->data[2999] == 2999.0f);
+
+	// more rows than can be addressed: rejected and the matrix is left alone
+	CHECK(mat_reserve_rows(&mat, SIZE_MAX / 2) == UTIL_ERROR_ARGUMENT);
+	CHECK(mat_append_rows(&mat, row, SIZE_MAX / 4) == UTIL_ERROR_ARGUMENT);
+	CHECK(mat_append_rows(&mat, row, SIZE_MAX / (3 * sizeof(float)) - 999) == UTIL_ERROR_ARGUMENT);
+	CHECK(mat->n_rows == 1000 && mat->capacity == 6000);
+
+	// an emptied matrix gives its buffer back on shrink and can be appended to again
+	mat->n_rows = 0;
+	CHECK(mat_shrink_to_fit(&mat) == UTIL_OK);
+	CHECK(mat->data == NULL && mat->capacity == 0);
+	CHECK(mat_append_rows(&mat, row, 1) == UTIL_OK);
+	CHECK(mat->n_rows == 1 && mat->data[2] == row[2]);
+
+	// stacking [1 2 3] with itself both ways
+	Matrix* parts[] = { mat, mat };
+	Matrix* wide = mat_hstack(parts, 2);
+	const Matrix* const_parts[] = { mat, mat };
+	Matrix* tall = mat_vstack(const_parts, 2);
+	CHECK(wide && wide->n_rows == 1 && wide->n_columns == 6 && wide->data[5] == row[2]);
+	CHECK(tall && tall->n_rows == 2 && tall->n_columns == 3 && tall->data[5] == row[2]);
+	mat_free(&wide);
+	mat_free(&tall);
+
+	mat_free(&mat);
+
+	return 0;
+}
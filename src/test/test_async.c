@@ -0,0 +1,148 @@
+#include <pthread.h>
+#include "async.h"
+#include "util.h"
+#include "test.h"
+
+// tasks must run under the submitter's context, and a pool hammered with tiny tasks (with dependencies) from
+// several threads at once must run every one of them exactly once and still shut down cleanly
+
+#define N_SUBMITTERS 4
+#define N_TASKS 2000
+
+typedef struct CountingAllocator
+{
+	size_t n_allocs;
+} CountingAllocator;
+
+static void* __counting_alloc(size_t size, void* argv)
+{
+	__atomic_add_fetch(&((CountingAllocator*)argv)->n_allocs, 1, __ATOMIC_RELAXED);
+	return malloc(size);
+}
+
+static void* __counting_realloc(void* ptr, size_t size, void* argv)
+{
+	(void)argv;
+	return realloc(ptr, size);
+}
+
+static void __counting_dealloc(void* ptr, void* argv)
+{
+	(void)argv;
+	free(ptr);
+}
+
+typedef struct ContextProbe
+{
+	void* alloc_argv;
+	size_t n_threads;
+	uint64_t draw;
+} ContextProbe;
+
+static void __probe(void* argv)
+{
+	ContextProbe* probe = argv;
+	UtilContext* ctx = util_get_context();
+	probe->alloc_argv = ctx->alloc_argv;
+	probe->n_threads = ctx->n_threads;
+	probe->draw = util_rng_next(&ctx->rng);
+
+	// goes through the submitter's allocator
+	util_free(util_malloc(16));
+}
+
+static void __check_context(void)
+{
+	CountingAllocator counter = { 0 };
+	UtilContext ctx;
+	util_context_init(&ctx);
+	ctx.alloc = __counting_alloc;
+	ctx.realloc = __counting_realloc;
+	ctx.dealloc = __counting_dealloc;
+	ctx.alloc_argv = &counter;
+	ctx.n_threads = 3;
+
+	uint64_t draws[2][2];
+	for (size_t run = 0; run < 2; ++run)
+	{
+		util_rng_seed(&ctx.rng, 26);
+		util_set_context(&ctx);
+
+		ContextProbe probes[2];
+		MatTask* first = mat_async_submit(__probe, &probes[0], NULL, 0);
+		MatTask* second = mat_async_submit(__probe, &probes[1], &first, 1);
+		CHECK(first && second);
+		mat_task_free(&second);
+		mat_task_free(&first);
+
+		util_set_context(NULL);
+
+		for (size_t i = 0; i < 2; ++i)
+		{
+			CHECK(probes[i].alloc_argv == &counter);
+			CHECK(probes[i].n_threads == 3);
+			draws[run][i] = probes[i].draw;
+		}
+	}
+
+	CHECK(counter.n_allocs == 4);
+	// every task gets its own sequence, and the same seed gives the same ones again
+	CHECK(draws[0][0] != draws[0][1]);
+	CHECK(draws[0][0] == draws[1][0] && draws[0][1] == draws[1][1]);
+}
+
+static void __increment(void* argv)
+{
+	__atomic_add_fetch((size_t*)argv, 1, __ATOMIC_RELAXED);
+}
+
+static size_t n_runs = 0;
+
+static void* __submitter(void* argv)
+{
+	(void)argv;
+	MatTask** tasks = malloc(N_TASKS * sizeof(MatTask*));
+	CHECK(tasks);
+
+	// every task depends on the one before the previous, so there are always chains being released from inside workers
+	for (size_t i = 0; i < N_TASKS; ++i)
+	{
+		MatTask** deps = i >= 2 ? &tasks[i - 2] : NULL;
+		tasks[i] = mat_async_submit(__increment, &n_runs, deps, i >= 2 ? 1 : 0);
+		CHECK(tasks[i]);
+	}
+
+	for (size_t i = 0; i < N_TASKS; ++i)
+		mat_task_free(&tasks[i]);
+	free(tasks);
+
+	return NULL;
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+	CHECK(mat_async_init(4) == UTIL_OK);
+
+	__check_context();
+
+	pthread_t submitters[N_SUBMITTERS];
+	for (size_t i = 0; i < N_SUBMITTERS; ++i)
+		CHECK(pthread_create(&submitters[i], NULL, __submitter, NULL) == 0);
+	for (size_t i = 0; i < N_SUBMITTERS; ++i)
+		CHECK(pthread_join(submitters[i], NULL) == 0);
+
+	CHECK(__atomic_load_n(&n_runs, __ATOMIC_RELAXED) == N_SUBMITTERS * N_TASKS);
+	mat_async_free();
+
+	// the pool can be started again after a shutdown
+	size_t after_restart = 0;
+	MatTask* task = mat_async_submit(__increment, &after_restart, NULL, 0);
+	CHECK(task);
+	CHECK(mat_task_status(task) == UTIL_OK);
+	mat_task_free(&task);
+	CHECK(after_restart == 1);
+	mat_async_free();
+
+	return 0;
+}
@@ -0,0 +1,136 @@
+#include <string.h>
+#include "matrix.h"
+#include "vector.h"
+#include "util.h"
+#include "test.h"
+
+// both convolution paths, serial and parallel, against a naive loop over the output. the workspaces are allocated at
+// exactly mat_conv2d_(parallel_)workspace_size floats, so a thread writing outside its slice shows up under a sanitizer.
+// also the shape checks of mat_conv2d_output_size
+
+static float __relu(float x, float* argv)
+{
+	(void)argv;
+	return x > 0.0f ? x : 0.0f;
+}
+
+static void __reference(const Matrix* input, const Matrix* filters, const MatConv2d* params, const Vector* bias, float* out)
+{
+	size_t out_height, out_width;
+	CHECK(mat_conv2d_output_size(params, &out_height, &out_width) == UTIL_OK);
+	const size_t channels = input->n_columns;
+	const size_t n_filters = filters->n_columns;
+
+	for (size_t oy = 0; oy < out_height; ++oy)
+		for (size_t ox = 0; ox < out_width; ++ox)
+			for (size_t f = 0; f < n_filters; ++f)
+			{
+				double sum = bias->data[f];
+				for (size_t ky = 0; ky < params->kernel_height; ++ky)
+					for (size_t kx = 0; kx < params->kernel_width; ++kx)
+					{
+						const long y = (long)(oy * params->stride + ky) - (long)params->padding;
+						const long x = (long)(ox * params->stride + kx) - (long)params->padding;
+						if (y < 0 || x < 0 || y >= (long)params->height || x >= (long)params->width)
+							continue;
+						for (size_t ch = 0; ch < channels; ++ch)
+							sum += (double)input->data[((size_t)y * params->width + (size_t)x) * channels + ch]
+								* filters->data[((ky * params->kernel_width + kx) * channels + ch) * n_filters + f];
+					}
+				out[(oy * out_width + ox) * n_filters + f] = __relu((float)sum, NULL);
+			}
+}
+
+static void __check(const MatConv2d* params, const size_t channels, const size_t n_filters, UtilRng* rng)
+{
+	size_t out_height, out_width;
+	CHECK(mat_conv2d_output_size(params, &out_height, &out_width) == UTIL_OK);
+
+	Matrix* input = NULL;
+	Matrix* filters = NULL;
+	Matrix* target = NULL;
+	Vector* bias = NULL;
+	CHECK(mat_init(&input, params->height * params->width, channels) == UTIL_OK);
+	CHECK(mat_init(&filters, params->kernel_height * params->kernel_width * channels, n_filters) == UTIL_OK);
+	CHECK(mat_init(&target, out_height * out_width, n_filters) == UTIL_OK);
+	CHECK(vec_init(&bias, n_filters) == UTIL_OK);
+	mat_random_r(&input, -1.0f, 1.0f, rng);
+	mat_random_r(&filters, -1.0f, 1.0f, rng);
+	vec_random_r(&bias, -1.0f, 1.0f, rng);
+
+	float* expected = malloc(out_height * out_width * n_filters * sizeof(float));
+	CHECK(expected);
+	__reference(input, filters, params, bias, expected);
+
+	MatEpilogue epilogue = MAT_EPILOGUE_INIT;
+	epilogue.bias = bias;
+	epilogue.activation = __relu;
+
+	for (int parallel = 0; parallel < 2; ++parallel)
+	{
+		const size_t size = (parallel ? mat_conv2d_parallel_workspace_size : mat_conv2d_workspace_size)(params, channels);
+		float* workspace = size > 0 ? malloc(size * sizeof(float)) : NULL;
+		CHECK(size == 0 || workspace);
+
+		mat_fill(&target, NAN);
+		CHECK((parallel ? mat_conv2d_parallel : mat_conv2d)(input, filters, params, workspace, &target, &epilogue) == UTIL_OK);
+		CHECK(test_relative_error(target->data, expected, out_height * out_width * n_filters) < 1e-5f);
+		free(workspace);
+	}
+
+	free(expected);
+	vec_free(&bias);
+	mat_free(&target);
+	mat_free(&filters);
+	mat_free(&input);
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	UtilContext ctx;
+	util_context_init(&ctx);
+	util_rng_seed(&ctx.rng, 37);
+	ctx.n_threads = 4;
+	util_set_context(&ctx);
+
+	// no parallel threshold, so the parallel variant really splits these between threads
+	MatTuning tuning;
+	mat_get_tuning(&tuning);
+	tuning.parallel_threshold = 1;
+	ctx.tuning = &tuning;
+
+	const MatConv2d shapes[] = {
+		{ 20, 24, 3, 3, 1, 1, MAT_CONV_AUTO }, // direct
+		{ 20, 24, 3, 3, 1, 1, MAT_CONV_IM2COL },
+		{ 33, 17, 5, 5, 2, 2, MAT_CONV_AUTO }, // im2col, stride and padding
+		{ 40, 300, 3, 2, 1, 0, MAT_CONV_AUTO }, // wide: one output row per band
+		{ 6, 6, 6, 6, 1, 0, MAT_CONV_IM2COL } // a single output pixel
+	};
+	for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i)
+		__check(&shapes[i], 3, 8, &ctx.rng);
+
+	// the workspace covers one band (per thread for the parallel variant), not the whole lowered image
+	const MatConv2d big = { 256, 256, 5, 5, 1, 2, MAT_CONV_IM2COL };
+	CHECK(mat_conv2d_parallel_workspace_size(&big, 3) < 256 * 256 * 5 * 5 * 3);
+#ifdef _OPENMP
+	CHECK(mat_conv2d_parallel_workspace_size(&big, 3) == 4 * mat_conv2d_workspace_size(&big, 3));
+#else
+	CHECK(mat_conv2d_parallel_workspace_size(&big, 3) == mat_conv2d_workspace_size(&big, 3));
+#endif
+	CHECK(mat_conv2d_workspace_size(&shapes[0], 3) == 0);
+
+	// shapes without a defined output size are rejected instead of dividing by zero or wrapping around
+	size_t out_height = 7, out_width = 7;
+	const MatConv2d no_stride = { 20, 20, 3, 3, 0, 1, MAT_CONV_IM2COL };
+	const MatConv2d too_big = { 4, 20, 7, 3, 1, 1, MAT_CONV_IM2COL };
+	CHECK(mat_conv2d_output_size(&no_stride, &out_height, &out_width) == UTIL_ERROR_ARGUMENT);
+	CHECK(mat_conv2d_output_size(&too_big, &out_height, &out_width) == UTIL_ERROR_DIMENSION);
+	CHECK(out_height == 7 && out_width == 7);
+	CHECK(mat_conv2d_workspace_size(&no_stride, 3) == 0 && mat_conv2d_parallel_workspace_size(&too_big, 3) == 0);
+
+	util_set_context(NULL);
+
+	return 0;
+}
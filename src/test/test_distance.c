@@ -0,0 +1,124 @@
+#include <string.h>
+#include "matrix.h"
+#include "util.h"
+#include "test.h"
+
+// mat_pairwise_distances and mat_knn against brute force in double, for every metric, over shapes that span several
+// tiles in both directions (plus an all-zero row for the cosine metric)
+
+static double __distance(const float* x, const float* y, const size_t n, const MatMetric metric)
+{
+	double dot = 0.0, xx = 0.0, yy = 0.0, squared = 0.0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		dot += (double)x[i] * y[i];
+		xx += (double)x[i] * x[i];
+		yy += (double)y[i] * y[i];
+		squared += ((double)x[i] - y[i]) * ((double)x[i] - y[i]);
+	}
+
+	if (metric == MAT_METRIC_COSINE)
+		return xx > 0.0 && yy > 0.0 ? 1.0 - dot / sqrt(xx * yy) : 1.0;
+	return metric == MAT_METRIC_EUCLIDEAN ? sqrt(squared) : squared;
+}
+
+// the kernel expands ||a - b||^2 = ||a||^2 + ||b||^2 - 2 a.b in float, so compare squared distances with an absolute
+// tolerance relative to the norms involved
+static bool __close(const double x, const double y, const MatMetric metric)
+{
+	if (metric == MAT_METRIC_EUCLIDEAN)
+		return fabs(x * x - y * y) <= 1e-4 * (1.0 + y * y);
+	return fabs(x - y) <= 1e-4 * (1.0 + fabs(y));
+}
+
+static int __compare(const void* x, const void* y)
+{
+	const double a = *(const double*)x, b = *(const double*)y;
+	return a < b ? -1 : a > b;
+}
+
+static void __check(const Matrix* a, const Matrix* b, const MatMetric metric, const size_t k)
+{
+	const size_t n = a->n_columns;
+	double* reference = malloc(b->n_rows * sizeof(double));
+	double* sorted = malloc(b->n_rows * sizeof(double));
+	size_t* indices = malloc(a->n_rows * k * sizeof(size_t));
+	float* distances = malloc(a->n_rows * k * sizeof(float));
+	CHECK(reference && sorted && indices && distances);
+
+	Matrix* pairwise = mat_pairwise_distances(a, b, metric);
+	CHECK(pairwise && pairwise->n_rows == a->n_rows && pairwise->n_columns == b->n_rows);
+	CHECK(mat_knn(a, b, k, metric, indices, distances) == UTIL_OK);
+
+	for (size_t r = 0; r < a->n_rows; ++r)
+	{
+		for (size_t c = 0; c < b->n_rows; ++c)
+		{
+			reference[c] = __distance(&a->data[r * n], &b->data[c * n], n, metric);
+			CHECK(__close(pairwise->data[r * b->n_rows + c], reference[c], metric));
+		}
+		memcpy(sorted, reference, b->n_rows * sizeof(double));
+		qsort(sorted, b->n_rows, sizeof(double), __compare);
+
+		// the j-th neighbour is at the j-th smallest distance (ties may come in any order), and no row is returned twice
+		for (size_t j = 0; j < k; ++j)
+		{
+			const size_t index = indices[r * k + j];
+			CHECK(index < b->n_rows);
+			CHECK(__close(distances[r * k + j], sorted[j], metric));
+			CHECK(__close(distances[r * k + j], reference[index], metric));
+			for (size_t i = 0; i < j; ++i)
+				CHECK(indices[r * k + i] != index);
+		}
+	}
+
+	mat_free(&pairwise);
+	free(distances);
+	free(indices);
+	free(sorted);
+	free(reference);
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	UtilRng rng;
+	util_rng_seed(&rng, 35);
+
+	Matrix* a = NULL;
+	Matrix* b = NULL;
+	CHECK(mat_init(&a, 150, 16) == UTIL_OK);
+	CHECK(mat_init(&b, 2100, 16) == UTIL_OK);
+	mat_random_r(&a, -1.0f, 1.0f, &rng);
+	mat_random_r(&b, -1.0f, 1.0f, &rng);
+	memset(&a->data[7 * 16], 0, 16 * sizeof(float));
+	memset(&b->data[1500 * 16], 0, 16 * sizeof(float));
+
+	const MatMetric metrics[] = { MAT_METRIC_EUCLIDEAN, MAT_METRIC_SQUARED_EUCLIDEAN, MAT_METRIC_COSINE };
+	for (size_t m = 0; m < 3; ++m)
+	{
+		__check(a, b, metrics[m], 1);
+		__check(a, b, metrics[m], 10);
+	}
+
+	// k can be all of b
+	Matrix* few = mat_subset(b, 0, 4, 0, 15);
+	CHECK(few && few->n_rows == 5);
+	__check(a, few, MAT_METRIC_EUCLIDEAN, 5);
+
+	// bad arguments
+	size_t index;
+	CHECK(mat_knn(a, few, 6, MAT_METRIC_EUCLIDEAN, &index, NULL) == UTIL_ERROR_ARGUMENT);
+	CHECK(mat_knn(a, few, 0, MAT_METRIC_EUCLIDEAN, &index, NULL) == UTIL_ERROR_ARGUMENT);
+	Matrix* narrow = mat_subset(b, 0, 4, 0, 7);
+	CHECK(narrow);
+	CHECK(mat_pairwise_distances(a, narrow, MAT_METRIC_COSINE) == NULL && util_last_error() == UTIL_ERROR_DIMENSION);
+
+	mat_free(&narrow);
+	mat_free(&few);
+	mat_free(&b);
+	mat_free(&a);
+
+	return 0;
+}
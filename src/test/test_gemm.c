@@ -0,0 +1,192 @@
+#include <string.h>
+#include "matrix.h"
+#include "vector.h"
+#include "util.h"
+#include "test.h"
+
+// mat_gemm against the reference multiply: every transpose combination, alpha / beta, the epilogue (including a zero
+// scale and the tile callback's positions), empty shapes, and both the serial and parallel kernels over many tiles
+
+static float __relu(float x, float* argv)
+{
+	(void)argv;
+	return x > 0.0f ? x : 0.0f;
+}
+
+// records which elements the tile callback was given, each must be seen exactly once at its own position
+typedef struct Visits
+{
+	float* base;
+	size_t n_columns;
+	unsigned char* seen;
+} Visits;
+
+static void __visit(float* tile, const size_t row, const size_t column, const size_t n_rows, const size_t n_columns, const size_t ld, void* argv)
+{
+	Visits* visits = argv;
+	CHECK(ld == visits->n_columns);
+	CHECK(tile == &visits->base[row * ld + column]);
+	for (size_t r = 0; r < n_rows; ++r)
+		for (size_t c = 0; c < n_columns; ++c)
+		{
+			__atomic_add_fetch(&visits->seen[(row + r) * ld + column + c], 1, __ATOMIC_RELAXED);
+			tile[r * ld + c] -= 1.0f;
+		}
+}
+
+static Matrix* __random(const size_t n_rows, const size_t n_columns, UtilRng* rng)
+{
+	Matrix* mat = NULL;
+	CHECK(mat_init(&mat, n_rows, n_columns) == UTIL_OK);
+	mat_random_r(&mat, -1.0f, 1.0f, rng);
+	return mat;
+}
+
+static void __check_shape(const size_t m, const size_t n, const size_t k, const bool parallel, UtilRng* rng)
+{
+	for (int trans = 0; trans < 4; ++trans)
+	{
+		const bool trans1 = trans & 1, trans2 = trans & 2;
+		Matrix* a = __random(m, k, rng);
+		Matrix* b = __random(k, n, rng);
+		Matrix* a_stored = trans1 ? mat_transpose(a) : mat_copy(a);
+		Matrix* b_stored = trans2 ? mat_transpose(b) : mat_copy(b);
+		Matrix* c = __random(m, n, rng);
+		Vector* bias = NULL;
+		CHECK(vec_init(&bias, n) == UTIL_OK);
+		vec_random_r(&bias, -1.0f, 1.0f, rng);
+
+		float* expected = malloc((m * n + 1) * sizeof(float));
+		CHECK(expected);
+		test_reference_multiply(a->data, b->data, expected, m, n, k);
+
+		// plain: target = 0.5 * op(a) x op(b) + 2 * target
+		Matrix* target = mat_copy(c);
+		CHECK((parallel ? mat_gemm_parallel : mat_gemm)(trans1, trans2, 0.5f, a_stored, b_stored, 2.0f, &target, NULL) == UTIL_OK);
+		float* plain = malloc((m * n + 1) * sizeof(float));
+		CHECK(plain);
+		for (size_t i = 0; i < m * n; ++i)
+			plain[i] = 0.5f * expected[i] + 2.0f * c->data[i];
+		CHECK(test_relative_error(target->data, plain, m * n) < 1e-5f);
+
+		// beta = 0 ignores the target, even NaN
+		for (size_t i = 0; i < m * n; ++i)
+			target->data[i] = NAN;
+		CHECK((parallel ? mat_gemm_parallel : mat_gemm)(trans1, trans2, 1.0f, a_stored, b_stored, 0.0f, &target, NULL) == UTIL_OK);
+		CHECK(test_relative_error(target->data, expected, m * n) < 1e-5f);
+
+		// full epilogue: -3 * relu(product + bias), then the tile callback subtracts 1 from every element once
+		Visits visits = { target->data, n, calloc(m * n + 1, 1) };
+		CHECK(visits.seen);
+		MatEpilogue epilogue = MAT_EPILOGUE_INIT;
+		epilogue.bias = bias;
+		epilogue.activation = __relu;
+		epilogue.scale = -3.0f;
+		epilogue.tile = __visit;
+		epilogue.tile_argv = &visits;
+		CHECK((parallel ? mat_gemm_parallel : mat_gemm)(trans1, trans2, 1.0f, a_stored, b_stored, 0.0f, &target, &epilogue) == UTIL_OK);
+		for (size_t i = 0; i < m * n; ++i)
+		{
+			CHECK(visits.seen[i] == 1);
+			plain[i] = -3.0f * __relu(expected[i] + bias->data[i % n], NULL) - 1.0f;
+		}
+		CHECK(test_relative_error(target->data, plain, m * n) < 1e-5f);
+
+		// scaling by 0 is a scale like any other
+		MatEpilogue zero = MAT_EPILOGUE_INIT;
+		zero.scale = 0.0f;
+		CHECK((parallel ? mat_gemm_parallel : mat_gemm)(trans1, trans2, 1.0f, a_stored, b_stored, 0.0f, &target, &zero) == UTIL_OK);
+		for (size_t i = 0; i < m * n; ++i)
+			CHECK(target->data[i] == 0.0f);
+
+		free(visits.seen);
+		free(plain);
+		free(expected);
+		vec_free(&bias);
+		mat_free(&target);
+		mat_free(&c);
+		mat_free(&b_stored);
+		mat_free(&a_stored);
+		mat_free(&b);
+		mat_free(&a);
+	}
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	UtilContext ctx;
+	util_context_init(&ctx);
+	util_rng_seed(&ctx.rng, 28);
+	ctx.n_threads = 4;
+	util_set_context(&ctx);
+
+	// small blocks and no parallel threshold, so even these shapes span many tiles and threads
+	MatTuning tuning;
+	mat_get_tuning(&tuning);
+	tuning.gemm_block_rows = 16;
+	tuning.gemm_block_columns = 24;
+	tuning.gemm_block_k = 8;
+	tuning.parallel_threshold = 1;
+	ctx.tuning = &tuning;
+
+	const size_t shapes[][3] = { { 37, 53, 29 }, { 100, 70, 130 }, { 1, 1, 1 }, { 1, 90, 3 }, { 90, 1, 3 }, { 5, 7, 1 } };
+	for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i)
+	{
+		__check_shape(shapes[i][0], shapes[i][1], shapes[i][2], false, &ctx.rng);
+		__check_shape(shapes[i][0], shapes[i][1], shapes[i][2], true, &ctx.rng);
+	}
+
+	// and with the default blocks, where one tile covers these
+	ctx.tuning = NULL;
+	__check_shape(37, 53, 29, false, &ctx.rng);
+	__check_shape(37, 53, 29, true, &ctx.rng);
+
+	// empty shapes: nothing to do, and k = 0 leaves beta * target
+	Matrix* a = NULL;
+	Matrix* b = NULL;
+	Matrix* target = NULL;
+	CHECK(mat_init(&a, 0, 5) == UTIL_OK);
+	CHECK(mat_init(&b, 5, 4) == UTIL_OK);
+	CHECK(mat_init(&target, 0, 4) == UTIL_OK);
+	CHECK(mat_gemm(false, false, 1.0f, a, b, 0.0f, &target, NULL) == UTIL_OK);
+	CHECK(mat_gemm(true, true, 1.0f, b, a, 0.0f, &target, NULL) == UTIL_ERROR_DIMENSION);
+	mat_free(&target);
+	mat_free(&b);
+	mat_free(&a);
+
+	CHECK(mat_init(&a, 3, 0) == UTIL_OK);
+	CHECK(mat_init(&b, 0, 4) == UTIL_OK);
+	CHECK(mat_init(&target, 3, 4) == UTIL_OK);
+	mat_fill(&target, 2.0f);
+	CHECK(mat_gemm(false, false, 1.0f, a, b, 0.5f, &target, NULL) == UTIL_OK);
+	for (size_t i = 0; i < 12; ++i)
+		CHECK(target->data[i] == 1.0f);
+	CHECK(mat_reshape(&a, 0, 3) == UTIL_OK);
+	CHECK(mat_reshape(&b, 4, 0) == UTIL_OK);
+	CHECK(mat_gemm_parallel(true, true, 1.0f, a, b, 0.0f, &target, NULL) == UTIL_OK);
+	for (size_t i = 0; i < 12; ++i)
+		CHECK(target->data[i] == 0.0f);
+	mat_free(&target);
+	mat_free(&b);
+	mat_free(&a);
+
+	// mismatched bias
+	a = __random(4, 3, &ctx.rng);
+	b = __random(3, 5, &ctx.rng);
+	CHECK(mat_init(&target, 4, 5) == UTIL_OK);
+	Vector* bias = NULL;
+	CHECK(vec_init(&bias, 4) == UTIL_OK);
+	MatEpilogue epilogue = MAT_EPILOGUE_INIT;
+	epilogue.bias = bias;
+	CHECK(mat_gemm(false, false, 1.0f, a, b, 0.0f, &target, &epilogue) == UTIL_ERROR_DIMENSION);
+	vec_free(&bias);
+	mat_free(&target);
+	mat_free(&b);
+	mat_free(&a);
+
+	util_set_context(NULL);
+
+	return 0;
+}
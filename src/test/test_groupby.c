@@ -0,0 +1,150 @@
+#include <string.h>
+#include "matrix.h"
+#include "util.h"
+#include "test.h"
+
+// mat_groupby_agg (serial and parallel) against a naive linear scan: group order, every aggregate, 0 / -0 and NaN keys,
+// NaN values, and more groups than the table starts out with
+
+#define MAX_GROUPS 4096
+
+typedef struct Reference
+{
+	size_t n_groups;
+	float keys[MAX_GROUPS];
+	double sum[MAX_GROUPS];
+	double min[MAX_GROUPS];
+	double max[MAX_GROUPS];
+	size_t count[MAX_GROUPS];
+} Reference;
+
+static bool __same_key(const float a, const float b)
+{
+	return (a != a && b != b) || a == b; // -0 == 0
+}
+
+// aggregates over column 1
+static void __reference(const Matrix* mat, Reference* ref)
+{
+	ref->n_groups = 0;
+	for (size_t r = 0; r < mat->n_rows; ++r)
+	{
+		const float key = mat->data[r * mat->n_columns];
+		const double value = mat->data[r * mat->n_columns + 1];
+		size_t g = 0;
+		while (g < ref->n_groups && !__same_key(ref->keys[g], key))
+			++g;
+		if (g == ref->n_groups)
+		{
+			CHECK(g < MAX_GROUPS);
+			ref->keys[g] = key;
+			ref->sum[g] = 0.0;
+			ref->min[g] = value;
+			ref->max[g] = value;
+			ref->count[g] = 0;
+			ref->n_groups++;
+		}
+
+		ref->sum[g] += value;
+		ref->count[g]++;
+		// a NaN sticks once it's in
+		if (ref->min[g] == ref->min[g] && (value != value || value < ref->min[g]))
+			ref->min[g] = value;
+		if (ref->max[g] == ref->max[g] && (value != value || value > ref->max[g]))
+			ref->max[g] = value;
+	}
+}
+
+static bool __close(const float x, const double y)
+{
+	if (y != y)
+		return x != x;
+	return fabs(x - y) <= 1e-5 * (1.0 + fabs(y));
+}
+
+static void __check(const Matrix* mat, const bool parallel)
+{
+	static Reference ref;
+	__reference(mat, &ref);
+
+	const MatAgg aggs[] = { { 1, MAT_AGG_SUM }, { 99, MAT_AGG_COUNT }, { 1, MAT_AGG_MEAN }, { 1, MAT_AGG_MIN }, { 1, MAT_AGG_MAX } };
+	Matrix* result = (parallel ? mat_groupby_agg_parallel : mat_groupby_agg)(mat, 0, aggs, 5);
+	CHECK(result);
+	CHECK(result->n_rows == ref.n_groups && result->n_columns == 6);
+
+	for (size_t g = 0; g < ref.n_groups; ++g)
+	{
+		const float* row = &result->data[g * 6];
+		CHECK(__same_key(row[0], ref.keys[g]));
+		CHECK(__close(row[1], ref.sum[g]));
+		CHECK(row[2] == (float)ref.count[g]);
+		CHECK(__close(row[3], ref.sum[g] / ref.count[g]));
+		CHECK(__close(row[4], ref.min[g]));
+		CHECK(__close(row[5], ref.max[g]));
+	}
+
+	mat_free(&result);
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	UtilContext ctx;
+	util_context_init(&ctx);
+	util_rng_seed(&ctx.rng, 36);
+	ctx.n_threads = 4;
+	util_set_context(&ctx);
+
+	MatTuning tuning;
+	mat_get_tuning(&tuning);
+	tuning.parallel_threshold = 1;
+	ctx.tuning = &tuning;
+
+	// few keys, including 0 / -0 and several NaNs, and a value column with a NaN in one group
+	Matrix* mat = NULL;
+	CHECK(mat_init(&mat, 5000, 3) == UTIL_OK);
+	mat_random_r(&mat, -10.0f, 10.0f, &ctx.rng);
+	for (size_t r = 0; r < mat->n_rows; ++r)
+	{
+		const size_t k = util_rng_next(&ctx.rng) % 12;
+		float key = (float)k - 3.0f;
+		if (k == 10)
+			key = -0.0f;
+		else if (k == 11)
+			key = r % 2 ? NAN : -NAN;
+		mat->data[r * 3] = key;
+	}
+	mat->data[4321 * 3 + 1] = NAN;
+	__check(mat, false);
+	__check(mat, true);
+
+	// many distinct keys, so the table has to grow
+	for (size_t r = 0; r < mat->n_rows; ++r)
+		mat->data[r * 3] = (float)(util_rng_next(&ctx.rng) % 3000);
+	__check(mat, false);
+	__check(mat, true);
+
+	// a single row, and no rows at all
+	Matrix* one = mat_subset(mat, 0, 0, 0, 2);
+	CHECK(one && one->n_rows == 1 && one->n_columns == 3);
+	__check(one, false);
+	__check(one, true);
+	mat_free(&one);
+
+	Matrix* empty = NULL;
+	CHECK(mat_init(&empty, 0, 3) == UTIL_OK);
+	__check(empty, false);
+	__check(empty, true);
+	mat_free(&empty);
+
+	// bad arguments
+	const MatAgg bad[] = { { 3, MAT_AGG_SUM } };
+	CHECK(mat_groupby_agg(mat, 3, bad, 0) == NULL && util_last_error() == UTIL_ERROR_ARGUMENT);
+	CHECK(mat_groupby_agg(mat, 0, bad, 1) == NULL && util_last_error() == UTIL_ERROR_ARGUMENT);
+
+	mat_free(&mat);
+	util_set_context(NULL);
+
+	return 0;
+}
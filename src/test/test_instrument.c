@@ -0,0 +1,93 @@
+#include "matrix.h"
+#include "lazy.h"
+#include "util.h"
+#include "instrument.h"
+#include "test.h"
+
+// only the outermost call is recorded (nothing counted twice), early returns still count and sort reports its traffic
+
+static InstrStats __stats(const InstrOp op)
+{
+	InstrSnapshot snapshot;
+	util_instr_snapshot(&snapshot);
+	return snapshot.ops[op];
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	Matrix* a = NULL;
+	Matrix* b = NULL;
+	CHECK(mat_init(&a, 64, 32) == UTIL_OK);
+	CHECK(mat_init(&b, 32, 48) == UTIL_OK);
+	mat_fill(&a, 1.0f);
+	mat_fill(&b, 2.0f);
+
+	// mat_multiply allocates its result with mat_init and runs the gemm kernel: one call, which includes both
+	util_instr_reset();
+	Matrix* product = mat_multiply(a, b);
+	CHECK(product);
+	CHECK(__stats(INSTR_MAT_MULTIPLY).calls == 1);
+	CHECK(__stats(INSTR_MAT_MULTIPLY).flops == 2 * 64 * 32 * 48);
+	CHECK(__stats(INSTR_MAT_MULTIPLY).bytes_allocated >= 64 * 48 * sizeof(float));
+	CHECK(__stats(INSTR_MAT_INIT).calls == 0);
+	CHECK(__stats(INSTR_MAT_GEMM).calls == 0);
+	mat_free(&product);
+
+	// same for the graph: mat_lazy_eval runs mat_gemm internally
+	util_instr_reset();
+	MatGraph* graph = NULL;
+	CHECK(mat_graph_init(&graph) == UTIL_OK);
+	Matrix* lazy = mat_lazy_eval(mat_lazy_multiply(mat_lazy(graph, a), mat_lazy(graph, b)));
+	CHECK(lazy);
+	CHECK(__stats(INSTR_MAT_LAZY_EVAL).calls == 1);
+	CHECK(__stats(INSTR_MAT_GEMM).calls == 0);
+	CHECK(__stats(INSTR_MAT_INIT).calls == 0);
+	mat_free(&lazy);
+	mat_graph_free(&graph);
+
+	// and for the worker threads of a parallel im2col convolution
+	util_get_context()->n_threads = 4;
+	const MatConv2d params = { 64, 64, 5, 5, 1, 2, MAT_CONV_IM2COL };
+	Matrix* image = NULL;
+	Matrix* filters = NULL;
+	Matrix* out = NULL;
+	CHECK(mat_init(&image, 64 * 64, 2) == UTIL_OK);
+	CHECK(mat_init(&filters, 5 * 5 * 2, 8) == UTIL_OK);
+	CHECK(mat_init(&out, 64 * 64, 8) == UTIL_OK);
+	float* workspace = malloc(mat_conv2d_parallel_workspace_size(&params, 2) * sizeof(float));
+	CHECK(workspace);
+	util_instr_reset();
+	CHECK(mat_conv2d_parallel(image, filters, &params, workspace, &out, NULL) == UTIL_OK);
+	CHECK(__stats(INSTR_MAT_CONV2D).calls == 1);
+	CHECK(__stats(INSTR_MAT_GEMM).calls == 0);
+
+	// a call that fails its checks is still a call
+	CHECK(mat_conv2d(image, filters, &params, NULL, &out, NULL) == UTIL_ERROR_ARGUMENT);
+	CHECK(mat_multiply(b, b) == NULL);
+	CHECK(__stats(INSTR_MAT_CONV2D).calls == 2);
+	CHECK(__stats(INSTR_MAT_MULTIPLY).calls == 1);
+	CHECK(mat_gemm(false, false, 1.0f, b, b, 0.0f, &out, NULL) == UTIL_ERROR_DIMENSION);
+	CHECK(mat_add_e(&a, b) == UTIL_ERROR_DIMENSION);
+	CHECK(__stats(INSTR_MAT_GEMM).calls == 1);
+	CHECK(__stats(INSTR_MAT_ADD_E).calls == 1);
+	free(workspace);
+
+	// sorting reads the keys and moves rows
+	util_instr_reset();
+	mat_random(&a, -1.0f, 1.0f);
+	mat_sort(&a, 0, true);
+	CHECK(__stats(INSTR_MAT_SORT).calls == 1);
+	CHECK(__stats(INSTR_MAT_SORT).bytes_moved >= 64 * sizeof(float));
+	for (size_t r = 1; r < a->n_rows; ++r)
+		CHECK(mat_at(a, r - 1, 0) <= mat_at(a, r, 0));
+
+	mat_free(&out);
+	mat_free(&filters);
+	mat_free(&image);
+	mat_free(&b);
+	mat_free(&a);
+
+	return 0;
+}
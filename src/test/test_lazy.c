@@ -0,0 +1,184 @@
+#include "lazy.h"
+#include "vector.h"
+#include "util.h"
+#include "test.h"
+
+// deferred graphs against the same computation done eagerly: transposed operands in every combination, fused
+// element-wise chains (including ones reading other transposed nodes), sums and intermediates used twice
+
+static float __relu(float x, float* argv)
+{
+	(void)argv;
+	return x > 0.0f ? x : 0.0f;
+}
+
+static size_t n_live = 0;
+
+static void* __tracking_alloc(size_t size, void* argv)
+{
+	(void)argv;
+	n_live++;
+	return malloc(size);
+}
+
+static void* __tracking_realloc(void* ptr, size_t size, void* argv)
+{
+	(void)argv;
+	if (!ptr)
+		n_live++;
+	return realloc(ptr, size);
+}
+
+static void __tracking_dealloc(void* ptr, void* argv)
+{
+	(void)argv;
+	n_live--;
+	free(ptr);
+}
+
+static Matrix* __random(const size_t n_rows, const size_t n_columns, UtilRng* rng)
+{
+	Matrix* mat = NULL;
+	CHECK(mat_init(&mat, n_rows, n_columns) == UTIL_OK);
+	mat_random_r(&mat, -1.0f, 1.0f, rng);
+	return mat;
+}
+
+// relu(2 * op(a) x op(b) + c - d^T) both lazily and eagerly, for every combination of stored transposes
+static void __check_fused(const size_t m, const size_t k, const size_t n, UtilRng* rng)
+{
+	for (int trans = 0; trans < 4; ++trans)
+	{
+		const bool trans_a = trans & 1, trans_b = trans & 2;
+		Matrix* a = trans_a ? __random(k, m, rng) : __random(m, k, rng);
+		Matrix* b = trans_b ? __random(n, k, rng) : __random(k, n, rng);
+		Matrix* c = __random(m, n, rng);
+		Matrix* d = __random(n, m, rng);
+
+		MatGraph* graph = NULL;
+		CHECK(mat_graph_init(&graph) == UTIL_OK);
+		MatNode* node_a = mat_lazy(graph, a);
+		MatNode* node_b = mat_lazy(graph, b);
+		if (trans_a)
+			node_a = mat_lazy_transpose(node_a);
+		if (trans_b)
+			node_b = mat_lazy_transpose(node_b);
+		MatNode* product = mat_lazy_multiply(node_a, node_b);
+		MatNode* result = mat_lazy_apply(mat_lazy_subtract_e(mat_lazy_add_e(mat_lazy_multiply_s(product, 2.0f), mat_lazy(graph, c)), mat_lazy_transpose(mat_lazy(graph, d))), __relu, NULL);
+		CHECK(result);
+
+		Matrix* lazy = mat_lazy_eval(result);
+		CHECK(lazy);
+		const float lazy_sum = mat_lazy_sum(result);
+
+		// eager
+		Matrix* eager_a = trans_a ? mat_transpose(a) : mat_copy(a);
+		Matrix* eager_b = trans_b ? mat_transpose(b) : mat_copy(b);
+		Matrix* eager = mat_multiply(eager_a, eager_b);
+		Matrix* d_t = mat_transpose(d);
+		mat_multiply_s(&eager, 2.0f);
+		mat_add_e(&eager, c);
+		mat_subtract_e(&eager, d_t);
+		mat_apply(&eager, __relu, NULL);
+
+		CHECK(test_relative_error(lazy->data, eager->data, m * n) < 1e-5f);
+		double eager_sum = 0.0;
+		for (size_t i = 0; i < m * n; ++i)
+			eager_sum += eager->data[i];
+		CHECK(fabs(lazy_sum - eager_sum) <= 1e-4 * (fabs(eager_sum) + m * n));
+
+		mat_free(&d_t);
+		mat_free(&eager);
+		mat_free(&eager_b);
+		mat_free(&eager_a);
+		mat_free(&lazy);
+		mat_graph_free(&graph);
+		mat_free(&d);
+		mat_free(&c);
+		mat_free(&b);
+		mat_free(&a);
+	}
+}
+
+// (a x b) is consumed twice, so it has to be materialized once and both consumers must see the same values
+static void __check_shared(UtilRng* rng)
+{
+	Matrix* a = __random(40, 30, rng);
+	Matrix* b = __random(30, 40, rng);
+
+	MatGraph* graph = NULL;
+	CHECK(mat_graph_init(&graph) == UTIL_OK);
+	MatNode* product = mat_lazy_multiply(mat_lazy(graph, a), mat_lazy(graph, b));
+	MatNode* result = mat_lazy_multiply(product, mat_lazy_transpose(product));
+	CHECK(result);
+
+	Matrix* lazy = mat_lazy_eval(result);
+	CHECK(lazy);
+	Matrix* p = mat_multiply(a, b);
+	Matrix* p_t = mat_transpose(p);
+	Matrix* eager = mat_multiply(p, p_t);
+	CHECK(test_relative_error(lazy->data, eager->data, 40 * 40) < 1e-5f);
+
+	// evaluating again reuses the pooled buffers and gives the same result
+	Matrix* again = mat_lazy_eval(result);
+	CHECK(again);
+	CHECK(memcmp(again->data, lazy->data, 40 * 40 * sizeof(float)) == 0);
+
+	mat_free(&again);
+	mat_free(&eager);
+	mat_free(&p_t);
+	mat_free(&p);
+	mat_free(&lazy);
+	mat_graph_free(&graph);
+	mat_free(&b);
+	mat_free(&a);
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	// everything, including the graph's internals, goes through this allocator and is handed back
+	UtilContext ctx;
+	util_context_init(&ctx);
+	util_rng_seed(&ctx.rng, 27);
+	ctx.alloc = __tracking_alloc;
+	ctx.realloc = __tracking_realloc;
+	ctx.dealloc = __tracking_dealloc;
+	util_set_context(&ctx);
+
+	__check_fused(37, 53, 29, &ctx.rng);
+	__check_fused(130, 70, 260, &ctx.rng);
+	__check_fused(1, 300, 1, &ctx.rng);
+	__check_shared(&ctx.rng);
+
+	// a failed builder makes every node built on top of it NULL, and evaluation reports it
+	MatGraph* graph = NULL;
+	CHECK(mat_graph_init(&graph) == UTIL_OK);
+	Matrix* a = __random(3, 4, &ctx.rng);
+	MatNode* bad = mat_lazy_multiply(mat_lazy(graph, a), mat_lazy(graph, a));
+	CHECK(bad == NULL && util_last_error() == UTIL_ERROR_DIMENSION);
+	CHECK(mat_lazy_eval(mat_lazy_add_s(bad, 1.0f)) == NULL);
+	CHECK(isnan(mat_lazy_sum(bad)));
+	util_clear_error();
+	CHECK(mat_lazy_eval(bad) == NULL && util_last_error() == UTIL_ERROR_ARGUMENT);
+
+	// a NULL graph, and nodes from two different graphs
+	util_clear_error();
+	CHECK(mat_lazy(NULL, a) == NULL && util_last_error() == UTIL_ERROR_ARGUMENT);
+	MatGraph* other = NULL;
+	CHECK(mat_graph_init(&other) == UTIL_OK);
+	util_clear_error();
+	CHECK(mat_lazy_add_e(mat_lazy(graph, a), mat_lazy(other, a)) == NULL && util_last_error() == UTIL_ERROR_ARGUMENT);
+	util_clear_error();
+	CHECK(mat_lazy_multiply(mat_lazy(graph, a), mat_lazy_transpose(mat_lazy(other, a))) == NULL && util_last_error() == UTIL_ERROR_ARGUMENT);
+	mat_graph_free(&other);
+
+	mat_free(&a);
+	mat_graph_free(&graph);
+
+	CHECK(n_live == 0);
+	util_set_context(NULL);
+
+	return 0;
+}
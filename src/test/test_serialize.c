@@ -0,0 +1,169 @@
+#include <string.h>
+#include <unistd.h>
+#include "matrix.h"
+#include "util.h"
+#include "test.h"
+
+// round trips through memory and file descriptors with both codecs (bit for bit, NaNs included), several matrices per
+// stream, and truncated / corrupt streams, which must fail (and leave a pre-allocated target alone while the header is incomplete)
+
+#define SERIAL_HEADER_SIZE 32
+
+static const MatCodec codecs[] = { MAT_CODEC_RAW, MAT_CODEC_SHUFFLE_RLE };
+
+static Matrix* __sample(const size_t n_rows, const size_t n_columns, const bool sparse, UtilRng* rng)
+{
+	Matrix* mat = NULL;
+	CHECK(mat_init(&mat, n_rows, n_columns) == UTIL_OK);
+	mat_random_r(&mat, -1.0f, 1.0f, rng);
+	for (size_t i = 0; i < n_rows * n_columns; ++i)
+		if (sparse && i % 17 != 0)
+			mat->data[i] = 0.0f;
+	if (n_rows * n_columns > 3)
+		mat->data[3] = NAN;
+	return mat;
+}
+
+static bool __same(const Matrix* a, const Matrix* b)
+{
+	return a->n_rows == b->n_rows && a->n_columns == b->n_columns
+		&& (a->n_rows * a->n_columns == 0 || memcmp(a->data, b->data, a->n_rows * a->n_columns * sizeof(float)) == 0);
+}
+
+// a file descriptor holding exactly these bytes, positioned at the start
+static int __fd_with(const void* bytes, const size_t size)
+{
+	FILE* f = tmpfile();
+	CHECK(f);
+	const int fd = dup(fileno(f));
+	fclose(f);
+	CHECK(fd >= 0);
+	CHECK(size == 0 || write(fd, bytes, size) == (ssize_t)size);
+	CHECK(lseek(fd, 0, SEEK_SET) == 0);
+	return fd;
+}
+
+static void __check_round_trip(const Matrix* mat, const MatCodec codec)
+{
+	const size_t bound = mat_write_bound(mat, codec);
+	unsigned char* buffer = malloc(bound);
+	CHECK(buffer);
+	size_t written = 0;
+	CHECK(mat_write_buffer(mat, codec, buffer, bound, &written) == UTIL_OK);
+	CHECK(written <= bound);
+	if (written > 0)
+		CHECK(mat_write_buffer(mat, codec, buffer, written - 1, NULL) == UTIL_ERROR_ARGUMENT);
+
+	// from memory, into a new matrix and into a pre-allocated one
+	Matrix* read = NULL;
+	size_t consumed = 0;
+	CHECK(mat_read_buffer(buffer, written, &read, &consumed) == UTIL_OK);
+	CHECK(consumed == written && __same(read, mat));
+	mat_fill(&read, 7.0f);
+	CHECK(mat_read_buffer(buffer, written, &read, NULL) == UTIL_OK);
+	CHECK(__same(read, mat));
+	mat_free(&read);
+
+	// through a file descriptor, which must produce the same bytes
+	int fd = __fd_with(NULL, 0);
+	CHECK(mat_write(mat, codec, fd) == UTIL_OK);
+	CHECK(lseek(fd, 0, SEEK_CUR) == (off_t)written);
+	CHECK(lseek(fd, 0, SEEK_SET) == 0);
+	CHECK(mat_read(fd, &read) == UTIL_OK);
+	CHECK(__same(read, mat));
+	mat_free(&read);
+	close(fd);
+
+	// every truncation fails, a pre-allocated target is only written once the header is complete
+	Matrix* target = NULL;
+	CHECK(mat_init(&target, mat->n_rows, mat->n_columns) == UTIL_OK);
+	mat_fill(&target, 7.0f);
+	Matrix* sevens = mat_copy(target);
+	for (size_t cut = 0; cut < written; cut += 1 + written / 50)
+	{
+		CHECK(mat_read_buffer(buffer, cut, &target, NULL) == UTIL_ERROR_FORMAT);
+		CHECK(cut >= SERIAL_HEADER_SIZE || __same(target, sevens));
+
+		fd = __fd_with(buffer, cut);
+		CHECK(mat_read(fd, &target) == UTIL_ERROR_FORMAT);
+		CHECK(cut >= SERIAL_HEADER_SIZE || __same(target, sevens));
+		close(fd);
+
+		Matrix* fresh = NULL;
+		CHECK(mat_read_buffer(buffer, cut, &fresh, NULL) == UTIL_ERROR_FORMAT);
+		CHECK(fresh == NULL);
+	}
+
+	mat_free(&sevens);
+	mat_free(&target);
+	free(buffer);
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	UtilRng rng;
+	util_rng_seed(&rng, 39);
+
+	const size_t shapes[][2] = { { 37, 53 }, { 300, 200 }, { 1, 1 }, { 0, 5 }, { 0, 0 } };
+	for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); ++i)
+		for (int sparse = 0; sparse < 2; ++sparse)
+		{
+			Matrix* mat = __sample(shapes[i][0], shapes[i][1], sparse, &rng);
+			for (size_t c = 0; c < 2; ++c)
+				__check_round_trip(mat, codecs[c]);
+			mat_free(&mat);
+		}
+
+	// sparse data compresses, random data costs at most ~1% over raw
+	Matrix* sparse = __sample(300, 200, true, &rng);
+	Matrix* dense = __sample(300, 200, false, &rng);
+	const size_t raw = mat_write_bound(dense, MAT_CODEC_RAW);
+	unsigned char* buffer = malloc(mat_write_bound(dense, MAT_CODEC_SHUFFLE_RLE));
+	CHECK(buffer);
+	size_t written = 0;
+	CHECK(mat_write_buffer(sparse, MAT_CODEC_SHUFFLE_RLE, buffer, mat_write_bound(sparse, MAT_CODEC_SHUFFLE_RLE), &written) == UTIL_OK);
+	CHECK(written < raw / 4);
+	CHECK(mat_write_buffer(dense, MAT_CODEC_SHUFFLE_RLE, buffer, mat_write_bound(dense, MAT_CODEC_SHUFFLE_RLE), &written) == UTIL_OK);
+	CHECK(written <= raw + raw / 100);
+
+	// a flipped byte in the payload is caught
+	buffer[40] ^= 0xff;
+	Matrix* read = NULL;
+	CHECK(mat_read_buffer(buffer, written, &read, NULL) == UTIL_ERROR_FORMAT);
+	CHECK(read == NULL);
+	CHECK(mat_read_buffer("NOPE", 4, &read, NULL) == UTIL_ERROR_FORMAT);
+	free(buffer);
+
+	// several matrices back to back in one stream, then the end of the stream
+	int fd = __fd_with(NULL, 0);
+	CHECK(mat_write(sparse, MAT_CODEC_SHUFFLE_RLE, fd) == UTIL_OK);
+	CHECK(mat_write(dense, MAT_CODEC_RAW, fd) == UTIL_OK);
+	CHECK(mat_write(sparse, MAT_CODEC_RAW, fd) == UTIL_OK);
+	CHECK(lseek(fd, 0, SEEK_SET) == 0);
+	const Matrix* expected[] = { sparse, dense, sparse };
+	for (size_t i = 0; i < 3; ++i)
+	{
+		CHECK(mat_read(fd, &read) == UTIL_OK);
+		CHECK(__same(read, expected[i]));
+		mat_free(&read);
+	}
+	CHECK(mat_read(fd, &read) == UTIL_ERROR_FORMAT);
+	close(fd);
+
+	// a pre-allocated target of the wrong shape
+	Matrix* wrong = NULL;
+	CHECK(mat_init(&wrong, 2, 2) == UTIL_OK);
+	fd = __fd_with(NULL, 0);
+	CHECK(mat_write(dense, MAT_CODEC_RAW, fd) == UTIL_OK);
+	CHECK(lseek(fd, 0, SEEK_SET) == 0);
+	CHECK(mat_read(fd, &wrong) == UTIL_ERROR_DIMENSION);
+	close(fd);
+
+	mat_free(&wrong);
+	mat_free(&dense);
+	mat_free(&sparse);
+
+	return 0;
+}
@@ -0,0 +1,205 @@
+#include <string.h>
+#include "matrix.h"
+#include "solver.h"
+#include "util.h"
+#include "test.h"
+
+// CG and LSQR on systems with a known answer: an SPD tridiagonal system (CSR and dense, serial and parallel),
+// consistent and inconsistent least squares and ridge regression against the normal equations solved in double
+
+#define N 200
+#define ROWS 300
+#define COLS 40
+
+static double __norm_diff(const float* x, const double* y, const size_t n, double* y_norm)
+{
+	double diff = 0.0, norm = 0.0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		diff += (x[i] - y[i]) * (x[i] - y[i]);
+		norm += y[i] * y[i];
+	}
+	*y_norm = sqrt(norm);
+	return sqrt(diff);
+}
+
+static bool __close(const float* x, const double* y, const size_t n, const double tolerance)
+{
+	double y_norm;
+	const double diff = __norm_diff(x, y, n, &y_norm);
+	return diff <= tolerance * y_norm;
+}
+
+// solve (A^T A + damping^2 I) x = A^T b in double with gaussian elimination
+static void __normal_equations(const Matrix* a, const float* b, const double damping, double* x)
+{
+	const size_t n = a->n_columns;
+	double* m = calloc(n * (n + 1), sizeof(double));
+	CHECK(m);
+	for (size_t i = 0; i < n; ++i)
+	{
+		for (size_t j = 0; j < n; ++j)
+			for (size_t r = 0; r < a->n_rows; ++r)
+				m[i * (n + 1) + j] += (double)a->data[r * n + i] * a->data[r * n + j];
+		m[i * (n + 1) + i] += damping * damping;
+		for (size_t r = 0; r < a->n_rows; ++r)
+			m[i * (n + 1) + n] += (double)a->data[r * n + i] * b[r];
+	}
+
+	for (size_t p = 0; p < n; ++p)
+		for (size_t i = p + 1; i < n; ++i)
+		{
+			const double f = m[i * (n + 1) + p] / m[p * (n + 1) + p];
+			for (size_t j = p; j <= n; ++j)
+				m[i * (n + 1) + j] -= f * m[p * (n + 1) + j];
+		}
+	for (size_t i = n; i-- > 0;)
+	{
+		double sum = m[i * (n + 1) + n];
+		for (size_t j = i + 1; j < n; ++j)
+			sum -= m[i * (n + 1) + j] * x[j];
+		x[i] = sum / m[i * (n + 1) + i];
+	}
+
+	free(m);
+}
+
+static void __check_cg(UtilRng* rng)
+{
+	// tridiagonal SPD: 2.5 on the diagonal, -1 next to it
+	size_t row_ptr[N + 1];
+	size_t col_idx[3 * N];
+	float values[3 * N];
+	Matrix* dense = NULL;
+	CHECK(mat_init(&dense, N, N) == UTIL_OK);
+	size_t nnz = 0;
+	for (size_t r = 0; r < N; ++r)
+	{
+		row_ptr[r] = nnz;
+		for (size_t c = r > 0 ? r - 1 : 0; c <= r + 1 && c < N; ++c)
+		{
+			col_idx[nnz] = c;
+			values[nnz] = c == r ? 2.5f : -1.0f;
+			dense->data[r * N + c] = values[nnz];
+			nnz++;
+		}
+	}
+	row_ptr[N] = nnz;
+	const MatCsr csr = { N, N, row_ptr, col_idx, values };
+
+	double x_true[N];
+	float x_float[N], b[N];
+	for (size_t i = 0; i < N; ++i)
+	{
+		x_true[i] = util_rand_between_r(rng, -1.0f, 1.0f);
+		x_float[i] = (float)x_true[i];
+	}
+
+	const MatOperator ops[] = { mat_operator_csr(&csr), mat_operator_csr_parallel(&csr), mat_operator_dense(dense), mat_operator_dense_parallel(dense) };
+	ops[0].apply(x_float, b, false, ops[0].argv);
+
+	float* workspace = malloc(mat_cg_workspace_size(&ops[0]) * sizeof(float));
+	CHECK(workspace);
+	for (size_t o = 0; o < 4; ++o)
+	{
+		float x[N] = { 0 };
+		MatSolverResult result;
+		CHECK((o % 2 ? mat_cg_parallel : mat_cg)(&ops[o], b, x, NULL, o < 2 ? workspace : NULL, &result) == UTIL_OK);
+		CHECK(result.converged && result.iterations > 0 && result.iterations <= N);
+		CHECK(__close(x, x_true, N, 1e-4));
+	}
+
+	// running out of iterations isn't an error
+	float x[N] = { 0 };
+	MatSolverResult result;
+	const MatSolverOptions short_run = { 2, 0.0f, 0.0f };
+	CHECK(mat_cg(&ops[0], b, x, &short_run, workspace, &result) == UTIL_OK);
+	CHECK(!result.converged && result.iterations == 2);
+
+	// negative definite: caught on the first step
+	for (size_t i = 0; i < 3 * N; ++i)
+		values[i] = -values[i];
+	memset(x, 0, sizeof(x));
+	CHECK(mat_cg(&ops[0], b, x, NULL, workspace, NULL) == UTIL_ERROR_ARGUMENT);
+
+	free(workspace);
+	mat_free(&dense);
+}
+
+static void __check_lsqr(UtilRng* rng)
+{
+	Matrix* a = NULL;
+	CHECK(mat_init(&a, ROWS, COLS) == UTIL_OK);
+	mat_random_r(&a, -1.0f, 1.0f, rng);
+	const MatOperator op = mat_operator_dense(a);
+	const MatOperator op_parallel = mat_operator_dense_parallel(a);
+
+	// consistent: b = A x_true exactly (up to rounding)
+	float x_float[COLS], b[ROWS];
+	double x_true[COLS];
+	for (size_t i = 0; i < COLS; ++i)
+	{
+		x_true[i] = util_rand_between_r(rng, -1.0f, 1.0f);
+		x_float[i] = (float)x_true[i];
+	}
+	op.apply(x_float, b, false, op.argv);
+
+	float x[COLS] = { 0 };
+	MatSolverResult result;
+	CHECK(mat_lsqr(&op, b, x, NULL, NULL, &result) == UTIL_OK);
+	CHECK(result.converged);
+	CHECK(__close(x, x_true, COLS, 1e-4));
+
+	// inconsistent: random b, compared against the normal equations
+	for (size_t i = 0; i < ROWS; ++i)
+		b[i] = util_rand_between_r(rng, -1.0f, 1.0f);
+	double expected[COLS];
+	__normal_equations(a, b, 0.0, expected);
+	memset(x, 0, sizeof(x));
+	CHECK(mat_lsqr_parallel(&op_parallel, b, x, NULL, NULL, &result) == UTIL_OK);
+	CHECK(result.converged);
+	CHECK(__close(x, expected, COLS, 1e-3));
+
+	// ridge regression
+	const MatSolverOptions ridge = { 0, 1e-6f, 3.0f };
+	__normal_equations(a, b, 3.0, expected);
+	memset(x, 0, sizeof(x));
+	CHECK(mat_lsqr(&op, b, x, &ridge, NULL, &result) == UTIL_OK);
+	CHECK(result.converged);
+	CHECK(__close(x, expected, COLS, 1e-4));
+
+	// a damping that isn't a finite, non-negative number is rejected before anything is computed
+	const MatSolverOptions bad_damping[] = { { 0, 0.0f, -1.0f }, { 0, 0.0f, NAN }, { 0, 0.0f, INFINITY } };
+	for (size_t i = 0; i < 3; ++i)
+	{
+		memset(x, 0, sizeof(x));
+		CHECK(mat_lsqr(&op, b, x, &bad_damping[i], NULL, NULL) == UTIL_ERROR_ARGUMENT);
+		CHECK(x[0] == 0.0f);
+	}
+
+	mat_free(&a);
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	UtilContext ctx;
+	util_context_init(&ctx);
+	util_rng_seed(&ctx.rng, 40);
+	ctx.n_threads = 4;
+	util_set_context(&ctx);
+
+	// no parallel threshold, so the parallel variants really use threads
+	MatTuning tuning;
+	mat_get_tuning(&tuning);
+	tuning.parallel_threshold = 1;
+	ctx.tuning = &tuning;
+
+	__check_cg(&ctx.rng);
+	__check_lsqr(&ctx.rng);
+
+	util_set_context(NULL);
+
+	return 0;
+}
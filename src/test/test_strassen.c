@@ -0,0 +1,105 @@
+#include "matrix.h"
+#include "util.h"
+#include "test.h"
+
+// the Strassen-Winograd path against the classic kernel and a double-precision reference, across cutoffs and
+// shapes which are powers of two, odd after a few levels (so the recursion stops early) and not square
+
+typedef struct Shape
+{
+	size_t m;
+	size_t k;
+	size_t n;
+} Shape;
+
+static void __check_shape(const Shape* shape, const size_t cutoff, UtilRng* rng)
+{
+	Matrix* a = NULL;
+	Matrix* b = NULL;
+	CHECK(mat_init(&a, shape->m, shape->k) == UTIL_OK);
+	CHECK(mat_init(&b, shape->k, shape->n) == UTIL_OK);
+	mat_random_r(&a, -1.0f, 1.0f, rng);
+	mat_random_r(&b, -1.0f, 1.0f, rng);
+
+	const size_t n_elem = shape->m * shape->n;
+	float* reference = malloc(n_elem * sizeof(float));
+	CHECK(reference);
+	test_reference_multiply(a->data, b->data, reference, shape->m, shape->n, shape->k);
+
+	mat_set_strassen_cutoff(0);
+	Matrix* classic = mat_multiply(a, b);
+	CHECK(classic);
+
+	mat_set_strassen_cutoff(cutoff);
+	Matrix* strassen = mat_multiply(a, b);
+	Matrix* strassen_parallel = mat_multiply_parallel(a, b);
+	Matrix* inplace = NULL;
+	CHECK(mat_init(&inplace, shape->m, shape->n) == UTIL_OK);
+	CHECK(mat_multiply_inplace(a, b, &inplace) == UTIL_OK);
+	CHECK(strassen && strassen_parallel);
+
+	// each level adds a few roundings, so the bound is looser than for the classic kernel but still far below what a wrong quadrant would give
+	CHECK(test_relative_error(classic->data, reference, n_elem) < 1e-5f);
+	CHECK(test_relative_error(strassen->data, reference, n_elem) < 1e-4f);
+	CHECK(test_relative_error(strassen_parallel->data, reference, n_elem) < 1e-4f);
+	CHECK(test_relative_error(inplace->data, strassen->data, n_elem) == 0.0f);
+
+	// every dimension is above the cutoff and even, so at least one level of the recursion must have run
+	if (shape->m > cutoff && shape->n > cutoff && shape->k > cutoff && shape->m % 2 == 0 && shape->n % 2 == 0 && shape->k % 2 == 0)
+		CHECK(memcmp(strassen->data, classic->data, n_elem * sizeof(float)) != 0);
+
+	mat_set_strassen_cutoff(0);
+	free(reference);
+	mat_free(&inplace);
+	mat_free(&strassen_parallel);
+	mat_free(&strassen);
+	mat_free(&classic);
+	mat_free(&b);
+	mat_free(&a);
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	UtilRng rng;
+	util_rng_seed(&rng, 29);
+
+	const Shape shapes[] = {
+		{ 256, 256, 256 },
+		{ 200, 96, 320 },
+		{ 130, 66, 258 },
+		{ 512, 512, 512 },
+		{ 64, 64, 64 },
+		{ 3, 500, 7 }
+	};
+	const size_t cutoffs[] = { 16, 32, 64 };
+
+	for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); ++s)
+		for (size_t c = 0; c < sizeof(cutoffs) / sizeof(cutoffs[0]); ++c)
+			__check_shape(&shapes[s], cutoffs[c], &rng);
+
+	// a cutoff of 1 would recurse down to 1x1 blocks, rejected just like in mat_set_tuning
+	CHECK(mat_set_strassen_cutoff(48) == UTIL_OK);
+	CHECK(mat_set_strassen_cutoff(1) == UTIL_ERROR_ARGUMENT);
+	CHECK(mat_get_strassen_cutoff() == 48);
+
+	// the getter reads back the process-wide value even while a context tuning overrides it for this thread
+	UtilContext ctx;
+	util_context_init(&ctx);
+	MatTuning tuning;
+	mat_get_tuning(&tuning);
+	tuning.strassen_cutoff = 0;
+	ctx.tuning = &tuning;
+	util_set_context(&ctx);
+	CHECK(mat_set_strassen_cutoff(64) == UTIL_OK);
+	CHECK(mat_get_strassen_cutoff() == 64);
+	MatTuning effective;
+	mat_get_tuning(&effective);
+	CHECK(effective.strassen_cutoff == 0);
+	util_set_context(NULL);
+
+	CHECK(mat_set_strassen_cutoff(0) == UTIL_OK);
+
+	return 0;
+}
@@ -0,0 +1,122 @@
+#include <pthread.h>
+#include "matrix.h"
+#include "util.h"
+#include "test.h"
+
+// several threads multiply, draw random numbers and raise errors while another one keeps changing the
+// process-wide tuning and error handler underneath them. every product is checked against a reference,
+// so a kernel mixing up two tunings mid-multiply (e.g., a Strassen workspace sized for one cutoff and
+// recursed with another) fails here, and the ThreadSanitizer build reports any unsynchronized access.
+
+#define N_WORKERS 4
+#define N_ITERATIONS 16
+#define SIZE 128
+
+static volatile int stop = 0;
+
+static void __count_errors(const UtilStatus status, const char* msg, void* argv)
+{
+	(void)status;
+	(void)msg;
+	__atomic_add_fetch((size_t*)argv, 1, __ATOMIC_RELAXED);
+}
+
+static size_t n_handled = 0;
+
+static void* __worker(void* argv)
+{
+	const size_t id = (size_t)argv;
+
+	// a private context with a fixed seed: the draws must only depend on this thread's generator
+	UtilContext ctx;
+	util_context_init(&ctx);
+	util_rng_seed(&ctx.rng, 1000 + id);
+	util_set_context(&ctx);
+
+	UtilRng expected;
+	util_rng_seed(&expected, 1000 + id);
+
+	Matrix* a = NULL;
+	Matrix* b = NULL;
+	Matrix* wrong = NULL;
+	CHECK(mat_init(&a, SIZE, SIZE) == UTIL_OK);
+	CHECK(mat_init(&b, SIZE, SIZE) == UTIL_OK);
+	CHECK(mat_init(&wrong, SIZE + 1, SIZE) == UTIL_OK);
+	float* reference = malloc(SIZE * SIZE * sizeof(float));
+	CHECK(reference);
+
+	for (size_t it = 0; it < N_ITERATIONS; ++it)
+	{
+		mat_random(&a, -1.0f, 1.0f);
+		mat_random(&b, -1.0f, 1.0f);
+		for (size_t i = 0; i < SIZE * SIZE; ++i)
+			CHECK(a->data[i] == util_rand_between_r(&expected, -1.0f, 1.0f));
+		for (size_t i = 0; i < SIZE * SIZE; ++i)
+			CHECK(b->data[i] == util_rand_between_r(&expected, -1.0f, 1.0f));
+
+		Matrix* c = mat_multiply(a, b);
+		CHECK(c);
+		test_reference_multiply(a->data, b->data, reference, SIZE, SIZE, SIZE);
+		CHECK(test_relative_error(c->data, reference, SIZE * SIZE) < 1e-4f);
+		mat_free(&c);
+
+		// the error has to land on this thread, whichever handler is installed right now
+		util_clear_error();
+		CHECK(mat_multiply(a, wrong) == NULL);
+		CHECK(util_last_error() == UTIL_ERROR_DIMENSION);
+	}
+
+	free(reference);
+	mat_free(&wrong);
+	mat_free(&b);
+	mat_free(&a);
+	util_set_context(NULL);
+
+	return NULL;
+}
+
+static void* __tuner(void* argv)
+{
+	(void)argv;
+	const size_t cutoffs[] = { 0, 16, 64, 32, 0, 8 };
+	const size_t blocks[] = { 16, 64, 32, 128 };
+
+	MatTuning tuning;
+	mat_get_tuning(&tuning);
+
+	for (size_t i = 0; !__atomic_load_n(&stop, __ATOMIC_RELAXED); ++i)
+	{
+		mat_set_strassen_cutoff(cutoffs[i % (sizeof(cutoffs) / sizeof(cutoffs[0]))]);
+
+		tuning.gemm_block_rows = blocks[i % 4];
+		tuning.gemm_block_columns = blocks[(i + 1) % 4];
+		tuning.gemm_block_k = blocks[(i + 2) % 4];
+		tuning.transpose_block = blocks[(i + 3) % 4];
+		tuning.strassen_cutoff = cutoffs[(i + 3) % (sizeof(cutoffs) / sizeof(cutoffs[0]))];
+		CHECK(mat_set_tuning(&tuning) == UTIL_OK);
+
+		// replaced handlers are never free'd, so only swap them every now and then
+		if (i % 64 == 0)
+			util_set_error_handler(i % 128 == 0 ? util_error_return : __count_errors, &n_handled);
+	}
+
+	return NULL;
+}
+
+int main(void)
+{
+	util_set_error_handler(util_error_return, NULL);
+
+	pthread_t tuner;
+	pthread_t workers[N_WORKERS];
+	CHECK(pthread_create(&tuner, NULL, __tuner, NULL) == 0);
+	for (size_t i = 0; i < N_WORKERS; ++i)
+		CHECK(pthread_create(&workers[i], NULL, __worker, (void*)i) == 0);
+
+	for (size_t i = 0; i < N_WORKERS; ++i)
+		CHECK(pthread_join(workers[i], NULL) == 0);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	CHECK(pthread_join(tuner, NULL) == 0);
+
+	return 0;
+}